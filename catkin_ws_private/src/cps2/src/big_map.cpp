@@ -0,0 +1,119 @@
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <ros/package.h>
+#include "big_map.hpp"
+
+namespace cps2 {
+
+BigMap::BigMap(cps2::ImageEvaluator *_image_evaluator, const MapSettings &settings)
+    : Map(_image_evaluator, settings)
+{
+  const std::string path_img   = ros::package::getPath("cps2") + "/config/map.png";
+  const std::string path_tiles = ros::package::getPath("cps2") + "/config/map.tiles";
+  struct stat st_img, st_tiles;
+
+  // (re)build the tiles whenever map.png is newer
+  if(stat(path_img.c_str(), &st_img) == 0
+      && (stat(path_tiles.c_str(), &st_tiles) != 0 || st_tiles.st_mtime < st_img.st_mtime) )
+  {
+    ROS_INFO("Map: building tiles of %s, this may take a while", path_img.c_str() );
+    TiledMap::build(path_img, path_tiles);
+  }
+
+  if(!tiled_map.open(path_tiles, image_evaluator->getResizeScale() ) )
+    ROS_ERROR("Map file not found: %s", path_img.c_str() );
+
+  dim_map = cv::Point2i(tiled_map.size().width / 2, tiled_map.size().height / 2);
+
+  // the big map is aligned with the world frame
+  const TiledMapHeader &header = tiled_map.getHeader();
+
+  if(header.orientation_confidence >= ORIENTATION_MIN_CONFIDENCE) {
+    work.ceiling_cos = header.orientation_confidence * cosf(4 * header.orientation_angle);
+    work.ceiling_sin = header.orientation_confidence * sinf(4 * header.orientation_angle);
+  }
+
+  publish();
+  state = std::atomic_load(&published);
+}
+
+std::vector<cv::Mat> BigMap::get_map_pieces(const cv::Point3f &pos_world) {
+  std::vector<cv::Mat> map_piece_images;
+
+  if(!ready || !tiled_map.is_open() )
+    return map_piece_images;
+
+  cv::Point2i pos_img = camera_matrix.relative2image(cv::Point2f(pos_world.x, pos_world.y) );
+  cv::Mat map_piece   = tiled_map.transform(pos_img + dim_map - dim_img, pos_world.z,
+      2 * dim_img.y, 2 * dim_img.x);
+
+  map_piece_images.push_back(map_piece);
+  return map_piece_images;
+}
+
+cv::Mat BigMap::get_map_area(const cv::Point2f &center_world, const int rows, const int cols) {
+  const int resize_scale = image_evaluator->getResizeScale();
+
+  if(!ready || !tiled_map.is_open() )
+    return cv::Mat::zeros(rows / resize_scale, cols / resize_scale, CV_8UC1);
+
+  cv::Point2i pos_img = camera_matrix.relative2image(center_world);
+
+  return tiled_map.transform(pos_img + dim_map - dim_img, 0, rows, cols);
+}
+
+void BigMap::prefetch(const cv::Rect2f &area_world) {
+  if(!ready)
+    return;
+
+  const cv::Point2i a = camera_matrix.relative2image(cv::Point2f(area_world.x, area_world.y) )
+      + dim_map - dim_img;
+  const cv::Point2i b = camera_matrix.relative2image(cv::Point2f(
+      area_world.x + area_world.width, area_world.y + area_world.height) ) + dim_map - dim_img;
+
+  // lookups read up to half an image diagonal around their center
+  const float margin = sqrtf(dim_img.x * dim_img.x + dim_img.y * dim_img.y);
+
+  tiled_map.prefetch(cv::Rect2f(
+      std::min(a.x, b.x) - margin, std::min(a.y, b.y) - margin,
+      abs(b.x - a.x) + 2 * margin, abs(b.y - a.y) + 2 * margin) );
+}
+
+void BigMap::update(const cv::Mat &image, const Particle &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &_camera_matrix) {
+  // update camera_matrix (with respect to auto-calibration, dynamic height, etc.)
+  camera_matrix = _camera_matrix;
+
+  // initialization (first call to update)
+  if(ready)
+    return;
+
+  ready   = true;
+  dim_img = cv::Point2i(image.cols / 2, image.rows / 2);
+
+  // camera_matrix is for fixed size images - to project the upperleft corner
+  // of the map (usually (0, 0) ), shift by the difference of dimensions (a
+  // bit hacky, but least complex)
+  cv::Point2i upperleft_corner = dim_img - dim_map;
+  cv::Point2f c_rel = camera_matrix.image2relative(upperleft_corner);
+  cv::Point2f c_abs = cv::Point2f(fabs(c_rel.x), fabs(c_rel.y) );
+
+  bbox.x      = -0.95 * c_abs.x;
+  bbox.y      = -0.95 * c_abs.y;
+  bbox.width  =   1.9 * c_abs.x;
+  bbox.height =   1.9 * c_abs.y;
+}
+
+bool BigMap::open_map_file(const std::string &path) {
+  ROS_WARN("Map: map files are not supported for a big map");
+  return false;
+}
+
+bool BigMap::attach_server(const std::string &name) {
+  ROS_WARN("Map: a map server is not supported for a big map");
+  return false;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,67 @@
+#ifndef SRC_BIG_MAP_HPP_
+#define SRC_BIG_MAP_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "map.hpp"
+#include "tiled_map.hpp"
+
+namespace cps2 {
+
+/**
+ * A Map of config/map.png instead of a recorded one. It is cut into tiles (config/map.tiles)
+ * on first use, see TiledMap, and never changes, so there is no worker, no map file and no
+ * map server.
+ */
+class BigMap : public Map {
+public:
+  /**
+   * @param image_evaluator ImageEvaluator, which determines the representation of map pieces
+   * @param settings see MapSettings, only grid_size is used
+   */
+  BigMap(cps2::ImageEvaluator *image_evaluator, const MapSettings &settings);
+
+  /**
+   * Crop a single image at the pose from the big map.
+   */
+  virtual std::vector<cv::Mat> get_map_pieces(const cv::Point3f &pos_world);
+
+  virtual cv::Mat get_map_area(const cv::Point2f &center_world, const int rows, const int cols);
+
+  /**
+   * Page in the tiles of an area in the background.
+   */
+  virtual void prefetch(const cv::Rect2f &area_world);
+
+  /**
+   * A big map has no map pieces.
+   */
+  virtual const std::vector<const MapPiece *> &get_candidates(const cv::Point3f &pos_world) {
+    return no_candidates;
+  }
+
+  /**
+   * Only takes over the camera matrix. The first call sets bbox to the extent of the map.
+   */
+  virtual void update(const cv::Mat &image, const Particle &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix);
+
+  virtual bool open_map_file(const std::string &path);
+
+  virtual bool attach_server(const std::string &name);
+
+protected:
+  virtual bool apply(const MapUpdate &job) {return false;}
+
+  virtual void refresh_candidates(const int64_t key) {}
+
+private:
+  TiledMap tiled_map;
+  cv::Point2i dim_map; //!< half the size of the big map
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_BIG_MAP_HPP_ */
@@ -31,11 +31,14 @@ class DBScan {
   neighborList regionQuery(std::size_t _p, float _eps);
 };
 
-cps2::Clusters DBScan::dbscan(std::vector<cps2::Particle> &_dataset,
+inline cps2::Clusters DBScan::dbscan(std::vector<cps2::Particle> &_dataset,
                               float _eps, int _min_pts){
   // https://en.wikipedia.org/wiki/DBSCAN
   dataset = _dataset;
   std::size_t clusters_index = 0;
+
+  if(dataset.empty() )
+    return clusters;
   
   for( unsigned int i = 0; i <= dataset.size() -1; ++i){
     // if point is visited skip to the next point
@@ -62,7 +65,7 @@ cps2::Clusters DBScan::dbscan(std::vector<cps2::Particle> &_dataset,
   return clusters;
 }
 
-bool DBScan::expandCluster(std::size_t _p, neighborList _neighbor_pts,
+inline bool DBScan::expandCluster(std::size_t _p, neighborList _neighbor_pts,
                            std::size_t _C, float _eps, int _min_pts){
   //add p to cluster C
   clusters.at(_C).push_back(dataset.at(_p));
@@ -89,9 +92,11 @@ bool DBScan::expandCluster(std::size_t _p, neighborList _neighbor_pts,
       }
     }
   }
+
+  return true;
 }
 
-neighborList DBScan::regionQuery(std::size_t _p, float _eps){
+inline neighborList DBScan::regionQuery(std::size_t _p, float _eps){
   cps2::Particle p = dataset.at(_p);
   neighborList neighbor_pts = {_p}; // add p to list
   std::size_t i = 0;
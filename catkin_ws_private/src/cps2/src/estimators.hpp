@@ -0,0 +1,291 @@
+#ifndef SRC_ESTIMATORS_HPP_
+#define SRC_ESTIMATORS_HPP_
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "dbscan.hpp"
+#include "particle.hpp"
+
+namespace cps2 {
+
+/*
+ * Pose estimation policies for ParticleFilterT. Each one is constructed from the bin_size of
+ * the filter and provides
+ *
+ *   void update(const std::vector<Particle> &particles, const Particle &best_single,
+ *       const cv::Rect2f &bbox);
+ *   Particle get() const;
+ *
+ * update() is called once per frame after the evaluation, with the bounding box of the map,
+ * get() returns the latest estimate.
+ */
+
+/**
+ * Use the Particle with the highest belief.
+ */
+class SingleBestEstimator {
+public:
+  SingleBestEstimator(const float _bin_size) : best(0, 0, 0) {}
+
+  void update(const std::vector<Particle> &particles, const Particle &best_single,
+      const cv::Rect2f &bbox)
+  {
+    best = best_single;
+  }
+
+  Particle get() const {return best;}
+
+private:
+  Particle best;
+};
+
+struct Bin {
+  int x;
+  int y;
+  float cx;
+  float cy;
+  int count;
+  float weight;
+  std::vector<Particle> ps;
+};
+
+/**
+ * Use a grid to detect clusters of Particles. Find the cluster with the maximum total weight
+ * and compute a new Particle from the weighted mean of the Particles from this cluster.
+ *
+ * The Bins tile the bounding box of the map, Particles outside of it count for the Bins at its
+ * border. Only the Bins of the Particles' extent are created, since the map may be large and
+ * sparse.
+ *
+ * Binning tends to avoid cluster-jumping and additionally smooths the result in comparison
+ * to the naive approach. With a bin_size of 0, this falls back to the single best Particle.
+ */
+class BinningEstimator {
+public:
+  BinningEstimator(const float _bin_size) : bin_size(_bin_size > 0 ? _bin_size : 0),
+      best(0, 0, 0) {}
+
+  void update(const std::vector<Particle> &particles, const Particle &best_single,
+      const cv::Rect2f &bbox)
+  {
+    if(bin_size == 0)
+      best = best_single;
+    else if(best_single.belief != 0)
+      binning(particles, bbox);
+  }
+
+  Particle get() const {return best;}
+
+  /**
+   * Weighted mean of a set of Particles, using a circular mean for the orientation.
+   *
+   * @param ps non-empty list of Particles
+   * @return the mean Particle
+   */
+  static Particle weighted_mean(const std::vector<Particle> &ps) {
+    float sx  = 0;
+    float sy  = 0;
+    float sts = 0;
+    float stc = 0;
+    float sb  = 0;
+
+    for(std::vector<Particle>::const_iterator it = ps.begin(); it != ps.end(); ++it) {
+      sx  += it->weight * it->p.x;
+      sy  += it->weight * it->p.y;
+      sts += it->weight * sinf(it->p.z);
+      stc += it->weight * cosf(it->p.z);
+      sb  += it->weight;
+    }
+
+    return Particle(sx / sb, sy / sb, atan2f(sts / sb, stc / sb) );
+  }
+
+private:
+  void binning(const std::vector<Particle> &particles, const cv::Rect2f &bbox) {
+    if(particles.empty() )
+      return;
+
+    // generate the Bins of bbox covering all Particles
+    float min_x = particles[0].p.x;
+    float min_y = particles[0].p.y;
+    float max_x = particles[0].p.x;
+    float max_y = particles[0].p.y;
+
+    for(std::vector<Particle>::const_iterator it = particles.begin(); it != particles.end(); ++it) {
+      min_x = std::min(min_x, it->p.x);
+      min_y = std::min(min_y, it->p.y);
+      max_x = std::max(max_x, it->p.x);
+      max_y = std::max(max_y, it->p.y);
+    }
+
+    const int bins_x = std::max(1, (int)ceilf(bbox.width  / bin_size) );
+    const int bins_y = std::max(1, (int)ceilf(bbox.height / bin_size) );
+    const int min_j  = bin_index(min_x - bbox.x, bins_x);
+    const int min_i  = bin_index(min_y - bbox.y, bins_y);
+    const int num_x  = bin_index(max_x - bbox.x, bins_x) - min_j + 1;
+    const int num_y  = bin_index(max_y - bbox.y, bins_y) - min_i + 1;
+    const float x0   = bbox.x + min_j * bin_size;
+    const float y0   = bbox.y + min_i * bin_size;
+
+    std::vector<std::vector<Bin> > bins(num_y, std::vector<Bin>(num_x) );
+    Bin *bestBin = &(bins[0][0]);
+
+    // set the grid indices and world frame coords of grid cell center for each Bin
+    for(int i = 0; i < num_y; ++i)
+      for(int j = 0; j < num_x; ++j) {
+        bins[i][j].x      = j;
+        bins[i][j].y      = i;
+        bins[i][j].cx     = x0 + (j + 0.5) * bin_size;
+        bins[i][j].cy     = y0 + (i + 0.5) * bin_size;
+        bins[i][j].weight = 0;
+        bins[i][j].count  = 0;
+      }
+
+    // assign the nearest Bin to each Particle and sum up the weights for the Bins. Keep track
+    // of the Bin with the highest weight
+    for(std::vector<Particle>::const_iterator it = particles.begin();
+        it != particles.end(); ++it)
+    {
+      const int x = bin_index(it->p.x - x0, num_x);
+      const int y = bin_index(it->p.y - y0, num_y);
+
+      bins[y][x].weight += it->weight;
+      ++bins[y][x].count;
+
+      bins[y][x].ps.push_back(*it);
+
+      if(bins[y][x].weight > bestBin->weight)
+        bestBin = &(bins[y][x]);
+    }
+
+    // compute the mean (x,y)-position of Particles in the best Bin
+    float sx = 0;
+    float sy = 0;
+
+    for(std::vector<Particle>::const_iterator it = bestBin->ps.begin();
+        it != bestBin->ps.end(); ++it)
+    {
+      sx += it->p.x;
+      sy += it->p.y;
+    }
+
+    sx /= bestBin->count;
+    sy /= bestBin->count;
+
+    // in order to get a representing cluster that is not compromised by the
+    // grid-discretization, add the three Bins nearest to bestBin (and bestBin) to the cluster.
+    std::vector<Bin> goodBins;
+    goodBins.push_back(*bestBin);
+
+    if(sx < bestBin->cx) {
+      if(bestBin->x > 0)
+        goodBins.push_back(bins[bestBin->y][bestBin->x - 1]);
+
+      if(sy < bestBin->cy) {
+        if(bestBin->y > 0)
+          goodBins.push_back(bins[bestBin->y - 1][bestBin->x]);
+
+        if(bestBin->x > 0 && bestBin->y > 0)
+          goodBins.push_back(bins[bestBin->y - 1][bestBin->x - 1]);
+      }
+      else {
+        if(bestBin->y < num_y - 1)
+          goodBins.push_back(bins[bestBin->y + 1][bestBin->x]);
+
+        if(bestBin->x > 0 && bestBin->y < num_y - 1)
+          goodBins.push_back(bins[bestBin->y + 1][bestBin->x - 1]);
+      }
+    }
+    else {
+      if(bestBin->x < num_x - 1)
+        goodBins.push_back(bins[bestBin->y][bestBin->x + 1]);
+
+      if(sy < bestBin->cy) {
+        if(bestBin->y > 0)
+          goodBins.push_back(bins[bestBin->y - 1][bestBin->x]);
+
+        if(bestBin->x < num_x - 1 && bestBin->y > 0)
+          goodBins.push_back(bins[bestBin->y - 1][bestBin->x + 1]);
+      }
+      else {
+        if(bestBin->y < num_y - 1)
+          goodBins.push_back(bins[bestBin->y + 1][bestBin->x]);
+
+        if(bestBin->x < num_x - 1 && bestBin->y < num_y - 1)
+          goodBins.push_back(bins[bestBin->y + 1][bestBin->x + 1]);
+      }
+    }
+
+    // compute the weighted mean of positions for all Particles in the cluster. To compute
+    // a mean of angles, split the angles in sin and cos portions, take the weighted means
+    // of both and rebuild an angle using atan2.
+    std::vector<Particle> cluster;
+
+    for(std::vector<Bin>::const_iterator it = goodBins.begin(); it != goodBins.end(); ++it)
+      cluster.insert(cluster.end(), it->ps.begin(), it->ps.end() );
+
+    best = weighted_mean(cluster);
+  }
+
+  /**
+   * @param offset distance from the start of a row or column of Bins
+   * @param num number of Bins in the row or column
+   * @return index of the Bin at offset, the border Bins for offsets beyond the row or column
+   */
+  int bin_index(const float offset, const int num) const {
+    return std::max(0, std::min(num - 1, (int)floorf(offset / bin_size) ) );
+  }
+
+  const float bin_size;
+  Particle best;
+};
+
+/**
+ * Run DBSCAN on the Particle positions, with bin_size as eps, and return the weighted mean
+ * of the cluster with the maximum total weight.
+ */
+class ClusterEstimator {
+public:
+  ClusterEstimator(const float _bin_size) : eps(_bin_size > 0 ? _bin_size : 0.5),
+      best(0, 0, 0) {}
+
+  void update(const std::vector<Particle> &particles, const Particle &best_single,
+      const cv::Rect2f &bbox)
+  {
+    if(particles.empty() || best_single.belief == 0)
+      return;
+
+    std::vector<Particle> dataset(particles);
+    const Clusters clusters = DBScan().dbscan(dataset, eps, 1);
+
+    const Point3fList *best_cluster = 0;
+    float best_weight               = 0;
+
+    for(Clusters::const_iterator it = clusters.begin(); it != clusters.end(); ++it) {
+      float weight = 0;
+
+      for(Point3fList::const_iterator pt = it->begin(); pt != it->end(); ++pt)
+        weight += pt->weight;
+
+      if(weight > best_weight) {
+        best_weight  = weight;
+        best_cluster = &(*it);
+      }
+    }
+
+    if(best_cluster)
+      best = BinningEstimator::weighted_mean(*best_cluster);
+  }
+
+  Particle get() const {return best;}
+
+private:
+  const float eps;
+  Particle best;
+};
+
+} // namespace cps2
+
+#endif
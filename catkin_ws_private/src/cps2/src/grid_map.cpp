@@ -0,0 +1,134 @@
+#include <algorithm>
+#include "grid_map.hpp"
+
+namespace cps2 {
+
+GridMap::GridMap(cps2::ImageEvaluator *_image_evaluator, const MapSettings &settings)
+    : Map(_image_evaluator, settings)
+{
+}
+
+GridMap::~GridMap() {
+  stop_worker();
+}
+
+const std::vector<const MapPiece *> &GridMap::get_candidates(const cv::Point3f &pos_world) {
+  const std::unordered_map<int64_t, std::vector<const MapPiece *> >::const_iterator it =
+      state->candidates.find(cell_key(world2grid(pos_world) ) );
+
+  if(it == state->candidates.end() )
+    return no_candidates;
+
+  return it->second;
+}
+
+void GridMap::update_candidates(const cv::Point2i &pos_grid) {
+  const cv::Point3f center = grid2world(pos_grid.x, pos_grid.y);
+  std::vector<const MapPiece *> map_pieces;
+
+  // collect all set pieces of the 3x3 cells around pos_grid
+  for(int i = pos_grid.y - 1; i <= pos_grid.y + 1; ++i)
+    for(int j = pos_grid.x - 1; j <= pos_grid.x + 1; ++j) {
+      const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+          work.grid.find(cell_key(cv::Point2i(j, i) ) );
+
+      if(it != work.grid.end() && it->second)
+        map_pieces.push_back(it->second.get() );
+    }
+
+  // keep the ones recorded nearest to the center of pos_grid
+  std::stable_sort(map_pieces.begin(), map_pieces.end(),
+      [this, &center](const MapPiece *a, const MapPiece *b) {
+    return dist(a->pos_world, center) < dist(b->pos_world, center);
+  });
+
+  if(map_pieces.size() > MAP_CANDIDATES)
+    map_pieces.resize(MAP_CANDIDATES);
+
+  work.candidates[cell_key(pos_grid)] = map_pieces;
+}
+
+bool GridMap::apply(const MapUpdate &job) {
+  // get the mappiece for pos_world. Cells are created on first visit, at any distance from the
+  // known ones
+  const cv::Point2i pos_grid = world2grid(job.pos_world);
+  const int64_t key          = cell_key(pos_grid);
+  std::shared_ptr<const MapPiece> &slot = work.grid[key];
+
+  if(!slot)
+    extend_bbox(pos_grid);
+
+  cv::Point3f center = grid2world(pos_grid.x, pos_grid.y);
+  float dt           = slot ? (job.stamp - slot->stamp).toSec() : 0;
+
+  if(path_now != center) {
+    path_prev = path_now;
+    path_now  = center;
+  }
+
+  // update the mappiece if needed
+  if(
+      slot
+      //&& dt <= update_interval_max
+      && (dt <= update_interval_min || dist(job.pos_world, center) >= dist(slot->pos_world, center) )
+  )
+    return false;
+
+  // pieces may still be read through published states, so write a new one
+  std::shared_ptr<MapPiece> map_piece = std::make_shared<MapPiece>();
+
+  // store the image the way the evaluator needs it. This saves the blurring and downscaling
+  // per lookup and resize_scale^2 of the memory.
+  store_native(*map_piece, image_evaluator->native(job.image), job.pos_world);
+
+  if(keep_full_res)
+    map_piece->img_full = job.image;
+
+  // replace the old piece's share of the ceiling orientation
+  if(slot)
+    add_ceiling_orientation(*slot, -1);
+
+  map_piece->orientation = OrientationHistogram(job.image);
+  map_piece->is_set = true;
+  map_piece->stamp  = job.stamp;
+
+  // correct the position by registering the piece with the one of the previous cell
+  const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator prev =
+      work.grid.find(cell_key(world2grid(path_prev) ) );
+
+  const MapPiece *registered_with = NULL;
+
+  if(path_prev != path_now && prev != work.grid.end() && prev->second
+      && !prev->second->img.empty() && native_distance(prev->second->img, map_piece->img,
+      prev->second->pos_world, job.pos_world, job.camera_matrix, map_piece->pos_world) )
+    registered_with = prev->second.get();
+  else
+    map_piece->pos_world = job.pos_world;
+
+  add_ceiling_orientation(*map_piece, 1);
+
+  set_piece(key, map_piece);
+
+  if(graph_iterations > 0)
+    add_to_graph(key, *map_piece, job, registered_with, registered_with ? prev->first : 0);
+
+  refresh_candidates(key);
+
+  piece_written(key);
+
+  if(map_file.is_open() )
+    map_file.append(pos_grid, *map_piece);
+
+  return true;
+}
+
+void GridMap::refresh_candidates(const int64_t key) {
+  // the piece affects the candidates of all cells that have its cell as neighbour
+  const cv::Point2i pos_grid = key2grid(key);
+
+  for(int i = pos_grid.y - 1; i <= pos_grid.y + 1; ++i)
+    for(int j = pos_grid.x - 1; j <= pos_grid.x + 1; ++j)
+      update_candidates(cv::Point2i(j, i) );
+}
+
+} /* namespace cps2 */
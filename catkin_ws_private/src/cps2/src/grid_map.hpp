@@ -0,0 +1,50 @@
+#ifndef SRC_GRID_MAP_HPP_
+#define SRC_GRID_MAP_HPP_
+
+#include <stdint.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "map.hpp"
+
+namespace cps2 {
+
+/**
+ * A recorded Map with one piece per grid cell. A cell's piece is replaced by a frame taken
+ * nearer to the center of the cell, but not within update_interval_min.
+ */
+class GridMap : public Map {
+public:
+  /**
+   * @param image_evaluator ImageEvaluator, which determines the representation of map pieces
+   * @param settings see MapSettings
+   */
+  GridMap(cps2::ImageEvaluator *image_evaluator, const MapSettings &settings);
+
+  virtual ~GridMap();
+
+  /**
+   * Get the map pieces to compare a pose with: up to MAP_CANDIDATES pieces of the 3x3 cells
+   * around the cell of pos_world, recorded nearest to the center of that cell first. The
+   * lists are precomputed per cell whenever the worker writes a piece, so all poses in the
+   * same cell share one list.
+   * @param pos_world pose in world frame
+   * @return list of map pieces, valid until the next call to update() or open_map_file()
+   */
+  virtual const std::vector<const MapPiece *> &get_candidates(const cv::Point3f &pos_world);
+
+protected:
+  virtual bool apply(const MapUpdate &job);
+
+  virtual void refresh_candidates(const int64_t key);
+
+private:
+  /**
+   * Recompute the candidates of a cell, see get_candidates().
+   * @param pos_grid grid indices of the cell
+   */
+  void update_candidates(const cv::Point2i &pos_grid);
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_GRID_MAP_HPP_ */
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <algorithm>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #ifdef DEBUG_IE
@@ -115,7 +116,82 @@ cv::Mat ImageEvaluator::transform(const cv::Mat &img,
   return transform(img, pos_image, th, ph, img.rows, img.cols);
 }
 
+cv::Mat ImageEvaluator::native(const cv::Mat &img) {
+  cv::Mat img_native;
+
+  cv::copyMakeBorder(transform(img, cv::Point2i(img.cols / 2, img.rows / 2), 0, 0), img_native,
+      IE_NATIVE_MARGIN, IE_NATIVE_MARGIN, IE_NATIVE_MARGIN, IE_NATIVE_MARGIN,
+      cv::BORDER_CONSTANT, cv::Scalar(0) );
+
+  return img_native;
+}
+
+cv::Mat ImageEvaluator::transform_native(const cv::Mat &native, const cv::Point2f &offset,
+    const float th, const float ph, const int rows, const int cols)
+{
+  // center of native, as placed by transform()
+  const int cx1   = (native.cols - 2 * IE_NATIVE_MARGIN) / 2 + IE_NATIVE_MARGIN;
+  const int cy1   = (native.rows - 2 * IE_NATIVE_MARGIN) / 2 + IE_NATIVE_MARGIN;
+  const int dim_x = cols / resize_scale;
+  const int dim_y = rows / resize_scale;
+  const int cx2   = dim_x / 2;
+  const int cy2   = dim_y / 2;
+  const float ox  = offset.x / resize_scale;
+  const float oy  = offset.y / resize_scale;
+  const float ths = sinf(th);
+  const float thc = cosf(th);
+  const float phs = sinf(ph);
+  const float phc = cosf(ph);
+
+  cv::Mat img_tf(dim_y, dim_x, CV_8UC1);
+
+  for(int r = 0; r < dim_y; ++r) {
+    const int sy = r - cy2;
+    uchar *row   = img_tf.ptr<uchar>(r);
+
+    for(int c = 0; c < dim_x; ++c) {
+      const int sx   = c - cx2;
+      const float x  = sx * thc - sy * ths + ox;
+      const float y  = sx * ths + sy * thc + oy;
+      const float xx = x * phc - y * phs + cx1;
+      const float yy = x * phs + y * phc + cy1;
+      const int x0   = (int)floorf(xx);
+      const int y0   = (int)floorf(yy);
+
+      row[c] = 0;
+
+      if(x0 < 0 || y0 < 0 || x0 + 1 >= native.cols || y0 + 1 >= native.rows)
+        continue;
+
+      const uchar *n0 = native.ptr<uchar>(y0);
+      const uchar *n1 = native.ptr<uchar>(y0 + 1);
+
+      // do not blend known pixels with unknown ones
+      if(n0[x0] == 0 || n0[x0 + 1] == 0 || n1[x0] == 0 || n1[x0 + 1] == 0)
+        continue;
+
+      const float fx = xx - x0;
+      const float fy = yy - y0;
+      const float v  = (1 - fy) * ( (1 - fx) * n0[x0] + fx * n0[x0 + 1])
+                     + fy * ( (1 - fx) * n1[x0] + fx * n1[x0 + 1]);
+
+      row[c] = std::max(1, (int)(v + 0.5f) );
+    }
+  }
+
+  return img_tf;
+}
+
 float ImageEvaluator::evaluate(const cv::Mat &img1, const cv::Mat &img2) {
+  // a single comparison, see evaluate_chamfer() for repeated ones
+  if(mode == IE_MODE_CHAMFER) {
+    std::vector<cv::Point2f> points;
+
+    edge_points(img1, points);
+
+    return evaluate_chamfer(distance_map(img2), points, cv::Point2f(0, 0), 0, 0);
+  }
+
   float error_pixels = 0;
 
 #ifdef DEBUG_IE
@@ -190,4 +266,274 @@ float ImageEvaluator::evaluate(const cv::Mat &img1, const cv::Mat &img2) {
   return error_pixels;
 }
 
+static int polarAngles(const cv::Mat &img) {
+  // sample the outer circle about twice per pixel, in a multiple of 4 angles
+  const int radius = std::min(img.rows, img.cols) / 2;
+
+  return 4 * std::max(4, (int)ceilf(M_PI * radius) );
+}
+
+float ImageEvaluator::getPolarStep(const cv::Mat &img) {
+  return 2 * M_PI / polarAngles(img);
+}
+
+cv::Mat ImageEvaluator::polar(const cv::Mat &img) {
+  // same center as transform()
+  const int cx     = img.cols / 2;
+  const int cy     = img.rows / 2;
+  const int radius = std::min(img.rows, img.cols) / 2;
+  const int angles = polarAngles(img);
+
+  cv::Mat img_polar(angles, radius, CV_8UC1);
+
+  for(int a = 0; a < angles; ++a) {
+    const float as = sinf(2 * M_PI * a / angles);
+    const float ac = cosf(2 * M_PI * a / angles);
+
+    for(int r = 0; r < radius; ++r) {
+      const float x  = cx + r * ac;
+      const float y  = cy + r * as;
+      const int x0   = std::max(0, std::min(img.cols - 1, (int)floorf(x) ) );
+      const int y0   = std::max(0, std::min(img.rows - 1, (int)floorf(y) ) );
+      const int x1   = std::min(img.cols - 1, x0 + 1);
+      const int y1   = std::min(img.rows - 1, y0 + 1);
+      const float fx = x - x0;
+      const float fy = y - y0;
+
+      const uchar v00 = img.at<uchar>(y0, x0);
+      const uchar v01 = img.at<uchar>(y0, x1);
+      const uchar v10 = img.at<uchar>(y1, x0);
+      const uchar v11 = img.at<uchar>(y1, x1);
+
+      // do not blend known pixels with unknown ones
+      if(v00 == 0 || v01 == 0 || v10 == 0 || v11 == 0) {
+        img_polar.at<uchar>(a, r) = 0;
+        continue;
+      }
+
+      const float v = (1 - fy) * ( (1 - fx) * v00 + fx * v01) + fy * ( (1 - fx) * v10 + fx * v11);
+
+      img_polar.at<uchar>(a, r) = std::max(1, (int)(v + 0.5f) );
+    }
+  }
+
+  return img_polar;
+}
+
+void ImageEvaluator::evaluate_rotations(const cv::Mat &polar1, const cv::Mat &polar2,
+    const int window, std::vector<float> &errors)
+{
+  const int angles = polar1.rows;
+
+  errors.assign(2 * window + 1, 1);
+
+  for(int k = -window; k <= window; ++k) {
+    float error = 0;
+    int pixels  = 0;
+
+    for(int a = 0; a < angles; ++a) {
+      const uchar *row1 = polar1.ptr<uchar>(a);
+      const uchar *row2 = polar2.ptr<uchar>( ( (a + k) % angles + angles) % angles);
+
+      for(int r = 0; r < polar1.cols; ++r)
+        if(row1[r] != 0 && row2[r] != 0) {
+          error += fabs( (float)row1[r] - row2[r]);
+          ++pixels;
+        }
+    }
+
+    if(pixels != 0)
+      errors[window + k] = error / (255 * pixels);
+  }
+}
+
+void ImageEvaluator::histogram(const cv::Mat &img, std::vector<float> &hist) {
+  // same center as transform()
+  const int cx     = img.cols / 2;
+  const int cy     = img.rows / 2;
+  const int radius = std::min(img.rows, img.cols) / 2;
+  int pixels       = 0;
+
+  hist.assign(IE_HISTOGRAM_BINS, 0);
+
+  for(int r = cy - radius; r < cy + radius; ++r) {
+    const uchar *row = img.ptr<uchar>(r);
+
+    for(int c = cx - radius; c < cx + radius; ++c)
+      if(row[c] != 0 && (r - cy) * (r - cy) + (c - cx) * (c - cx) < radius * radius) {
+        hist[row[c] * IE_HISTOGRAM_BINS / 256] += 1;
+        ++pixels;
+      }
+  }
+
+  if(pixels == 0)
+    return;
+
+  for(std::vector<float>::iterator it = hist.begin(); it != hist.end(); ++it)
+    *it /= pixels;
+}
+
+float ImageEvaluator::histogram_distance(const std::vector<float> &hist1,
+    const std::vector<float> &hist2)
+{
+  float distance = 0;
+
+  for(int k = 0; k < hist1.size() && k < hist2.size(); ++k)
+    distance += fabsf(hist1[k] - hist2[k]);
+
+  return 0.5f * distance;
+}
+
+/**
+ * Gradient of a pixel by central differences, false if a neighbour is unknown.
+ */
+static bool gradient(const cv::Mat &img, const int r, const int c, float &gx, float &gy) {
+  const uchar *row0 = img.ptr<uchar>(r - 1);
+  const uchar *row1 = img.ptr<uchar>(r);
+  const uchar *row2 = img.ptr<uchar>(r + 1);
+
+  if(row0[c - 1] == 0 || row0[c] == 0 || row0[c + 1] == 0 || row1[c - 1] == 0 || row1[c] == 0
+      || row1[c + 1] == 0 || row2[c - 1] == 0 || row2[c] == 0 || row2[c + 1] == 0)
+    return false;
+
+  gx = 0.5f * ( (float)row1[c + 1] - row1[c - 1]);
+  gy = 0.5f * ( (float)row2[c] - row0[c]);
+
+  return true;
+}
+
+/**
+ * Edge pixels of an image, see ImageEvaluator::edge_points().
+ */
+static cv::Mat edges(const cv::Mat &img) {
+  cv::Mat magnitude = cv::Mat::zeros(img.rows, img.cols, CV_32FC1);
+  cv::Mat direction = cv::Mat::zeros(img.rows, img.cols, CV_8UC1);
+  cv::Mat edge      = cv::Mat::zeros(img.rows, img.cols, CV_8UC1);
+
+  for(int r = 1; r + 1 < img.rows; ++r)
+    for(int c = 1; c + 1 < img.cols; ++c) {
+      float gx;
+      float gy;
+
+      if(!gradient(img, r, c, gx, gy) )
+        continue;
+
+      magnitude.at<float>(r, c) = sqrtf(gx * gx + gy * gy);
+
+      // 0: horizontal, 1: vertical, 2: diagonal, 3: antidiagonal gradient
+      if(fabsf(gx) > 2 * fabsf(gy) )
+        direction.at<uchar>(r, c) = 0;
+      else if(fabsf(gy) > 2 * fabsf(gx) )
+        direction.at<uchar>(r, c) = 1;
+      else
+        direction.at<uchar>(r, c) = gx * gy > 0 ? 2 : 3;
+    }
+
+  const int dx[4] = {1, 0, 1, 1};
+  const int dy[4] = {0, 1, 1, -1};
+
+  // keep the local maxima along the gradient, so an edge is one pixel wide
+  for(int r = 1; r + 1 < img.rows; ++r)
+    for(int c = 1; c + 1 < img.cols; ++c) {
+      const float m = magnitude.at<float>(r, c);
+      const int d   = direction.at<uchar>(r, c);
+
+      if(m < IE_CHAMFER_MIN_GRADIENT)
+        continue;
+
+      if(m >= magnitude.at<float>(r + dy[d], c + dx[d])
+          && m >= magnitude.at<float>(r - dy[d], c - dx[d]) )
+        edge.at<uchar>(r, c) = 1;
+    }
+
+  return edge;
+}
+
+void ImageEvaluator::edge_points(const cv::Mat &img, std::vector<cv::Point2f> &points) {
+  // same center as transform()
+  const int cx       = img.cols / 2;
+  const int cy       = img.rows / 2;
+  const cv::Mat edge = edges(img);
+  const int count    = cv::countNonZero(edge);
+  const int stride   = std::max(1, (count + IE_CHAMFER_MAX_POINTS - 1) / IE_CHAMFER_MAX_POINTS);
+  int k              = 0;
+
+  points.clear();
+
+  for(int r = 0; r < edge.rows; ++r)
+    for(int c = 0; c < edge.cols; ++c)
+      if(edge.at<uchar>(r, c) != 0 && k++ % stride == 0)
+        points.push_back(cv::Point2f(c - cx, r - cy) );
+}
+
+cv::Mat ImageEvaluator::distance_map(const cv::Mat &img) {
+  const cv::Mat edge = edges(img);
+  cv::Mat input(img.rows, img.cols, CV_8UC1);
+  cv::Mat distance;
+
+  // distanceTransform() measures the distance to the nearest zero pixel
+  for(int r = 0; r < img.rows; ++r)
+    for(int c = 0; c < img.cols; ++c)
+      input.at<uchar>(r, c) = edge.at<uchar>(r, c) != 0 ? 0 : 1;
+
+  cv::distanceTransform(input, distance, cv::DIST_L2, cv::DIST_MASK_3, CV_32F);
+
+  for(int r = 0; r < img.rows; ++r) {
+    const uchar *row_img = img.ptr<uchar>(r);
+    float *row           = distance.ptr<float>(r);
+
+    for(int c = 0; c < img.cols; ++c)
+      row[c] = row_img[c] == 0 ? -1 : std::min(row[c], IE_CHAMFER_MAX_DISTANCE);
+  }
+
+  return distance;
+}
+
+float ImageEvaluator::evaluate_chamfer(const cv::Mat &distance,
+    const std::vector<cv::Point2f> &points, const cv::Point2f &offset, const float th,
+    const float ph)
+{
+  // same placement as transform_native()
+  const int cx1   = (distance.cols - 2 * IE_NATIVE_MARGIN) / 2 + IE_NATIVE_MARGIN;
+  const int cy1   = (distance.rows - 2 * IE_NATIVE_MARGIN) / 2 + IE_NATIVE_MARGIN;
+  const float ox  = offset.x / resize_scale;
+  const float oy  = offset.y / resize_scale;
+  const float ths = sinf(th);
+  const float thc = cosf(th);
+  const float phs = sinf(ph);
+  const float phc = cosf(ph);
+  float sum       = 0;
+  int known       = 0;
+
+  for(std::vector<cv::Point2f>::const_iterator it = points.begin(); it != points.end(); ++it) {
+    const float x  = it->x * thc - it->y * ths + ox;
+    const float y  = it->x * ths + it->y * thc + oy;
+    const float xx = x * phc - y * phs + cx1;
+    const float yy = x * phs + y * phc + cy1;
+    const int x0   = (int)floorf(xx);
+    const int y0   = (int)floorf(yy);
+
+    if(x0 < 0 || y0 < 0 || x0 + 1 >= distance.cols || y0 + 1 >= distance.rows)
+      continue;
+
+    const float *d0 = distance.ptr<float>(y0);
+    const float *d1 = distance.ptr<float>(y0 + 1);
+
+    if(d0[x0] < 0 || d0[x0 + 1] < 0 || d1[x0] < 0 || d1[x0 + 1] < 0)
+      continue;
+
+    const float fx = xx - x0;
+    const float fy = yy - y0;
+
+    sum += (1 - fy) * ( (1 - fx) * d0[x0] + fx * d0[x0 + 1])
+         + fy * ( (1 - fx) * d1[x0] + fx * d1[x0 + 1]);
+    ++known;
+  }
+
+  if(known == 0 || known < IE_CHAMFER_MIN_KNOWN * points.size() )
+    return 1;
+
+  return sum / (known * IE_CHAMFER_MAX_DISTANCE);
+}
+
 } /* namespace cps2 */
@@ -1,12 +1,23 @@
 #ifndef SRC_IMAGE_EVALUATOR_HPP_
 #define SRC_IMAGE_EVALUATOR_HPP_
 
+#include <vector>
 #include <opencv2/core/core.hpp>
 
 namespace cps2 {
 
 const int IE_MODE_PIXELS    = 0;
 const int IE_MODE_CENTROIDS = 1;
+const int IE_MODE_CHAMFER   = 2;
+
+const int IE_NATIVE_MARGIN  = 1; //!< border (in pixels) of zeros around native images
+const int IE_HISTOGRAM_BINS = 16; //!< bins of histogram()
+
+// edge matching, see IE_MODE_CHAMFER
+const int   IE_CHAMFER_MIN_GRADIENT = 24;  //!< gray values per pixel, weaker ones are no edges
+const int   IE_CHAMFER_MAX_POINTS   = 400; //!< edge points per image, more are thinned out
+const float IE_CHAMFER_MAX_DISTANCE = 4;   //!< in pixels, distances are truncated to this
+const float IE_CHAMFER_MIN_KNOWN    = 0.5; //!< fraction of edge points that must hit the map
 
 class ImageEvaluator {
  public:
@@ -26,8 +37,124 @@ class ImageEvaluator {
   cv::Mat transform(const cv::Mat &img, const cv::Point2i &pos_image,
       const float th, const float ph);
 
+  /**
+   * Convert a full resolution image to the native representation of the evaluator: blurred,
+   * downscaled by resize_scale like transform() does, and padded by IE_NATIVE_MARGIN zeros so
+   * that interpolation never reads outside. Store images this way to transform them cheaply
+   * and repeatedly with transform_native().
+   * @param img a grayscale image
+   * @return the native image
+   */
+  cv::Mat native(const cv::Mat &img);
+
+  /**
+   * Like transform(), but reading from a native image. The source pixels are interpolated
+   * bilinearly instead of being blurred at full resolution.
+   * @param native an image created by native()
+   * @param offset center of the new image, relative to the center of the original image, in
+   *        pixels of the original image
+   * @param th rotate the resulting image around this angle
+   * @param ph rotate the original image around this angle
+   * @param rows full resolution height of the resulting image
+   * @param cols full resolution width of the resulting image
+   * @return the transformed image
+   */
+  cv::Mat transform_native(const cv::Mat &native, const cv::Point2f &offset,
+      const float th, const float ph, const int rows, const int cols);
+
+  /**
+   * Error between two transformed images of the same size. With IE_MODE_CHAMFER, this
+   * computes the edge points of img1 and the distance map of img2 on every call, which is only
+   * meant for single comparisons. Compare many poses with evaluate_chamfer() instead.
+   * @param img1 the current frame
+   * @param img2 the map
+   * @return error between 0 and 1
+   */
   float evaluate(const cv::Mat &img1, const cv::Mat &img2);
 
+  int getMode() const {return mode;}
+  int getResizeScale() const {return resize_scale;}
+  int getKernelSize() const {return kernel_size;}
+  float getKernelStddev() const {return kernel_stddev;}
+
+  /**
+   * Resample the disc around the center of a transformed image in polar coordinates. Row a
+   * holds the angle a * getPolarStep(img), column r the distance r from the center. Rotating
+   * the image by k * getPolarStep(img) (th of transform) shifts the rows cyclically by k.
+   * Pixels that touch an unknown (zero) pixel are zero.
+   * @param img a transformed image
+   * @return the polar image
+   */
+  cv::Mat polar(const cv::Mat &img);
+
+  /**
+   * @param img a transformed image
+   * @return angle (in radians) between two rows of polar(img)
+   */
+  float getPolarStep(const cv::Mat &img);
+
+  /**
+   * Pixelwise error between two polar images for a range of rotations, like IE_MODE_PIXELS.
+   * errors[window + k] compares row a of polar1 with row a + k of polar2, which is the error
+   * of the image of polar2 rotated by k * getPolarStep().
+   * @param polar1 polar image of the current frame
+   * @param polar2 polar image of a map piece, of the same size
+   * @param window number of rows to shift in each direction
+   * @param errors output list of 2 * window + 1 errors
+   */
+  void evaluate_rotations(const cv::Mat &polar1, const cv::Mat &polar2, const int window,
+      std::vector<float> &errors);
+
+  /**
+   * Normalized intensity histogram of the known pixels in the disc around the center of a
+   * transformed or native image. It does not change when the image is rotated, so it can be
+   * compared with the histogram of a map piece without transforming the map piece.
+   * @param img a transformed or native image
+   * @param hist output list of IE_HISTOGRAM_BINS fractions, all 0 if no pixel is known
+   */
+  void histogram(const cv::Mat &img, std::vector<float> &hist);
+
+  /**
+   * Total variation distance between two histograms.
+   * @return 0 for equal histograms, up to 1 for disjoint ones
+   */
+  static float histogram_distance(const std::vector<float> &hist1,
+      const std::vector<float> &hist2);
+
+  /**
+   * Edge points of a transformed image for IE_MODE_CHAMFER: the pixels whose gradient is at
+   * least IE_CHAMFER_MIN_GRADIENT and a local maximum along its direction. Pixels next to an
+   * unknown (zero) pixel are skipped, so the border of the undistorted image is no edge. At
+   * most IE_CHAMFER_MAX_POINTS are kept, evenly spread over the image.
+   * @param img a transformed image
+   * @param points output list of edge points, relative to the center of img
+   */
+  void edge_points(const cv::Mat &img, std::vector<cv::Point2f> &points);
+
+  /**
+   * Distance of each pixel to the nearest edge point (see edge_points() ), truncated to
+   * IE_CHAMFER_MAX_DISTANCE. Compute it once per map piece to evaluate any pose against it
+   * with evaluate_chamfer().
+   * @param img a transformed or native image
+   * @return CV_32FC1 distances in pixels, -1 at unknown pixels of img
+   */
+  cv::Mat distance_map(const cv::Mat &img);
+
+  /**
+   * Chamfer error of edge points placed on a distance map like transform_native() places the
+   * pixels of its result: the mean distance at the points that hit known pixels, relative to
+   * IE_CHAMFER_MAX_DISTANCE. The cost depends on the number of points only.
+   * @param distance distance_map() of a native image
+   * @param points edge_points() of the current frame
+   * @param offset center of the frame, relative to the center of the original image, in
+   *        pixels of the original image
+   * @param th heading of the frame
+   * @param ph rotate the original image around this angle
+   * @return error between 0 and 1, 1 if less than IE_CHAMFER_MIN_KNOWN of the points hit
+   */
+  float evaluate_chamfer(const cv::Mat &distance, const std::vector<cv::Point2f> &points,
+      const cv::Point2f &offset, const float th, const float ph);
+
  private:
   void generateKernel();
   int applyKernel(const cv::Mat &img, int x, int y);
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include "keyframe_index.hpp"
+
+namespace cps2 {
+
+KeyframeIndex::KeyframeIndex(const std::vector<std::pair<cv::Point2f, int64_t> > &points) {
+  nodes.resize(points.size() );
+
+  for(int i = 0; i < points.size(); ++i) {
+    nodes[i].pos = points[i].first;
+    nodes[i].key = points[i].second;
+  }
+
+  build(0, nodes.size(), 0);
+}
+
+void KeyframeIndex::build(const int begin, const int end, const int axis) {
+  if(end - begin <= 1)
+    return;
+
+  const int mid = begin + (end - begin) / 2;
+
+  std::nth_element(nodes.begin() + begin, nodes.begin() + mid, nodes.begin() + end,
+      [axis](const Node &a, const Node &b) {
+    return axis == 0 ? a.pos.x < b.pos.x : a.pos.y < b.pos.y;
+  });
+
+  build(begin, mid, 1 - axis);
+  build(mid + 1, end, 1 - axis);
+}
+
+void KeyframeIndex::nearest(const cv::Point2f &pos, const int k,
+    std::vector<int64_t> &keys) const
+{
+  // max heap of the best k so far, by squared distance
+  std::vector<std::pair<float, int64_t> > heap;
+
+  keys.clear();
+
+  if(k <= 0)
+    return;
+
+  heap.reserve(k + 1);
+  search_nearest(0, nodes.size(), 0, pos, k, heap);
+
+  std::sort_heap(heap.begin(), heap.end() );
+
+  for(int i = 0; i < heap.size(); ++i)
+    keys.push_back(heap[i].second);
+}
+
+void KeyframeIndex::search_nearest(const int begin, const int end, const int axis,
+    const cv::Point2f &pos, const int k, std::vector<std::pair<float, int64_t> > &heap) const
+{
+  if(begin >= end)
+    return;
+
+  const int mid     = begin + (end - begin) / 2;
+  const Node &node  = nodes[mid];
+  const float dx    = pos.x - node.pos.x;
+  const float dy    = pos.y - node.pos.y;
+  const float split = axis == 0 ? dx : dy;
+
+  if(heap.size() < k || dx * dx + dy * dy < heap.front().first) {
+    heap.push_back(std::make_pair(dx * dx + dy * dy, node.key) );
+    std::push_heap(heap.begin(), heap.end() );
+
+    if(heap.size() > k) {
+      std::pop_heap(heap.begin(), heap.end() );
+      heap.pop_back();
+    }
+  }
+
+  // the side of pos first, the other one only if it may hold closer nodes
+  if(split < 0) {
+    search_nearest(begin, mid, 1 - axis, pos, k, heap);
+
+    if(heap.size() < k || split * split < heap.front().first)
+      search_nearest(mid + 1, end, 1 - axis, pos, k, heap);
+  }
+  else {
+    search_nearest(mid + 1, end, 1 - axis, pos, k, heap);
+
+    if(heap.size() < k || split * split < heap.front().first)
+      search_nearest(begin, mid, 1 - axis, pos, k, heap);
+  }
+}
+
+void KeyframeIndex::within(const cv::Point2f &pos, const float radius,
+    std::vector<int64_t> &keys) const
+{
+  keys.clear();
+  search_within(0, nodes.size(), 0, pos, radius * radius, keys);
+}
+
+void KeyframeIndex::search_within(const int begin, const int end, const int axis,
+    const cv::Point2f &pos, const float radius2, std::vector<int64_t> &keys) const
+{
+  if(begin >= end)
+    return;
+
+  const int mid     = begin + (end - begin) / 2;
+  const Node &node  = nodes[mid];
+  const float dx    = pos.x - node.pos.x;
+  const float dy    = pos.y - node.pos.y;
+  const float split = axis == 0 ? dx : dy;
+
+  if(dx * dx + dy * dy <= radius2)
+    keys.push_back(node.key);
+
+  if(split < 0 || split * split <= radius2)
+    search_within(begin, mid, 1 - axis, pos, radius2, keys);
+
+  if(split >= 0 || split * split <= radius2)
+    search_within(mid + 1, end, 1 - axis, pos, radius2, keys);
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,63 @@
+#ifndef SRC_KEYFRAME_INDEX_HPP_
+#define SRC_KEYFRAME_INDEX_HPP_
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+/**
+ * Static 2-d tree over the (x, y) positions of keyframes, see Map.
+ *
+ * The tree is implicit: the nodes are stored in one array, each range is split at its median,
+ * alternating between x and y. It is built once and never changed, so a published index can
+ * be shared by readers without locks. Rebuilding is O(n log n).
+ */
+class KeyframeIndex {
+public:
+  /**
+   * Build the tree.
+   * @param points positions in world frame and keys of the keyframes
+   */
+  KeyframeIndex(const std::vector<std::pair<cv::Point2f, int64_t> > &points);
+
+  /**
+   * Get the keys of the k nearest keyframes, nearest first.
+   * @param pos position in world frame
+   * @param k max number of keyframes
+   * @param keys output list of keys, at most k
+   */
+  void nearest(const cv::Point2f &pos, const int k, std::vector<int64_t> &keys) const;
+
+  /**
+   * Get the keys of all keyframes within a distance, in no particular order.
+   * @param pos position in world frame
+   * @param radius distance in m
+   * @param keys output list of keys
+   */
+  void within(const cv::Point2f &pos, const float radius, std::vector<int64_t> &keys) const;
+
+  size_t size() const {return nodes.size();}
+
+private:
+  struct Node {
+    cv::Point2f pos;
+    int64_t key;
+  };
+
+  void build(const int begin, const int end, const int axis);
+
+  void search_nearest(const int begin, const int end, const int axis, const cv::Point2f &pos,
+      const int k, std::vector<std::pair<float, int64_t> > &heap) const;
+
+  void search_within(const int begin, const int end, const int axis, const cv::Point2f &pos,
+      const float radius2, std::vector<int64_t> &keys) const;
+
+  std::vector<Node> nodes;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_KEYFRAME_INDEX_HPP_ */
@@ -0,0 +1,177 @@
+#include <math.h>
+#include <algorithm>
+#include "keyframe_map.hpp"
+
+namespace cps2 {
+
+KeyframeMap::KeyframeMap(cps2::ImageEvaluator *_image_evaluator, const MapSettings &settings)
+    : Map(_image_evaluator, settings),
+      next_keyframe(0),
+      keyframes_dirty(true)
+{
+}
+
+KeyframeMap::~KeyframeMap() {
+  stop_worker();
+}
+
+const std::vector<const MapPiece *> &KeyframeMap::get_candidates(
+    const cv::Point3f &pos_world)
+{
+  keyframe_candidates.clear();
+
+  if(!state->keyframes)
+    return keyframe_candidates;
+
+  state->keyframes->nearest(cv::Point2f(pos_world.x, pos_world.y), MAP_KEYFRAME_QUERY,
+      keyframe_query);
+
+  // the ones overlapping most with the pose
+  std::vector<std::pair<float, const MapPiece *> > ranked;
+
+  for(std::vector<int64_t>::const_iterator it = keyframe_query.begin();
+      it != keyframe_query.end(); ++it)
+  {
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator piece =
+        state->grid.find(*it);
+
+    if(piece == state->grid.end() || !piece->second)
+      continue;
+
+    const float ratio = overlap(*piece->second, pos_world, camera_footprint);
+
+    if(ratio > 0)
+      ranked.push_back(std::make_pair(-ratio, piece->second.get() ) );
+  }
+
+  std::stable_sort(ranked.begin(), ranked.end(),
+      [](const std::pair<float, const MapPiece *> &a, const std::pair<float, const MapPiece *> &b) {
+    return a.first < b.first;
+  });
+
+  for(int i = 0; i < ranked.size() && i < MAP_CANDIDATES; ++i)
+    keyframe_candidates.push_back(ranked[i].second);
+
+  return keyframe_candidates;
+}
+
+bool KeyframeMap::apply(const MapUpdate &job) {
+  const cv::Point2f view = footprint(job.camera_matrix,
+      cv::Point2i(job.image.cols / 2, job.image.rows / 2) );
+  std::vector<int64_t> keys;
+
+  update_index();
+  work.keyframes->nearest(cv::Point2f(job.pos_world.x, job.pos_world.y), MAP_KEYFRAME_QUERY,
+      keys);
+
+  // the keyframe overlapping most with the frame
+  const MapPiece *best = NULL;
+  int64_t best_key     = 0;
+  float best_overlap   = 0;
+
+  for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+    const std::shared_ptr<const MapPiece> &piece = work.grid[*it];
+    const float ratio = piece ? overlap(*piece, job.pos_world, view) : 0;
+
+    if(ratio > best_overlap) {
+      best         = piece.get();
+      best_key     = *it;
+      best_overlap = ratio;
+    }
+  }
+
+  // the frame does not cover enough new area
+  if(best_overlap >= MAP_KEYFRAME_OVERLAP)
+    return false;
+
+  const int64_t key = next_keyframe++;
+  std::shared_ptr<MapPiece> map_piece = std::make_shared<MapPiece>();
+
+  store_native(*map_piece, image_evaluator->native(job.image), job.pos_world);
+
+  if(keep_full_res)
+    map_piece->img_full = job.image;
+
+  map_piece->orientation = OrientationHistogram(job.image);
+  map_piece->is_set = true;
+  map_piece->stamp  = job.stamp;
+
+  // correct the position by registering the keyframe with the one overlapping most
+  const MapPiece *registered_with = NULL;
+
+  if(best && !best->img.empty() && native_distance(best->img, map_piece->img, best->pos_world,
+      job.pos_world, job.camera_matrix, map_piece->pos_world) )
+    registered_with = best;
+  else
+    map_piece->pos_world = job.pos_world;
+
+  add_ceiling_orientation(*map_piece, 1);
+  set_piece(key, map_piece);
+  extend_bbox(world2grid(map_piece->pos_world) );
+
+  if(graph_iterations > 0)
+    add_to_graph(key, *map_piece, job, registered_with, best_key);
+
+  refresh_candidates(key);
+
+  piece_written(key);
+
+  if(map_file.is_open() )
+    map_file.append(key2grid(key), *map_piece);
+
+  return true;
+}
+
+void KeyframeMap::refresh_candidates(const int64_t key) {
+  keyframes_dirty = true;
+}
+
+void KeyframeMap::nearby_keys(const cv::Point3f &pos_world, const int cells,
+    std::vector<int64_t> &keys)
+{
+  keys.clear();
+  update_index();
+  work.keyframes->within(cv::Point2f(pos_world.x, pos_world.y), (cells + 0.5) * grid_size, keys);
+}
+
+void KeyframeMap::insert_pieces(const std::vector<std::pair<cv::Point2i, MapPiece> > &pieces) {
+  Map::insert_pieces(pieces);
+
+  // new keyframes are numbered after the loaded ones
+  for(std::vector<std::pair<cv::Point2i, MapPiece> >::const_iterator it = pieces.begin();
+      it != pieces.end(); ++it)
+    next_keyframe = std::max(next_keyframe, cell_key(it->first) + 1);
+}
+
+void KeyframeMap::update_index() {
+  if(!keyframes_dirty)
+    return;
+
+  std::vector<std::pair<cv::Point2f, int64_t> > points;
+
+  points.reserve(work.grid.size() );
+
+  for(std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+      work.grid.begin(); it != work.grid.end(); ++it)
+    if(it->second)
+      points.push_back(std::make_pair(
+          cv::Point2f(it->second->pos_world.x, it->second->pos_world.y), it->first) );
+
+  // published states keep their own index
+  work.keyframes  = std::make_shared<const KeyframeIndex>(points);
+  keyframes_dirty = false;
+}
+
+float KeyframeMap::overlap(const MapPiece &map_piece, const cv::Point3f &pos_world,
+    const cv::Point2f &footprint)
+{
+  if(footprint.x <= 0 || footprint.y <= 0)
+    return 0;
+
+  const float x = 1 - fabsf(pos_world.x - map_piece.pos_world.x) / (2 * footprint.x);
+  const float y = 1 - fabsf(pos_world.y - map_piece.pos_world.y) / (2 * footprint.y);
+
+  return x > 0 && y > 0 ? x * y : 0;
+}
+
+} /* namespace cps2 */
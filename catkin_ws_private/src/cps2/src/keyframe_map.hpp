@@ -0,0 +1,91 @@
+#ifndef SRC_KEYFRAME_MAP_HPP_
+#define SRC_KEYFRAME_MAP_HPP_
+
+#include <stdint.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "map.hpp"
+
+namespace cps2 {
+
+const float MAP_KEYFRAME_OVERLAP = 0.6; //!< add a keyframe where no other overlaps more
+const int   MAP_KEYFRAME_QUERY   = 8;   //!< nearest keyframes considered per lookup
+
+/**
+ * A recorded Map of keyframes instead of one piece per grid cell. A frame becomes a new
+ * keyframe wherever no keyframe overlaps it by more than MAP_KEYFRAME_OVERLAP, see overlap().
+ * The keyframes are indexed by a KeyframeIndex, and lookups take the keyframes overlapping
+ * most with the pose, regardless of the grid. The grid_size then only scales the
+ * neighbourhoods.
+ */
+class KeyframeMap : public Map {
+public:
+  /**
+   * @param image_evaluator ImageEvaluator, which determines the representation of map pieces
+   * @param settings see MapSettings
+   */
+  KeyframeMap(cps2::ImageEvaluator *image_evaluator, const MapSettings &settings);
+
+  virtual ~KeyframeMap();
+
+  /**
+   * Get the MAP_CANDIDATES of the MAP_KEYFRAME_QUERY nearest keyframes, which overlap most
+   * with pos_world.
+   * @param pos_world pose in world frame
+   * @return list of map pieces, valid until the next call to update(), open_map_file() or
+   *         get_candidates()
+   */
+  virtual const std::vector<const MapPiece *> &get_candidates(const cv::Point3f &pos_world);
+
+protected:
+  virtual bool apply(const MapUpdate &job);
+
+  /**
+   * Only marks the KeyframeIndex as outdated, it is rebuilt on demand.
+   */
+  virtual void refresh_candidates(const int64_t key);
+
+  /**
+   * The keyframes within (cells + 0.5) * grid_size of pos_world.
+   */
+  virtual void nearby_keys(const cv::Point3f &pos_world, const int cells,
+      std::vector<int64_t> &keys);
+
+  virtual cv::Point2i cell_of(const int64_t key, const MapPiece &map_piece) {
+    return world2grid(map_piece.pos_world);
+  }
+
+  virtual uint32_t layout() const {return MAP_FILE_LAYOUT_KEYFRAMES;}
+
+  virtual void snapshot() {update_index();}
+
+  virtual void insert_pieces(const std::vector<std::pair<cv::Point2i, MapPiece> > &pieces);
+
+private:
+  /**
+   * Rebuild the KeyframeIndex of the working state, if keyframes were added or moved.
+   */
+  void update_index();
+
+  /**
+   * Approximate ratio of the area seen from pos_world, which is also seen from a map piece.
+   * Both camera footprints are taken as rectangles aligned with the world frame.
+   * @param map_piece the map piece
+   * @param pos_world pose in world frame
+   * @param footprint half the size of the camera footprint, in m
+   * @return ratio between 0 and 1
+   */
+  static float overlap(const MapPiece &map_piece, const cv::Point3f &pos_world,
+      const cv::Point2f &footprint);
+
+  std::vector<const MapPiece *> keyframe_candidates; //!< returned by get_candidates()
+  std::vector<int64_t> keyframe_query;
+
+  // written by the worker only, with state_mutex locked
+  int64_t next_keyframe; //!< key of the next keyframe
+  bool keyframes_dirty;  //!< work.keyframes is outdated
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_KEYFRAME_MAP_HPP_ */
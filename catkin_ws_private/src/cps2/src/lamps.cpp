@@ -0,0 +1,123 @@
+#include <math.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "lamps.hpp"
+
+namespace cps2 {
+
+void detect_lamps(const cv::Mat &img, std::vector<Lamp> &lamps) {
+  lamps.clear();
+
+  // brightness of the known pixels
+  double sum  = 0;
+  double sum2 = 0;
+  int pixels  = 0;
+
+  for(int r = 0; r < img.rows; ++r) {
+    const uchar *row = img.ptr<uchar>(r);
+
+    for(int c = 0; c < img.cols; ++c)
+      if(row[c] != 0) {
+        sum  += row[c];
+        sum2 += row[c] * row[c];
+        ++pixels;
+      }
+  }
+
+  if(pixels == 0)
+    return;
+
+  const float mean      = sum / pixels;
+  const float stddev    = sqrtf(std::max(0.0, sum2 / pixels - mean * mean) );
+  const float threshold = std::max(LAMP_MIN_BRIGHTNESS, mean + LAMP_CONTRAST * stddev);
+
+  cv::Mat bright(img.rows, img.cols, CV_8UC1);
+
+  for(int r = 0; r < img.rows; ++r) {
+    const uchar *row = img.ptr<uchar>(r);
+    uchar *row_b     = bright.ptr<uchar>(r);
+
+    for(int c = 0; c < img.cols; ++c)
+      row_b[c] = row[c] >= threshold ? 255 : 0;
+  }
+
+  cv::Mat labels, stats, centroids;
+  const int count = cv::connectedComponentsWithStats(bright, labels, stats, centroids, 8, CV_32S);
+
+  // label 0 is the background
+  for(int label = 1; label < count; ++label) {
+    const int x = stats.at<int>(label, cv::CC_STAT_LEFT);
+    const int y = stats.at<int>(label, cv::CC_STAT_TOP);
+    const int w = stats.at<int>(label, cv::CC_STAT_WIDTH);
+    const int h = stats.at<int>(label, cv::CC_STAT_HEIGHT);
+
+    if(stats.at<int>(label, cv::CC_STAT_AREA) < LAMP_MIN_AREA
+        || x == 0 || y == 0 || x + w == img.cols || y + h == img.rows)
+      continue;
+
+    // moments of the blob, weighted by the brightness above the threshold. A blob next to an
+    // unknown pixel was cut off.
+    double m00 = 0, m10 = 0, m01 = 0, m20 = 0, m11 = 0, m02 = 0;
+    bool cut   = false;
+
+    for(int r = y - 1; r <= y + h && !cut; ++r) {
+      const int *row_l = labels.ptr<int>(r);
+      const uchar *row = img.ptr<uchar>(r);
+
+      for(int c = x - 1; c <= x + w; ++c) {
+        if(row_l[c] != label) {
+          cut = cut || row[c] == 0;
+          continue;
+        }
+
+        const double v = row[c] - threshold + 1;
+
+        m00 += v;
+        m10 += v * c;
+        m01 += v * r;
+        m20 += v * c * c;
+        m11 += v * c * r;
+        m02 += v * r * r;
+      }
+    }
+
+    if(cut || m00 <= 0)
+      continue;
+
+    const double cx   = m10 / m00;
+    const double cy   = m01 / m00;
+    const double mu20 = m20 / m00 - cx * cx;
+    const double mu11 = m11 / m00 - cx * cy;
+    const double mu02 = m02 / m00 - cy * cy;
+
+    // eigenvalues of the covariance give the axes. A pixel wide line still has the variance
+    // 1/12 of a pixel across.
+    const double root  = sqrt(4 * mu11 * mu11 + (mu20 - mu02) * (mu20 - mu02) );
+    const double major = 0.5 * (mu20 + mu02 + root) + 1.0 / 12;
+    const double minor = 0.5 * (mu20 + mu02 - root) + 1.0 / 12;
+
+    Lamp lamp;
+
+    lamp.pos        = cv::Point2f(cx - img.cols / 2, cy - img.rows / 2);
+    lamp.angle      = axis_diff(0, 0.5 * atan2(2 * mu11, mu20 - mu02) );
+    lamp.elongation = sqrt(major / minor);
+    lamp.area       = stats.at<int>(label, cv::CC_STAT_AREA);
+
+    lamps.push_back(lamp);
+  }
+
+  std::stable_sort(lamps.begin(), lamps.end(), [](const Lamp &a, const Lamp &b) {
+    return a.area > b.area;
+  });
+
+  if(lamps.size() > LAMP_MAX_COUNT)
+    lamps.resize(LAMP_MAX_COUNT);
+}
+
+float axis_diff(const float from, const float to) {
+  const float d = to - from;
+
+  return d - M_PI * floorf( (d + M_PI / 2) / M_PI);
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,46 @@
+#ifndef SRC_LAMPS_HPP_
+#define SRC_LAMPS_HPP_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+const float LAMP_MIN_BRIGHTNESS = 160; //!< darker pixels never belong to a lamp
+const float LAMP_CONTRAST       = 2;   //!< lamps are this many stddevs brighter than the mean
+const int   LAMP_MIN_AREA       = 2;   //!< in pixels, smaller blobs are noise
+const int   LAMP_MAX_COUNT      = 16;  //!< keep only the largest lamps of an image
+const float LAMP_MIN_ELONGATION = 1.5; //!< the orientation of rounder lamps is meaningless
+
+/**
+ * A bright blob in an image of the ceiling.
+ */
+struct Lamp {
+  Lamp() : angle(0), elongation(1), area(0) {}
+
+  cv::Point2f pos;  //!< brightness weighted centroid, relative to the center of the image
+  float angle;      //!< orientation of the major axis in image coordinates, in [-pi/2, pi/2)
+  float elongation; //!< ratio of the major to the minor axis, 1 for round lamps
+  int area;         //!< in pixels
+};
+
+/**
+ * Find the lamps in an image: the connected components of pixels, which are brighter than
+ * both LAMP_MIN_BRIGHTNESS and the mean of the image plus LAMP_CONTRAST standard deviations.
+ * Blobs touching the border or unknown (zero) pixels are skipped, as their centroid would be
+ * off. Meant for the small images of an ImageEvaluator, see ImageEvaluator::transform() and
+ * ImageEvaluator::native(), whose center is the center used here.
+ * @param img a grayscale image
+ * @param lamps output list of up to LAMP_MAX_COUNT lamps, largest first
+ */
+void detect_lamps(const cv::Mat &img, std::vector<Lamp> &lamps);
+
+/**
+ * Difference between two axis orientations, i.e. modulo 180 degrees.
+ * @return d in [-pi/2, pi/2)
+ */
+float axis_diff(const float from, const float to);
+
+} /* namespace cps2 */
+
+#endif /* SRC_LAMPS_HPP_ */
@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdlib.h>
+#include <thread>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -13,20 +15,67 @@
 #include <tf/tf.h>
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
+#include "big_map.hpp"
+#include "grid_map.hpp"
+#include "keyframe_map.hpp"
 #include "map.hpp"
+#include "mosaic_map.hpp"
 #include "particle_filter.hpp"
+#include "spsc_queue.hpp"
+#include "visual_odometry.hpp"
 #include <cps2_particle_msgs/particle_msgs.h>
 
+/**
+ * A preprocessed image, handed from stage 1 (image callback) to stage 2 (filter).
+ */
+struct Frame {
+  std_msgs::Header header;
+  cv::Mat image; //!< grayscale
+  fisheye_camera_matrix::CameraMatrix camera_matrix;
+  cv::Point3f odometry; //!< fused odometry integrated over all frames, see ingest_frame()
+};
+
+/**
+ * The result of a frame, handed from stage 2 (filter) to stage 3 (publisher).
+ */
+struct Estimate {
+  Estimate() :
+    best(0, 0, 0),
+    belief(0),
+    evaluated(0),
+    cascade_passed(0),
+    cascade_rejected(0) {}
+
+  std_msgs::Header header;
+  cps2::Particle best;
+  float belief;
+  float evaluated;
+  int cascade_passed;
+  int cascade_rejected;
+  cps2::MapStats map_stats;
+#ifdef DEBUG_PF
+  std::vector<cps2::Particle> particles;
+  std::shared_ptr<const cps2::MapState> map_state;
+  cv::Mat best_img;
+#endif
+};
+
 bool has_odom          = false;
 bool has_camera_matrix = false;
 bool ready             = false;
 
 cps2::ImageEvaluator *image_evaluator;
 cps2::Map *map;
-cps2::ParticleFilter *particleFilter;
+cps2::ParticleFilterBase *particleFilter;
+cps2::VisualOdometry *visualOdometry;
+
+// queues between the stages, NULL if the image callback runs all stages
+cps2::SpscQueue<Frame> *frames       = NULL;
+cps2::SpscQueue<Estimate> *estimates = NULL;
 
-cv::Mat image;
 cv::Point3f pos_start;
+cv::Point3f odometry;      //!< of stage 1
+cv::Point3f odometry_last; //!< odometry of the last frame of stage 2
 cv::Point2f pos_relative_vel;
 nav_msgs::Odometry odom_last;
 fisheye_camera_matrix::CameraMatrix camera_matrix;
@@ -79,52 +128,145 @@ void callback_camera_matrix(const fisheye_camera_matrix_msgs::CameraMatrix &msg)
   has_camera_matrix = true;
 }
 
-void callback_image(const sensor_msgs::ImageConstPtr &msg) {
-  cv::cvtColor(cv_bridge::toCvShare(msg, "bgr8")->image, image, CV_BGR2GRAY);
+/**
+ * Stage 1: convert an image and fuse odometry with the motion seen by the camera since the
+ * last image. Runs in the image callback.
+ * @return false while the filter cannot start yet
+ */
+bool ingest_frame(const sensor_msgs::ImageConstPtr &msg, Frame &frame) {
+  if(!has_odom || !has_camera_matrix)
+    return false;
 
-  if(!ready)
-    if(has_odom && has_camera_matrix) {
+  cv::cvtColor(cv_bridge::toCvShare(msg, "bgr8")->image, frame.image, CV_BGR2GRAY);
 
-      // TODO use init functions to hide the logic
+  ros::Time now = msg->header.stamp;
+  float dt      = stamp_last_image.isZero() ? 0 : (now - stamp_last_image).toSec();
 
-      map->update(image, cps2::Particle(pos_start.x, pos_start.y, pos_start.z), camera_matrix);
-      particleFilter->addNewRandomParticles();
-      ready = true;
-    }
-    else
-      return;
+  stamp_last_image = now;
 
-  if(stamp_last_image.isZero() ) {
-    stamp_last_image = msg->header.stamp;
-    return;
+  cv::Point3f motion = visualOdometry->update(frame.image, camera_matrix,
+      dt * pos_relative_vel.x, -pos_relative_vel.y);
+
+  pos_relative_vel.y = 0;
+
+  // integrate the motion like OdometryMotion does, so the filter can skip frames
+  odometry.z  = atan2f(sinf(odometry.z + motion.z), cosf(odometry.z + motion.z) );
+  odometry.x += motion.x * cosf(odometry.z) - motion.y * sinf(odometry.z);
+  odometry.y += motion.x * sinf(odometry.z) + motion.y * cosf(odometry.z);
+
+  frame.header        = msg->header;
+  frame.camera_matrix = camera_matrix;
+  frame.odometry      = odometry;
+
+  return true;
+}
+
+/**
+ * Start the map and the particles at pos_start with the first frame.
+ */
+void init_filter(const Frame &frame) {
+  map->update(frame.image, cps2::Particle(pos_start.x, pos_start.y, pos_start.z),
+      frame.camera_matrix);
+  particleFilter->addNewRandomParticles();
+  odometry_last = frame.odometry;
+  ready         = true;
+}
+
+/**
+ * Stage 2: update the filter with a frame and hand the frame to the map worker.
+ * @return false if the frame only initialized the filter
+ */
+bool filter_frame(const Frame &frame, Estimate &estimate) {
+  if(!ready) {
+    init_filter(frame);
+    return false;
   }
 
-  ros::Time now = msg->header.stamp;
-  float dt      = (now - stamp_last_image).toSec();
+  // admit only headings that match the ceiling orientation
+  particleFilter->update_heading_prior(frame.image);
 
-  stamp_last_image = now;
+  // motion since the last frame of this stage, including the ones dropped in between
+  const float c   = cosf(frame.odometry.z);
+  const float s   = sinf(frame.odometry.z);
+  const float dx  = frame.odometry.x - odometry_last.x;
+  const float dy  = frame.odometry.y - odometry_last.y;
+  const float dth = frame.odometry.z - odometry_last.z;
 
-  particleFilter->motion_update(dt * pos_relative_vel.x, -pos_relative_vel.y);
-  particleFilter->resample();
-  particleFilter->evaluate(image);
-  
-  cps2::Particle best = particleFilter->getBest();
+  particleFilter->motion_update(c * dx + s * dy, -s * dx + c * dy, atan2f(sinf(dth), cosf(dth) ));
 
-  map->update(image, best, camera_matrix);
+  odometry_last = frame.odometry;
 
-  pos_relative_vel.y = 0;
+  // weights are carried over between frames, resample only once they degenerated
+  if(particleFilter->resample_needed() )
+    particleFilter->resample();
+
+  particleFilter->evaluate(frame.image);
+
+  estimate.header           = frame.header;
+  estimate.best             = particleFilter->getBest();
+  estimate.belief           = particleFilter->getBestSignle().belief;
+  estimate.evaluated        = particleFilter->getEvaluatedRatio();
+  estimate.cascade_passed   = particleFilter->getCascadePassed();
+  estimate.cascade_rejected = particleFilter->getCascadeRejected();
+
+  // only queues the frame, the map worker writes it
+  map->update(frame.image, estimate.best, frame.camera_matrix);
+
+  estimate.map_stats = map->get_stats();
+
+#ifdef DEBUG_PF
+  estimate.particles = particleFilter->particles;
+  estimate.map_state = map->get_state();
+
+  const std::vector<cv::Mat> mappieces = map->get_map_pieces(estimate.best.p);
+
+  estimate.best_img = mappieces.empty() ? cv::Mat() : mappieces.front();
+#endif
+
+  return true;
+}
+
+/**
+ * Stage 3: log the statistics and publish an estimate.
+ */
+void publish_estimate(const Estimate &estimate) {
+  const cps2::MapStats &map_stats = estimate.map_stats;
+  const cps2::Particle &best      = estimate.best;
+
+  ROS_INFO_THROTTLE(10, "localization_cps2_publisher: map pieces: %d (%d compressed, %d mapped), "
+      "MB: %.1f decoded, %.1f compressed, %.1f mapped, %.1f cache, %.1f arena (%d/%d slots used), "
+      "%.1f mosaic, compressions: %d, decompressions: %d, cache hits: %d, misses: %d",
+      (int)map_stats.pieces, (int)map_stats.pieces_compressed, (int)map_stats.pieces_mapped,
+      map_stats.bytes_hot / 1048576.0, map_stats.bytes_compressed / 1048576.0,
+      map_stats.bytes_mapped / 1048576.0, map_stats.bytes_cache / 1048576.0,
+      map_stats.bytes_arena / 1048576.0, (int)map_stats.arena_slots_used,
+      (int)map_stats.arena_slots, map_stats.bytes_mosaic / 1048576.0,
+      (int)map_stats.compressions, (int)map_stats.decompressions,
+      (int)map_stats.cache_hits, (int)map_stats.cache_misses);
+
+  const int cascade_tested = estimate.cascade_passed + estimate.cascade_rejected;
+
+  if(cascade_tested > 0)
+    ROS_INFO_THROTTLE(10, "localization_cps2_publisher: cascade passed %d, rejected %d particles "
+        "(%.1f%% rejected)", estimate.cascade_passed, estimate.cascade_rejected,
+        100.0f * estimate.cascade_rejected / cascade_tested);
+
+  if(frames)
+    ROS_INFO_THROTTLE(10, "localization_cps2_publisher: pipeline dropped %d frames, %d estimates",
+        (int)frames->dropped(), (int)estimates->dropped() );
 
   tf::Quaternion best_q = tf::createQuaternionFromYaw(best.p.z);
 
-  msg_particle.header.seq         = msg->header.seq;
-  msg_particle.header.stamp       = msg->header.stamp;
+  msg_particle.header.seq         = estimate.header.seq;
+  msg_particle.header.stamp       = estimate.header.stamp;
   msg_particle.pose.position.x    = best.p.x;
   msg_particle.pose.position.y    = best.p.y;
   msg_particle.pose.orientation.x = best_q.getX();
   msg_particle.pose.orientation.y = best_q.getY();
   msg_particle.pose.orientation.z = best_q.getZ();
   msg_particle.pose.orientation.w = best_q.getW();
-  msg_particle.belief = particleFilter->getBestSignle().belief;
+  msg_particle.belief = estimate.belief;
+  msg_particle.evaluated = estimate.evaluated;
   pub_particle.publish(msg_particle);
 
 #ifdef DEBUG_PF
@@ -137,13 +279,13 @@ void callback_image(const sensor_msgs::ImageConstPtr &msg) {
   // draw particles
   int i = 0;
 
-  for(std::vector<cps2::Particle>::iterator it = particleFilter->particles.begin();
-      it < particleFilter->particles.end(); ++it) {
+  for(std::vector<cps2::Particle>::const_iterator it = estimate.particles.begin();
+      it < estimate.particles.end(); ++it) {
     tf::Quaternion q  = tf::createQuaternionFromYaw(it->p.z);
     visualization_msgs::Marker *marker = &msg_markers_particles.markers[i];
 
-    marker->header.seq         = msg->header.seq;
-    marker->header.stamp       = msg->header.stamp;
+    marker->header.seq         = estimate.header.seq;
+    marker->header.stamp       = estimate.header.stamp;
     marker->pose.position.x    = it->p.x;
     marker->pose.position.y    = it->p.y;
     marker->pose.orientation.x = q.getX();
@@ -163,52 +305,48 @@ void callback_image(const sensor_msgs::ImageConstPtr &msg) {
 
   i = 0;
 
-  for(std::vector<std::vector<cps2::MapPiece> >::const_iterator it1 = map->grid.begin();
-      it1 != map->grid.end(); ++it1)
-    for(std::vector<cps2::MapPiece>::const_iterator it2 = it1->begin();
-        it2 != it1->end(); ++it2)
-      if(it2->is_set) {
-        visualization_msgs::Marker marker;
-
-        tf::Quaternion q = tf::createQuaternionFromYaw(it2->pos_world.z);
-
-        marker.header.frame_id    = "base_link";
-        marker.header.seq         = msg->header.seq;
-        marker.header.stamp       = msg->header.stamp;
-        marker.ns                 = "cps2";
-        marker.id                 = i++;
-        marker.type               = visualization_msgs::Marker::ARROW;
-        marker.action             = visualization_msgs::Marker::ADD;
-        marker.pose.position.x    = it2->pos_world.x;
-        marker.pose.position.y    = it2->pos_world.y;
-        marker.pose.position.z    = 0;
-        marker.pose.orientation.x = q.getX();
-        marker.pose.orientation.y = q.getY();
-        marker.pose.orientation.z = q.getZ();
-        marker.pose.orientation.w = q.getW();
-        marker.color.a            = 1.0;
-        marker.color.r            = 0.0;
-        marker.color.g            = 0.8;
-        marker.color.b            = 1.0;
-        marker.scale.x            = 0.4;
-        marker.scale.y            = 0.2;
-        marker.scale.z            = 0.2;
-
-        msg_markers_mappieces.markers.push_back(marker);
-      }
+  const std::shared_ptr<const cps2::MapState> &map_state = estimate.map_state;
+
+  for(std::unordered_map<int64_t, std::shared_ptr<const cps2::MapPiece> >::const_iterator it =
+      map_state->grid.begin(); it != map_state->grid.end(); ++it)
+    if(it->second) {
+      visualization_msgs::Marker marker;
+
+      tf::Quaternion q = tf::createQuaternionFromYaw(it->second->pos_world.z);
+
+      marker.header.frame_id    = "base_link";
+      marker.header.seq         = estimate.header.seq;
+      marker.header.stamp       = estimate.header.stamp;
+      marker.ns                 = "cps2";
+      marker.id                 = i++;
+      marker.type               = visualization_msgs::Marker::ARROW;
+      marker.action             = visualization_msgs::Marker::ADD;
+      marker.pose.position.x    = it->second->pos_world.x;
+      marker.pose.position.y    = it->second->pos_world.y;
+      marker.pose.position.z    = 0;
+      marker.pose.orientation.x = q.getX();
+      marker.pose.orientation.y = q.getY();
+      marker.pose.orientation.z = q.getZ();
+      marker.pose.orientation.w = q.getW();
+      marker.color.a            = 1.0;
+      marker.color.r            = 0.0;
+      marker.color.g            = 0.8;
+      marker.color.b            = 1.0;
+      marker.scale.x            = 0.4;
+      marker.scale.y            = 0.2;
+      marker.scale.z            = 0.2;
+
+      msg_markers_mappieces.markers.push_back(marker);
+    }
 
   pub_markers_mappieces.publish(msg_markers_mappieces);
 
   // publish image of map at localized pos
-  std::vector<cv::Mat> mappieces = map->get_map_pieces(best.p);
-
-  if(!mappieces.empty() ) {
-    cv::Mat best_img = mappieces.front();
-
-    msg_best = cv_bridge::CvImage(std_msgs::Header(), "mono8", best_img).toImageMsg();
+  if(!estimate.best_img.empty() ) {
+    msg_best = cv_bridge::CvImage(std_msgs::Header(), "mono8", estimate.best_img).toImageMsg();
 
-    msg_best->header.seq   = msg->header.seq;
-    msg_best->header.stamp = msg->header.stamp;
+    msg_best->header.seq   = estimate.header.seq;
+    msg_best->header.stamp = estimate.header.stamp;
 
     pub_best.publish(msg_best);
   }
@@ -219,15 +357,65 @@ void callback_image(const sensor_msgs::ImageConstPtr &msg) {
 #endif
 }
 
+/**
+ * Thread of stage 2, until frames is closed.
+ */
+void filter_loop() {
+  Frame frame;
+  Estimate estimate;
+
+  while(frames->wait_pop(frame) )
+    if(filter_frame(frame, estimate) )
+      estimates->push(estimate);
+
+  estimates->close();
+}
+
+/**
+ * Thread of stage 3, until estimates is closed.
+ */
+void publish_loop() {
+  Estimate estimate;
+
+  while(estimates->wait_pop(estimate) )
+    publish_estimate(estimate);
+}
+
+void callback_image(const sensor_msgs::ImageConstPtr &msg) {
+  Frame frame;
+
+  if(!ingest_frame(msg, frame) )
+    return;
+
+  // the filter thread takes over
+  if(frames) {
+    frames->push(frame);
+    return;
+  }
+
+  Estimate estimate;
+
+  if(filter_frame(frame, estimate) )
+    publish_estimate(estimate);
+}
+
 int main(int argc, char **argv) {
   ros::init(argc, argv, "localization_cps2_publisher");
 
-  if(argc < 18) {
+  if(argc < 19) {
     ROS_ERROR("Please use roslaunch: 'roslaunch cps2 localization_publisher[_debug].launch "
-              "[big_map:=INT] [grid_size:=FLOAT] [update_interval_min:=FLOAT] [update_interval_max:=FLOAT] [logfile:=FILE] [errorfunction:=(0|1)] [downscale:=INT] [kernel_size:=INT] "
+              "[big_map:=INT] [grid_size:=FLOAT] [update_interval_min:=FLOAT] [update_interval_max:=FLOAT] [logfile:=FILE] [errorfunction:=(0|1|2)] [downscale:=INT] [kernel_size:=INT] "
               "[kernel_stddev:=FLOAT] [particles_num:=INT] [particles_keep:=FLOAT] "
               "[particle_stddev_lin:=FLOAT] [particle_stddev_ang:=FLOAT] [hamid_sampling:=(0|1)] "
-              "[bin_size:=FLOAT] [punishEdgeParticlesRate:=FLOAT] [startPos:=BOOL]'");
+              "[bin_size:=FLOAT] [punishEdgeParticlesRate:=FLOAT] [startPos:=BOOL] "
+              "[eval_budget:=FLOAT] [eval_explore:=FLOAT] [belief_decay:=FLOAT] "
+              "[resample_ess:=FLOAT] [vo_weight:=FLOAT] [vo_downscale:=INT] [vo_budget:=FLOAT] "
+              "[vo_min_response:=FLOAT] [heading_window:=FLOAT] "
+              "[heading_prior:=FLOAT] [map_file:=FILE] [map_update_lag:=INT] "
+              "[map_memory_budget:=FLOAT] [map_cache_size:=INT] [map_graph_iterations:=INT] "
+              "[map_keyframes:=(0|1)] [map_server:=NAME] [map_mosaic:=(0|1)] "
+              "[measurement_model:=(image|field|lamps)] [cascade_threshold:=FLOAT] "
+              "[pipeline_depth:=INT]'");
     return 1;
   }
 
@@ -251,26 +439,129 @@ int main(int argc, char **argv) {
   float punishEdgeParticlesRate = atof(argv[17]);
   bool setStartPos              = atoi(argv[18]) != 0;
 
+  // settings beyond the positional arguments are private parameters, which default to the
+  // values of the launch files
+  ros::NodeHandle nh_private("~");
+  float eval_budget, eval_explore, belief_decay, resample_ess, vo_weight, vo_budget;
+  float vo_min_response, heading_window, heading_prior, map_memory_budget, cascade_threshold;
+  int vo_downscale, map_update_lag, map_cache_size, map_graph_iterations, map_keyframes;
+  int map_mosaic, pipeline_depth;
+  std::string map_file, map_server, measurement_model;
+
+  nh_private.param("eval_budget",          eval_budget,          0.0f);
+  nh_private.param("eval_explore",         eval_explore,         0.1f);
+  nh_private.param("belief_decay",         belief_decay,         0.9f);
+  nh_private.param("resample_ess",         resample_ess,         0.5f);
+  nh_private.param("vo_weight",            vo_weight,            0.0f);
+  nh_private.param("vo_downscale",         vo_downscale,         8);
+  nh_private.param("vo_budget",            vo_budget,            0.01f);
+  nh_private.param("vo_min_response",      vo_min_response,      0.1f);
+  nh_private.param("heading_window",       heading_window,       0.0f);
+  nh_private.param("heading_prior",        heading_prior,        0.0f);
+  nh_private.param("map_file",             map_file,             std::string("none") );
+  nh_private.param("map_update_lag",       map_update_lag,       0);
+  nh_private.param("map_memory_budget",    map_memory_budget,    0.0f);
+  nh_private.param("map_cache_size",       map_cache_size,       8);
+  nh_private.param("map_graph_iterations", map_graph_iterations, 0);
+  nh_private.param("map_keyframes",        map_keyframes,        0);
+  nh_private.param("map_server",           map_server,           std::string("none") );
+  nh_private.param("map_mosaic",           map_mosaic,           0);
+  nh_private.param("measurement_model",    measurement_model,    std::string("image") );
+  nh_private.param("cascade_threshold",    cascade_threshold,    0.0f);
+  nh_private.param("pipeline_depth",       pipeline_depth,       0);
+
   ROS_INFO("localization_cps2_publisher: using logfile: %s", path_log.c_str());
   ROS_INFO("localization_cps2_publisher: using big_map: %s, grid_size: %f, update_interval_min: %f, "
       "update_interval_max: %f, errorfunction: %s, downscale: %d, kernel_size: %d, "
       "kernel_stddev: %.2f, particles_num: %d, particles_keep: %.2f, particle_belief_scale: %.2f, "
       "particle_stddev_lin: %.2f, particle_stddev_ang: %.2f, hamid_sampling: %s, bin_size: %.2f, "
-      "punishEdgeParticleRate %.2f, setStartPos: %d",
+      "punishEdgeParticleRate %.2f, setStartPos: %d, eval_budget: %.3f, eval_explore: %.2f, "
+      "belief_decay: %.2f, resample_ess: %.2f, vo_weight: %.2f, vo_downscale: %d, "
+      "vo_budget: %.3f, vo_min_response: %.2f, heading_window: %.3f, "
+      "heading_prior: %.2f, map_file: %s, map_update_lag: %d, "
+      "map_memory_budget: %.1f MB, map_cache_size: %d, map_graph_iterations: %d, "
+      "map_keyframes: %s, map_server: %s, map_mosaic: %s, measurement_model: %s, "
+      "cascade_threshold: %.2f, pipeline_depth: %d",
            (big_map ? "yes" : "no"), grid_size, update_interval_min, update_interval_max,
-           (errorfunction == cps2::IE_MODE_CENTROIDS ? "centroids" : "pixels"), downscale,
+           (errorfunction == cps2::IE_MODE_CENTROIDS ? "centroids" :
+            errorfunction == cps2::IE_MODE_CHAMFER ? "chamfer" : "pixels"), downscale,
            kernel_size, kernel_stddev, particles_num, particles_keep, particle_belief_scale,
            particle_stddev_lin, particle_stddev_ang, hamid_sampling ? "on" : "off", bin_size,
-           punishEdgeParticlesRate, setStartPos);
+           punishEdgeParticlesRate, setStartPos, eval_budget, eval_explore, belief_decay,
+           resample_ess, vo_weight, vo_downscale, vo_budget, vo_min_response,
+           heading_window, heading_prior, map_file.c_str(), map_update_lag,
+           map_memory_budget, map_cache_size, map_graph_iterations,
+           map_keyframes ? "yes" : "no", map_server.c_str(), map_mosaic ? "yes" : "no",
+           measurement_model.c_str(), cascade_threshold, pipeline_depth);
 
   pos_start = cv::Point3f(grid_size / 2, grid_size / 2, 0);
 
+  // only recorded map pieces keep distance maps, see Map::get_distance_map()
+  if(errorfunction == cps2::IE_MODE_CHAMFER && (big_map || map_mosaic) ) {
+    ROS_WARN("localization_cps2_publisher: errorfunction chamfer needs map pieces, not a big map "
+        "or a mosaic, using pixels");
+    errorfunction = cps2::IE_MODE_PIXELS;
+  }
+
   image_evaluator = new cps2::ImageEvaluator(errorfunction, downscale, kernel_size, kernel_stddev);
-  map             = new cps2::Map(image_evaluator, big_map, grid_size, update_interval_min, update_interval_max);
-  particleFilter  = new cps2::ParticleFilter(map, image_evaluator,
-      particles_num, particles_keep, particle_belief_scale,
-      particle_stddev_lin, particle_stddev_ang, hamid_sampling,
-      bin_size, punishEdgeParticlesRate, setStartPos, pos_start);
+
+  cps2::MapSettings map_settings;
+
+  map_settings.grid_size           = grid_size;
+  map_settings.update_interval_min = update_interval_min;
+  map_settings.update_interval_max = update_interval_max;
+  map_settings.update_lag          = map_update_lag;
+  map_settings.memory_budget       = (size_t)(map_memory_budget * 1024 * 1024);
+  map_settings.cache_size          = map_cache_size;
+  map_settings.graph_iterations    = map_graph_iterations;
+
+  if(big_map)
+    map = new cps2::BigMap(image_evaluator, map_settings);
+  else if(map_mosaic && map_keyframes)
+    map = new cps2::MosaicMap<cps2::KeyframeMap>(image_evaluator, map_settings);
+  else if(map_mosaic)
+    map = new cps2::MosaicMap<cps2::GridMap>(image_evaluator, map_settings);
+  else if(map_keyframes)
+    map = new cps2::KeyframeMap(image_evaluator, map_settings);
+  else
+    map = new cps2::GridMap(image_evaluator, map_settings);
+
+  // share the map of a map server, or continue with a map from an earlier run
+  if(map_server != "none") {
+    if(!map->attach_server(map_server) )
+      ROS_WARN("localization_cps2_publisher: cannot attach to map server %s, recording an own map",
+          map_server.c_str() );
+  }
+  else if(map_file != "none")
+    map->open_map_file(ros::package::getPath("cps2") + std::string("/config/") + map_file);
+
+  if(measurement_model == "field")
+    particleFilter = new cps2::FieldParticleFilter(map, image_evaluator,
+        particles_num, particles_keep, particle_belief_scale,
+        particle_stddev_lin, particle_stddev_ang, hamid_sampling,
+        bin_size, punishEdgeParticlesRate, setStartPos, pos_start,
+        eval_budget, eval_explore, belief_decay, resample_ess, heading_window,
+        heading_prior, cascade_threshold);
+  else if(measurement_model == "lamps")
+    particleFilter = new cps2::LampParticleFilter(map, image_evaluator,
+        particles_num, particles_keep, particle_belief_scale,
+        particle_stddev_lin, particle_stddev_ang, hamid_sampling,
+        bin_size, punishEdgeParticlesRate, setStartPos, pos_start,
+        eval_budget, eval_explore, belief_decay, resample_ess, heading_window,
+        heading_prior, cascade_threshold);
+  else {
+    if(measurement_model != "image")
+      ROS_WARN("localization_cps2_publisher: unknown measurement_model %s, using image",
+          measurement_model.c_str() );
+
+    particleFilter = new cps2::ParticleFilter(map, image_evaluator,
+        particles_num, particles_keep, particle_belief_scale,
+        particle_stddev_lin, particle_stddev_ang, hamid_sampling,
+        bin_size, punishEdgeParticlesRate, setStartPos, pos_start,
+        eval_budget, eval_explore, belief_decay, resample_ess, heading_window,
+        heading_prior, cascade_threshold);
+  }
+  visualOdometry  = new cps2::VisualOdometry(vo_weight, vo_downscale, vo_budget, vo_min_response);
 
   ros::NodeHandle nh;
   image_transport::ImageTransport it(nh);
@@ -325,5 +616,23 @@ int main(int argc, char **argv) {
 #endif
 #endif
 
+  // preprocess the next frame while the filter evaluates the current one, and publish the
+  // previous one meanwhile
+  std::thread filter_thread;
+  std::thread publish_thread;
+
+  if(pipeline_depth > 0) {
+    frames         = new cps2::SpscQueue<Frame>(pipeline_depth);
+    estimates      = new cps2::SpscQueue<Estimate>(pipeline_depth);
+    filter_thread  = std::thread(filter_loop);
+    publish_thread = std::thread(publish_loop);
+  }
+
   ros::spin();
+
+  if(pipeline_depth > 0) {
+    frames->close();
+    filter_thread.join();
+    publish_thread.join();
+  }
 }
@@ -1,45 +1,60 @@
 #include <math.h>
+#include <string.h>
+#include <algorithm>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <ros/package.h>
 #include "map.hpp"
 
 namespace cps2 {
 
-Map::Map(cps2::ImageEvaluator *_image_evaluator, bool _is_big_map,
-    float _grid_size, float _update_interval_min, float _update_interval_max)
-    : is_big_map(_is_big_map),
-      grid_size(_grid_size),
-      update_interval_min(_update_interval_min),
-      update_interval_max(_update_interval_max),
+Map::Map(cps2::ImageEvaluator *_image_evaluator, const MapSettings &settings)
+    : grid_size(settings.grid_size),
+      update_interval_min(settings.update_interval_min),
+      update_interval_max(settings.update_interval_max),
+      keep_full_res(settings.keep_full_res),
+      update_lag(std::max(0, settings.update_lag) ),
+      memory_budget(settings.memory_budget),
+      cache_size(settings.cache_size),
+      graph_iterations(settings.graph_iterations),
       ready(false),
-      bbox(0, 0, _grid_size, _grid_size),
+      bytes_cache(0),
+      cache_hits(0),
+      cache_misses(0),
+      grid_min(0, 0),
+      grid_max(0, 0),
+      bbox(0, 0, settings.grid_size, settings.grid_size),
       image_evaluator(_image_evaluator),
-      path_now(cv::Point3f(_grid_size / 2, _grid_size / 2, 0) ),
-      path_prev(cv::Point3f(_grid_size / 2, _grid_size / 2, 0) )
+      registration(1, MAP_REGISTRATION_ANGLE_RANGE, MAP_REGISTRATION_ANGLE_STEP,
+          MAP_REGISTRATION_BUDGET),
+      path_now(cv::Point3f(settings.grid_size / 2, settings.grid_size / 2, 0) ),
+      path_prev(cv::Point3f(settings.grid_size / 2, settings.grid_size / 2, 0) ),
+      frame(0),
+      graph_last(-1),
+      frames_queued(0),
+      frames_applied(0),
+      worker_stop(false)
 {
-  if(is_big_map) {
-    std::string path_img = ros::package::getPath("cps2")
-        + std::string("/config/map.png");
+  work.bbox = bbox;
 
-    if(access(path_img.c_str(), R_OK ) == -1)
-      ROS_ERROR("Map file not found: %s", path_img.c_str() );
-
-    big_map = cv::imread(path_img);
-    dim_map = cv::Point2i(big_map.cols / 2, big_map.rows / 2);
-
-    cv::cvtColor(big_map, big_map, CV_BGR2GRAY);
-  }
-  else {
-    // start with a 1x1 grid
-    std::vector<MapPiece> v;
-    v.push_back(MapPiece() );
-    grid.push_back(v);
-  }
+  publish();
+  state = std::atomic_load(&published);
 }
 
 Map::~Map() {
+  stop_worker();
+}
+
+void Map::stop_worker() {
+  if(!worker.joinable() )
+    return;
 
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    worker_stop = true;
+  }
+
+  queue_cond.notify_one();
+  worker.join();
 }
 
 std::vector<cv::Mat> Map::get_map_pieces(const cv::Point3f &pos_world) {
@@ -48,127 +63,230 @@ std::vector<cv::Mat> Map::get_map_pieces(const cv::Point3f &pos_world) {
   if(!ready)
     return map_piece_images;
 
-  if(is_big_map) {
-    cv::Point2i pos_img = camera_matrix.relative2image(cv::Point2f(pos_world.x, pos_world.y) );
-    cv::Mat map_piece   = image_evaluator->transform(big_map,
-        pos_img + dim_map - dim_img, pos_world.z, 0, 2 * dim_img.y, 2 * dim_img.x);
+  const std::vector<const MapPiece *> &map_pieces = get_candidates(pos_world);
 
-    map_piece_images.push_back(map_piece);
-    return map_piece_images;
+  // extract the images
+  for(std::vector<const MapPiece *>::const_iterator it = map_pieces.begin();
+      it != map_pieces.end(); ++it)
+  {
+    // vector between pos_world and center of mappiece
+    cv::Point2f pos_rel(
+        pos_world.x - (*it)->pos_world.x,
+        pos_world.y - (*it)->pos_world.y);
+
+    // projection of pos_world to image plane, relative to the image center
+    cv::Point2i pos_image = camera_matrix.relative2image(pos_rel) - dim_img;
+
+    // transformed image with respect to pos_world rotation and mappiece rotation
+    map_piece_images.push_back(image_evaluator->transform_native(
+        get_image(**it), pos_image, pos_world.z, -(*it)->pos_world.z, 2 * dim_img.y, 2 * dim_img.x) );
   }
-  // ... else:
 
-  // get grid indices and world coords of the grid cells center for pos_world
-  const cv::Point2i pos_grid = world2grid(pos_world);
-  const cv::Point3f center   = grid2world(pos_grid.x, pos_grid.y);
-
-  // find up to two cells which contain a valid (set) mappiece that was recorded near pos_world
-  MapPiece map_pieces[2] = { };
-
-  const int grid_x_lb = std::max(0, pos_grid.x - 1);
-  const int grid_x_ub = std::min( (int)grid.at(0).size(), pos_grid.x + 2);
-  const int grid_y_lb = std::max(0, pos_grid.y - 1);
-  const int grid_y_ub = std::min( (int)grid.size(), pos_grid.y + 2);
-
-  for(int k = 0; k < 2; ++k) {
-    // check a 3x3 grid for image with least distance
-    for(int i = grid_y_lb; i < grid_y_ub; ++i)
-      for(int j = grid_x_lb; j < grid_x_ub; ++j) {
-        // do not use data from pos_grid itself, to avoid reading and updating the same mappiece
-        // if(i == pos_grid.y && j == pos_grid.x)
-        //   continue;
-
-        // skip unset pieces
-        if(!grid.at(i).at(j).is_set)
-          continue;
-
-        // treat k==1
-        if(k == 1 && map_pieces[0].pos_world.x == grid.at(i).at(j).pos_world.x
-            && map_pieces[0].pos_world.y == grid.at(i).at(j).pos_world.y)
-          continue;
-
-        // always prefer set pieces over unset ones. Check the distance as final criterium
-        if(!map_pieces[k].is_set
-           || dist(grid.at(i).at(j).pos_world, center) < dist(map_pieces[k].pos_world, center)
-        )
-          map_pieces[k] = grid.at(i).at(j);
-      }
+  return map_piece_images;
+}
+
+cv::Mat Map::get_map_area(const cv::Point2f &center_world, const int rows, const int cols) {
+  const int resize_scale = image_evaluator->getResizeScale();
+
+  if(!ready)
+    return cv::Mat::zeros(rows / resize_scale, cols / resize_scale, CV_8UC1);
+
+  // the pieces of all cells the area touches. The image x axis is the world y axis.
+  const cv::Point2f corner = world2image(cv::Point2f(1, 1) );
+  const float half_x = 0.5f * rows / fabsf(corner.y) + grid_size;
+  const float half_y = 0.5f * cols / fabsf(corner.x) + grid_size;
+  std::vector<const MapPiece *> pieces;
+
+  for(float x = center_world.x - half_x; x <= center_world.x + half_x; x += grid_size)
+    for(float y = center_world.y - half_y; y <= center_world.y + half_y; y += grid_size) {
+      const std::vector<const MapPiece *> &candidates = get_candidates(cv::Point3f(x, y, 0) );
+
+      pieces.insert(pieces.end(), candidates.begin(), candidates.end() );
+    }
+
+  std::sort(pieces.begin(), pieces.end() );
+  pieces.erase(std::unique(pieces.begin(), pieces.end() ), pieces.end() );
+
+  // average the known pixels of the pieces
+  cv::Mat sum   = cv::Mat::zeros(rows / resize_scale, cols / resize_scale, CV_32FC1);
+  cv::Mat count = cv::Mat::zeros(rows / resize_scale, cols / resize_scale, CV_32FC1);
+
+  for(std::vector<const MapPiece *>::const_iterator it = pieces.begin(); it != pieces.end();
+      ++it)
+  {
+    const cv::Point2i pos_image = camera_matrix.relative2image(cv::Point2f(
+        center_world.x - (*it)->pos_world.x, center_world.y - (*it)->pos_world.y) ) - dim_img;
+    const cv::Mat img = image_evaluator->transform_native(get_image(**it), pos_image, 0,
+        -(*it)->pos_world.z, rows, cols);
+
+    for(int r = 0; r < img.rows; ++r) {
+      const uchar *row = img.ptr<uchar>(r);
+      float *row_sum   = sum.ptr<float>(r);
+      float *row_count = count.ptr<float>(r);
+
+      for(int c = 0; c < img.cols; ++c)
+        if(row[c] != 0) {
+          row_sum[c]   += row[c];
+          row_count[c] += 1;
+        }
+    }
   }
 
-  // if there is no other option, use pos_grid itself
-  if(!map_pieces[0].is_set && pos_grid.x > 0 && pos_grid.y > 0
-      && pos_grid.x < grid.at(0).size() && pos_grid.y < grid.size() )
-    map_pieces[0] = grid.at(pos_grid.y).at(pos_grid.x);
+  cv::Mat area(sum.rows, sum.cols, CV_8UC1);
 
-  // extract the images
-  for(int k = 0; k < 2; ++k) {
-    if(!map_pieces[k].is_set)
-      break;
+  for(int r = 0; r < area.rows; ++r) {
+    const float *row_sum   = sum.ptr<float>(r);
+    const float *row_count = count.ptr<float>(r);
+    uchar *row             = area.ptr<uchar>(r);
 
-    // vector between pos_world and center of mappiece
-    cv::Point2f pos_rel(
-        pos_world.x - map_pieces[k].pos_world.x,
-        pos_world.y - map_pieces[k].pos_world.y);
+    for(int c = 0; c < area.cols; ++c)
+      row[c] = row_count[c] > 0 ? (uchar)(row_sum[c] / row_count[c] + 0.5f) : 0;
+  }
 
-    // projection of pos_world to image plane
-    cv::Point2i pos_image = camera_matrix.relative2image(pos_rel);
+  return area;
+}
 
-    // transformed image with respect to pos_world rotation and mappiece rotation
-    map_piece_images.push_back(image_evaluator->transform(
-        map_pieces[k].img, pos_image, pos_world.z, -map_pieces[k].pos_world.z) );
+cv::Point2f Map::world2image(const cv::Point2f &pos_world) const {
+  const float k = camera_matrix.fl / (camera_matrix.scale * camera_matrix.ceil_height);
+
+  return cv::Point2f(k * pos_world.y, -k * pos_world.x);
+}
+
+cv::Mat Map::get_distance_map(const MapPiece &map_piece) {
+  if(!map_piece.distance.empty() )
+    return map_piece.distance;
+
+  // recorded with another mode
+  if(!map_piece.is_compressed() )
+    return image_evaluator->distance_map(map_piece.img);
+
+  // compressing a piece drops its distance map, so keep it next to the decoded image
+  CacheEntry &entry = cache_lookup(map_piece);
+
+  if(entry.distance.empty() ) {
+    entry.distance = image_evaluator->distance_map(entry.img);
+
+    if(&entry != &uncached)
+      bytes_cache += entry.distance.total() * entry.distance.elemSize();
   }
 
-  return map_piece_images;
+  return entry.distance;
+}
+
+cv::Mat Map::get_image(const MapPiece &map_piece) {
+  if(!map_piece.is_compressed() )
+    return map_piece.img;
+
+  return cache_lookup(map_piece).img;
+}
+
+Map::CacheEntry &Map::cache_lookup(const MapPiece &map_piece) {
+  const std::unordered_map<const MapPiece *, std::list<CacheEntry>::iterator>::iterator it =
+      cache_index.find(&map_piece);
+
+  if(it != cache_index.end() && it->second->stamp == map_piece.stamp) {
+    ++cache_hits;
+    cache.splice(cache.begin(), cache, it->second);
+
+    return *it->second;
+  }
+
+  ++cache_misses;
+
+  // an entry of a piece that was freed meanwhile
+  if(it != cache_index.end() ) {
+    bytes_cache -= it->second->bytes();
+    cache.erase(it->second);
+    cache_index.erase(it);
+  }
+
+  CacheEntry entry;
+
+  entry.map_piece = &map_piece;
+  entry.stamp     = map_piece.stamp;
+  entry.img       = cv::imdecode(map_piece.img_compressed, cv::IMREAD_GRAYSCALE);
+
+  if(cache_size <= 0) {
+    uncached = entry;
+    return uncached;
+  }
+
+  cache.push_front(entry);
+  cache_index[&map_piece] = cache.begin();
+  bytes_cache += entry.bytes();
+
+  while(cache.size() > cache_size) {
+    bytes_cache -= cache.back().bytes();
+    cache_index.erase(cache.back().map_piece);
+    cache.pop_back();
+  }
+
+  return cache.front();
+}
+
+MapStats Map::get_stats() const {
+  MapStats stats = state->stats;
+
+  const PieceArenaStats arena_stats = arena.get_stats();
+
+  stats.bytes_cache      = bytes_cache;
+  stats.cache_hits       = cache_hits;
+  stats.cache_misses     = cache_misses;
+  stats.bytes_arena      = arena_stats.bytes;
+  stats.arena_slots      = arena_stats.slots;
+  stats.arena_slots_used = arena_stats.slots_used;
+
+  return stats;
 }
 
 cv::Point3f Map::image_distance(const cv::Mat &img1, const cv::Mat &img2,
       const cv::Point3f &pos_prev, const cv::Point3f &pos_now) {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  cv::Point3f pos_corr;
 
-  // this is a brute force experimental approach!
-  const cv::Point2i shift = camera_matrix.relative2image(
-      cv::Point2f(pos_now.x - pos_prev.x, pos_now.y - pos_prev.y) )
-      - cv::Point2i(img1.cols / 2, img1.rows / 2);
-
-  int best_x     = shift.x;
-  int best_y     = shift.y;
-  float best_th  = pos_now.z - pos_prev.z;
-  float best_err = 1;
-
-  for(float th = pos_now.z - pos_prev.z - 0.1; th <= pos_now.z - pos_prev.z + 0.1; th += 0.02)
-    for(int dx = shift.x - 10; dx <= shift.x + 10; dx += 2)
-      for(int dy = shift.y - 20; dy <= shift.y + 20; dy += 4) {
-        const cv::Mat img1_cut = transform(img1,  dx / 2,  dy / 2, 0);
-        const cv::Mat img2_cut = transform(img2, -dx / 2, -dy / 2, -th);
-        const float err        = image_evaluator->evaluate(img1_cut, img2_cut);
-
-        if(err < best_err) {
-          best_x   = dx;
-          best_y   = dy;
-          best_th  = th;
-          best_err = err;
-        }
-      }
+  native_distance(image_evaluator->native(img1), image_evaluator->native(img2),
+      pos_prev, pos_now, camera_matrix, pos_corr);
+
+  return pos_corr;
+}
 
-#ifdef DEBUG_IMAGE_DISTANCE
-  printf("correction in image frame      : %d, %d, %.2f\n",
-        best_x - shift.x, best_y - shift.y, best_th - pos_now.z + pos_prev.z);
+bool Map::native_distance(const cv::Mat &native1, const cv::Mat &native2,
+      const cv::Point3f &pos_prev, const cv::Point3f &pos_now,
+      fisheye_camera_matrix::CameraMatrix cm, cv::Point3f &pos_corr) {
+  const cv::Rect inner(IE_NATIVE_MARGIN, IE_NATIVE_MARGIN,
+      native1.cols - 2 * IE_NATIVE_MARGIN, native1.rows - 2 * IE_NATIVE_MARGIN);
 
-  cv::Mat img1_cut = transform(img1,  best_x / 2,  best_y / 2, 0);
-  cv::Mat img2_cut = transform(img2, -best_x / 2, -best_y / 2, -best_th);
-  cv::Mat canvas3(img1_cut.rows, 2 * img1_cut.cols + 20, CV_8UC1, cv::Scalar(127) );
+  pos_corr = pos_now;
 
-  img1_cut.copyTo(canvas3(cv::Rect2i(0, 0, img1_cut.cols, img1_cut.rows) ) );
-  img2_cut.copyTo(canvas3(cv::Rect2i(img1_cut.cols + 20, 0, img1_cut.cols, img1_cut.rows) ) );
+  if(native1.size() != native2.size() || inner.width <= 0 || inner.height <= 0)
+    return false;
 
-  cv::imshow("img1 (cut) <-> img2 (corrected, cut)", canvas3);
-  cv::waitKey(0);
-#endif
+  cv::Point3f shift;
+  const float response = registration.register_images(native1(inner), native2(inner),
+      pos_now.z - pos_prev.z, shift);
 
-  cv::Point2f best_rel = camera_matrix.image2relative(
-      cv::Point2i(best_x + img1.cols / 2, best_y + img1.rows / 2) )
-      + cv::Point2f(pos_prev.x, pos_prev.y);
+  if(response < MAP_REGISTRATION_MIN_RESPONSE)
+    return false;
 
-  return cv::Point3f(best_rel.x, best_rel.y, best_th + pos_prev.z);
+  // the shift is in the frame of img1 and in pixels of the native images. Rotate it into the
+  // world frame and scale it to the full resolution.
+  const float scale = image_evaluator->getResizeScale();
+  const float phc   = cosf(pos_prev.z);
+  const float phs   = sinf(pos_prev.z);
+  const cv::Point2i center = cm.relative2image(cv::Point2f(0, 0) );
+  const cv::Point2f rel    = cm.image2relative(center + cv::Point2i(
+      (int)rintf(scale * (shift.x * phc - shift.y * phs) ),
+      (int)rintf(scale * (shift.x * phs + shift.y * phc) ) ) );
+
+  const cv::Point3f pos_reg(pos_prev.x + rel.x, pos_prev.y + rel.y, pos_prev.z + shift.z);
+
+  // a correction this large is rather a mismatch than a drift of the pose
+  if(dist(pos_reg, pos_now) > MAP_REGISTRATION_MAX_CORRECTION * grid_size)
+    return false;
+
+  pos_corr = pos_reg;
+
+  return true;
 }
 
 void Map::update(const cv::Mat &image, const Particle &pos_world,
@@ -176,151 +294,550 @@ void Map::update(const cv::Mat &image, const Particle &pos_world,
   // update camera_matrix (with respect to auto-calibration, dynamic height, etc.)
   camera_matrix = _camera_matrix;
 
-  // initialization (first call to update)
+  const bool first = !ready;
+
+  // initialization (first call to update). The backend is fully constructed by now.
   if(!ready) {
-    ready = true;
-
-    if(is_big_map) {
-      dim_img = cv::Point2i(image.cols / 2, image.rows / 2);
-
-      // camera_matrix is for fixed size images - to project the upperleft corner
-      // of the map (usually (0, 0) ), shift by the difference of dimensions (a
-      // bit hacky, but least complex)
-      cv::Point2i upperleft_corner = dim_img - dim_map;
-      cv::Point2f c_rel = camera_matrix.image2relative(upperleft_corner);
-      cv::Point2f c_abs = cv::Point2f(fabs(c_rel.x), fabs(c_rel.y) );
-
-      bbox.x      = -0.95 * c_abs.x;
-      bbox.y      = -0.95 * c_abs.y;
-      bbox.width  =   1.9 * c_abs.x;
-      bbox.height =   1.9 * c_abs.y;
+    ready   = true;
+    dim_img = cv::Point2i(image.cols / 2, image.rows / 2);
+    worker  = std::thread(&Map::worker_loop, this);
+  }
+
+  camera_footprint = footprint(camera_matrix, dim_img);
+
+  MapUpdate job;
+
+  job.image         = image.clone();
+  job.pos_world     = pos_world.p;
+  job.camera_matrix = _camera_matrix;
+  job.stamp         = ros::Time::now();
+
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+
+    queue.push_back(job);
+    ++frames_queued;
+    queue_cond.notify_one();
+
+    // bound the lag of the state. The first frame defines where the map starts, so wait for it.
+    const uint64_t lag = first ? 0 : update_lag;
+
+    applied_cond.wait(lock, [this, lag] {return frames_queued - frames_applied <= lag;});
+  }
+
+  state = std::atomic_load(&published);
+  bbox  = state->bbox;
+}
+
+void Map::worker_loop() {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+
+  while(true) {
+    queue_cond.wait(lock, [this] {return !queue.empty() || worker_stop;});
+
+    // finish all queued frames before stopping, so that the map file gets them, too
+    if(queue.empty() )
+      return;
+
+    std::deque<MapUpdate> jobs;
+    jobs.swap(queue);
+
+    lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> state_lock(state_mutex);
+      bool changed = false;
+
+      if(shared.is_open() ) {
+        // the server records the map
+        for(std::deque<MapUpdate>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+          if(!shared.submit(it->image, it->pos_world, it->camera_matrix) )
+            ROS_WARN_THROTTLE(10, "Map: the map server drops frames, its queue is full or the "
+                "frames have another size");
+
+        changed = sync_server();
+      }
+      else {
+        for(std::deque<MapUpdate>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+          ++frame;
+          changed = apply(*it) || changed;
+        }
+
+        changed = optimize_graph() || changed;
+      }
+      changed = finish_batch(jobs.back().camera_matrix) || changed;
+      changed = enforce_budget(jobs.back().pos_world) || changed;
+
+      if(changed)
+        publish();
     }
+
+    lock.lock();
+
+    frames_applied += jobs.size();
+    applied_cond.notify_all();
   }
+}
+
+/**
+ * Add (sign 1) or remove (sign -1) a map piece to the statistics.
+ */
+static void count_piece(MapStats &stats, const MapPiece &map_piece, const int sign) {
+  const size_t images     = map_piece.img.total() * map_piece.img.elemSize()
+                          + map_piece.img_full.total() * map_piece.img_full.elemSize()
+                          + map_piece.distance.total() * map_piece.distance.elemSize();
+  const size_t compressed = map_piece.img_compressed.size()
+                          + map_piece.img_full_compressed.size();
+
+  stats.pieces            += sign;
+  stats.pieces_compressed += map_piece.is_compressed() ? sign : 0;
+  stats.pieces_mapped     += map_piece.mapped ? sign : 0;
+  stats.bytes_compressed  += sign * (ptrdiff_t)compressed;
+
+  if(map_piece.mapped)
+    stats.bytes_mapped += sign * (ptrdiff_t)images;
+  else
+    stats.bytes_hot    += sign * (ptrdiff_t)images;
+}
+
+void Map::store_native(MapPiece &map_piece, const cv::Mat &native,
+    const cv::Point3f &pos_world)
+{
+  cv::Mat slot = arena.allocate(world2grid(pos_world), native.rows, native.cols, native.type(),
+      map_piece.img_slot);
+
+  image_evaluator->histogram(native, map_piece.histogram);
+  detect_lamps(native, map_piece.lamps);
 
-  // nothing else to update for a big map
-  if(is_big_map)
+  if(image_evaluator->getMode() == IE_MODE_CHAMFER)
+    map_piece.distance = image_evaluator->distance_map(native);
+
+  // e.g. after the size of the camera images changed
+  if(slot.empty() ) {
+    map_piece.img = native;
     return;
-  // ... else:
+  }
+
+  native.copyTo(slot);
+  map_piece.img = slot;
+}
+
+void Map::set_piece(const int64_t key, const std::shared_ptr<const MapPiece> &map_piece) {
+  std::shared_ptr<const MapPiece> &slot = work.grid[key];
 
-  // resize the grid if needed
-  if(pos_world.p.x - grid_size < bbox.x) {
-    for(std::vector<std::vector<MapPiece> >::iterator y = grid.begin(); y != grid.end(); ++y)
-      y->insert(y->begin(), MapPiece() );
+  if(slot)
+    count_piece(work.stats, *slot, -1);
 
-    bbox.x     -= grid_size;
-    bbox.width += grid_size;
+  if(map_piece)
+    count_piece(work.stats, *map_piece, 1);
+
+  slot = map_piece;
+}
+
+bool Map::enforce_budget(const cv::Point3f &pos_world) {
+  std::vector<int64_t> hot;
+  std::vector<int64_t> changed;
+
+  nearby_keys(pos_world, MAP_HOT_RADIUS, hot);
+
+  // decode the pieces around the pose again, the particles will look them up soon
+  for(std::vector<int64_t>::const_iterator key = hot.begin(); key != hot.end(); ++key) {
+    last_used[*key] = frame;
+
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+        work.grid.find(*key);
+
+    if(it == work.grid.end() || !it->second || !it->second->is_compressed() )
+      continue;
+
+    std::shared_ptr<MapPiece> map_piece = std::make_shared<MapPiece>(*it->second);
+
+    store_native(*map_piece, cv::imdecode(map_piece->img_compressed, cv::IMREAD_GRAYSCALE),
+        map_piece->pos_world);
+
+    if(!map_piece->img_full_compressed.empty() )
+      map_piece->img_full = cv::imdecode(map_piece->img_full_compressed, cv::IMREAD_GRAYSCALE);
+
+    std::vector<uchar>().swap(map_piece->img_compressed);
+    std::vector<uchar>().swap(map_piece->img_full_compressed);
+
+    set_piece(*key, map_piece);
+    changed.push_back(*key);
+    ++work.stats.decompressions;
   }
-  else if(pos_world.p.y - grid_size < bbox.y) {
-    std::vector<MapPiece> v(bbox.width / grid_size);
 
-    grid.insert(grid.begin(), v);
+  // compress the least recently visited pieces until the budget is met
+  if(memory_budget > 0 && work.stats.bytes_hot + work.stats.bytes_compressed > memory_budget) {
+    std::vector<std::pair<uint64_t, int64_t> > order;
+
+    for(std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+        work.grid.begin(); it != work.grid.end(); ++it)
+    {
+      if(!it->second || it->second->is_compressed() || it->second->mapped)
+        continue;
+
+      const std::unordered_map<int64_t, uint64_t>::const_iterator used =
+          last_used.find(it->first);
+      const uint64_t last = used == last_used.end() ? 0 : used->second;
+
+      // just marked as hot
+      if(last == frame)
+        continue;
 
-    bbox.y      -= grid_size;
-    bbox.height += grid_size;
+      order.push_back(std::make_pair(last, it->first) );
+    }
+
+    std::sort(order.begin(), order.end() );
+
+    for(int k = 0; k < order.size()
+        && work.stats.bytes_hot + work.stats.bytes_compressed > memory_budget; ++k)
+    {
+      std::shared_ptr<MapPiece> map_piece =
+          std::make_shared<MapPiece>(*work.grid[order[k].second]);
+
+      cv::imencode(".png", map_piece->img, map_piece->img_compressed);
+      map_piece->img      = cv::Mat();
+      map_piece->distance = cv::Mat();
+      map_piece->img_slot.reset();
+
+      if(!map_piece->img_full.empty() ) {
+        cv::imencode(".png", map_piece->img_full, map_piece->img_full_compressed);
+        map_piece->img_full = cv::Mat();
+      }
+
+      set_piece(order[k].second, map_piece);
+      changed.push_back(order[k].second);
+      ++work.stats.compressions;
+    }
   }
-  else if(pos_world.p.x  + grid_size > bbox.x + bbox.width) {
-    for(std::vector<std::vector<MapPiece> >::iterator y = grid.begin(); y != grid.end(); ++y)
-      y->push_back(MapPiece() );
 
-    bbox.width += grid_size;
+  // the candidates point to the replaced pieces
+  for(std::vector<int64_t>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+    refresh_candidates(*it);
+
+  return !changed.empty();
+}
+
+void Map::publish() {
+  snapshot();
+
+  // pieces are shared, only the containers are copied
+  const std::shared_ptr<const MapState> next(new MapState(work) );
+
+  if(shared.is_open() )
+    shared_states.push_back(std::make_pair(next->generation, next) );
+
+  std::atomic_store(&published, next);
+}
+
+void Map::add_to_graph(const int64_t key, const MapPiece &map_piece,
+    const MapUpdate &job, const MapPiece *registered_with, const int64_t registered_key)
+{
+  const std::unordered_map<int64_t, int>::const_iterator found = graph_nodes.find(key);
+  int node;
+
+  if(found == graph_nodes.end() ) {
+    node              = graph.add_node(map_piece.pos_world);
+    graph_nodes[key]  = node;
+    graph_keys.push_back(key);
   }
-  else if(pos_world.p.y  + grid_size > bbox.y + bbox.height) {
-    std::vector<MapPiece> v(bbox.width / grid_size);
+  else {
+    node = found->second;
+    graph.reset_node(node, map_piece.pos_world);
+  }
+
+  // the filter's motion since the last written piece
+  if(graph_last >= 0 && graph_last != node)
+    graph.add_edge(graph_last, node, PoseGraph::relative(graph_last_estimate, job.pos_world),
+        MAP_GRAPH_ODOMETRY_LIN, MAP_GRAPH_ODOMETRY_ANG);
 
-    grid.push_back(v);
+  graph_last          = node;
+  graph_last_estimate = job.pos_world;
 
-    bbox.height += grid_size;
+  // apply() already registered the piece with the one of the previous cell
+  const std::unordered_map<int64_t, int>::const_iterator registered =
+      registered_with ? graph_nodes.find(registered_key) : graph_nodes.end();
+
+  if(registered != graph_nodes.end() )
+    graph.add_edge(registered->second, node,
+        PoseGraph::relative(registered_with->pos_world, map_piece.pos_world),
+        MAP_GRAPH_REGISTRATION_LIN, MAP_GRAPH_REGISTRATION_ANG);
+
+  // register with the nearest other decoded neighbours, closing loops with pieces recorded
+  // earlier
+  std::vector<int64_t> keys;
+  std::vector<std::pair<float, int64_t> > neighbours;
+
+  nearby_keys(job.pos_world, 1, keys);
+
+  for(std::vector<int64_t>::const_iterator key = keys.begin(); key != keys.end(); ++key) {
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+        work.grid.find(*key);
+
+    if(it == work.grid.end() || !it->second || it->second.get() == &map_piece
+        || it->second.get() == registered_with || it->second->img.empty()
+        || graph_nodes.find(it->first) == graph_nodes.end() )
+      continue;
+
+    neighbours.push_back(std::make_pair(dist(it->second->pos_world, map_piece.pos_world),
+        it->first) );
   }
 
-  // get the mappiece for pos_world
-  cv::Point2i pos_grid = world2grid(pos_world.p);
-  MapPiece *map_piece  = &(grid.at(pos_grid.y).at(pos_grid.x) );
-  cv::Point3f center   = grid2world(pos_grid.x, pos_grid.y);
-  ros::Time now        = ros::Time::now();
-  float dt             = (now - map_piece->stamp).toSec();
+  std::sort(neighbours.begin(), neighbours.end() );
+
+  if(neighbours.size() > MAP_GRAPH_LOOP_CANDIDATES)
+    neighbours.resize(MAP_GRAPH_LOOP_CANDIDATES);
 
-  if(path_now != center) {
-    path_prev = path_now;
-    path_now  = center;
+  for(std::vector<std::pair<float, int64_t> >::const_iterator it = neighbours.begin();
+      it != neighbours.end(); ++it)
+  {
+    const MapPiece &other = *work.grid[it->second];
+    cv::Point3f pos_corr;
+
+    if(native_distance(other.img, map_piece.img, other.pos_world, map_piece.pos_world,
+        job.camera_matrix, pos_corr) )
+      graph.add_edge(graph_nodes[it->second], node, PoseGraph::relative(other.pos_world, pos_corr),
+          MAP_GRAPH_REGISTRATION_LIN, MAP_GRAPH_REGISTRATION_ANG);
   }
+}
+
+bool Map::optimize_graph() {
+  if(graph_iterations <= 0)
+    return false;
+
+  std::vector<int> moved;
+  std::vector<int64_t> changed;
+
+  graph.optimize(graph_iterations, moved);
+
+  for(std::vector<int>::const_iterator it = moved.begin(); it != moved.end(); ++it) {
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator slot =
+        work.grid.find(graph_keys[*it]);
+
+    if(slot == work.grid.end() || !slot->second)
+      continue;
+
+    const cv::Point3f &pose = graph.get_pose(*it);
+    const cv::Point3f old   = slot->second->pos_world;
+
+    if(fabsf(pose.x - old.x) < MAP_GRAPH_MIN_SHIFT && fabsf(pose.y - old.y) < MAP_GRAPH_MIN_SHIFT
+        && fabsf(pose.z - old.z) < MAP_GRAPH_MIN_SHIFT)
+      continue;
+
+    // pieces may still be read through published states, so write a new one. The images are
+    // shared with the old piece.
+    std::shared_ptr<MapPiece> map_piece = std::make_shared<MapPiece>(*slot->second);
+
+    map_piece->pos_world = pose;
+
+    add_ceiling_orientation(*slot->second, -1);
+    add_ceiling_orientation(*map_piece, 1);
+
+    set_piece(graph_keys[*it], map_piece);
+    changed.push_back(graph_keys[*it]);
+    piece_moved(graph_keys[*it], old);
+
+    if(!map_file.is_open() )
+      continue;
 
-  // update the mappiece if needed
-  if(
-      !map_piece->is_set
-      //|| dt > update_interval_max
-      || (dt > update_interval_min && dist(pos_world.p, center) < dist(map_piece->pos_world, center) )
-  ) {
-    image.copyTo(map_piece->img);
-
-    map_piece->is_set = true;
-    map_piece->stamp  = now;
-
-    // correct the position
-    /* TODO Do something smart - full brute force scanning is way too slow!
-    if(path_prev != path_now) {
-      cv::Point2i path_prev_grid = world2grid(path_prev);
-
-      map_piece->pos_world = image_distance(
-          grid.at(path_prev_grid.y).at(path_prev_grid.x).img,
-          image, grid.at(path_prev_grid.y).at(path_prev_grid.x).pos_world, pos_world.p);
+    // a later record of the cell replaces the drifted one. The record needs the images.
+    if(map_piece->is_compressed() ) {
+      MapPiece decoded(*map_piece);
+
+      decoded.img = cv::imdecode(decoded.img_compressed, cv::IMREAD_GRAYSCALE);
+
+      if(!decoded.img_full_compressed.empty() )
+        decoded.img_full = cv::imdecode(decoded.img_full_compressed, cv::IMREAD_GRAYSCALE);
+
+      map_file.append(key2grid(graph_keys[*it]), decoded);
     }
-    else */
-      map_piece->pos_world = pos_world.p;
+    else
+      map_file.append(key2grid(graph_keys[*it]), *map_piece);
   }
+
+  // the candidates point to the replaced pieces and are sorted by their positions
+  for(std::vector<int64_t>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+    refresh_candidates(*it);
+
+  return !changed.empty();
 }
 
-inline cv::Point2i Map::world2grid(const cv::Point3f &pos_world) {
-  return cv::Point2i(
-      (int)floorf( (pos_world.x - bbox.x) / grid_size),
-      (int)floorf( (pos_world.y - bbox.y) / grid_size)
-  );
+void Map::nearby_keys(const cv::Point3f &pos_world, const int cells,
+    std::vector<int64_t> &keys)
+{
+  keys.clear();
+
+  const cv::Point2i pos_grid = world2grid(pos_world);
+
+  for(int i = pos_grid.y - cells; i <= pos_grid.y + cells; ++i)
+    for(int j = pos_grid.x - cells; j <= pos_grid.x + cells; ++j)
+      keys.push_back(cell_key(cv::Point2i(j, i) ) );
 }
 
-inline cv::Point3f Map::grid2world(const int &grid_x, const int &grid_y) {
-  return cv::Point3f(
-      (grid_x + 0.5) * grid_size + bbox.x,
-      (grid_y + 0.5) * grid_size + bbox.y,
-      0
-  );
+cv::Point2f Map::footprint(fisheye_camera_matrix::CameraMatrix cm, const cv::Point2i &dim) {
+  const cv::Point2f corner = cm.image2relative(cm.relative2image(cv::Point2f(0, 0) ) - dim);
+
+  return cv::Point2f(fabsf(corner.x), fabsf(corner.y) );
 }
 
-inline float Map::dist(const cv::Point3f &p1, const cv::Point3f &p2) {
-  const float x = p1.x - p2.x;
-  const float y = p1.y - p2.y;
+bool Map::open_map_file(const std::string &path) {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  std::vector<std::pair<cv::Point2i, MapPiece> > pieces;
+
+  if(shared.is_open() ) {
+    ROS_WARN("Map: map files are not supported with a map server");
+    return false;
+  }
+
+  if(!map_file.open(path, grid_size, image_evaluator->getResizeScale(),
+      image_evaluator->getKernelSize(), image_evaluator->getKernelStddev(),
+      layout(), pieces) )
+    return false;
+
+  insert_pieces(pieces);
+  publish();
+
+  state = std::atomic_load(&published);
+  bbox  = state->bbox;
 
-  return sqrtf(x * x + y * y);
+  return true;
 }
 
-cv::Mat Map::transform(const cv::Mat &img, const int dx, const int dy, const float rotation) {
-  const int cx1   = img.cols / 2;
-  const int cy1   = img.rows / 2;
-  const int dim_x = std::min(40, img.cols - 2 * abs(dx) );
-  const int dim_y = std::min(40, img.rows - 2 * abs(dy) );
-  const int cx2   = dim_x / 2;
-  const int cy2   = dim_y / 2;
-  const float phs = sinf(rotation);
-  const float phc = cosf(rotation);
-
-  cv::Mat img_tf(dim_y, dim_x, CV_8UC1);
-
-  for(int c = 0; c < dim_x; ++c) {
-    const int sx = c - cx2;
-
-    for(int r = 0; r < dim_y; ++r) {
-      const int sy   = r - cy2;
-      const float x  = sx + dx;
-      const float y  = sy + dy;
-      const float xx = x * phc - y * phs + cx1;
-      const float yy = x * phs + y * phc + cy1;
-
-      if(xx >= 0 && yy >= 0 && xx < img.cols && yy < img.rows)
-        img_tf.at<uchar>(r, c) = img.at<uchar>( rintf(yy), rintf(xx) );
-      else
-        img_tf.at<uchar>(r, c) = 0;
+bool Map::attach_server(const std::string &name) {
+  if(map_file.is_open() ) {
+    ROS_WARN("Map: a map server is not supported with a map file");
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(state_mutex);
+  SharedMapSettings settings;
+
+  memset(&settings, 0, sizeof(settings) );
+  settings.grid_size     = grid_size;
+  settings.resize_scale  = image_evaluator->getResizeScale();
+  settings.kernel_size   = image_evaluator->getKernelSize();
+  settings.kernel_stddev = image_evaluator->getKernelStddev();
+  settings.layout        = layout();
+
+  if(!shared.attach(name, settings) )
+    return false;
+
+  sync_server();
+  publish();
+
+  state = std::atomic_load(&published);
+  bbox  = state->bbox;
+
+  return true;
+}
+
+bool Map::sync_server() {
+  std::vector<std::pair<cv::Point2i, MapPiece> > pieces;
+  const bool changed = shared.sync(pieces) && !pieces.empty();
+
+  if(changed)
+    insert_pieces(pieces);
+
+  work.generation = shared.get_generation();
+
+  // the server may reuse the slots of pieces, which no published state refers to anymore
+  while(!shared_states.empty() && shared_states.front().second.expired() )
+    shared_states.pop_front();
+
+  uint64_t epoch = work.generation;
+
+  for(std::deque<std::pair<uint64_t, std::weak_ptr<const MapState> > >::const_iterator it =
+      shared_states.begin(); it != shared_states.end(); ++it)
+    if(!it->second.expired() )
+      epoch = std::min(epoch, it->first);
+
+  shared.set_epoch(epoch);
+
+  return changed;
+}
+
+void Map::insert_pieces(const std::vector<std::pair<cv::Point2i, MapPiece> > &pieces) {
+  for(std::vector<std::pair<cv::Point2i, MapPiece> >::const_iterator it = pieces.begin();
+      it != pieces.end(); ++it)
+  {
+    const int64_t key = cell_key(it->first);
+    const std::shared_ptr<const MapPiece> &slot = work.grid[key];
+
+    if(slot)
+      add_ceiling_orientation(*slot, -1);
+    else
+      extend_bbox(cell_of(key, it->second) );
+
+    std::shared_ptr<MapPiece> map_piece = std::make_shared<MapPiece>(it->second);
+
+    // neither map files nor map servers keep the histograms and lamps
+    if(map_piece->histogram.empty() && !map_piece->img.empty() ) {
+      image_evaluator->histogram(map_piece->img, map_piece->histogram);
+      detect_lamps(map_piece->img, map_piece->lamps);
+
+      if(image_evaluator->getMode() == IE_MODE_CHAMFER)
+        map_piece->distance = image_evaluator->distance_map(map_piece->img);
     }
+
+    set_piece(key, map_piece);
+
+    add_ceiling_orientation(*slot, 1);
+
+    // loaded pieces join the pose graph without edges, so they only move once new pieces
+    // are registered with them. The first one anchors the graph. The poses of a map server's
+    // pieces are up to the server.
+    if(graph_iterations > 0 && !shared.is_open()
+        && graph_nodes.find(key) == graph_nodes.end() )
+    {
+      graph_nodes[key] = graph.add_node(slot->pos_world);
+      graph_keys.push_back(key);
+    }
+  }
+
+  for(std::vector<std::pair<cv::Point2i, MapPiece> >::const_iterator it = pieces.begin();
+      it != pieces.end(); ++it)
+  {
+    refresh_candidates(cell_key(it->first) );
+    piece_written(cell_key(it->first) );
+  }
+}
+
+void Map::add_ceiling_orientation(const MapPiece &map_piece, const float sign) {
+  if(!map_piece.orientation.valid() )
+    return;
+
+  const float a = 4 * (map_piece.orientation.angle + map_piece.pos_world.z);
+
+  work.ceiling_cos += sign * map_piece.orientation.confidence * cosf(a);
+  work.ceiling_sin += sign * map_piece.orientation.confidence * sinf(a);
+}
+
+bool Map::get_ceiling_orientation(float &angle) const {
+  if(state->ceiling_cos * state->ceiling_cos + state->ceiling_sin * state->ceiling_sin < 1e-6)
+    return false;
+
+  angle = atan2f(state->ceiling_sin, state->ceiling_cos) / 4;
+
+  return true;
+}
+
+void Map::extend_bbox(const cv::Point2i &pos_grid) {
+  if(work.grid.size() == 1) {
+    grid_min = pos_grid;
+    grid_max = pos_grid;
+  }
+  else {
+    grid_min.x = std::min(grid_min.x, pos_grid.x);
+    grid_min.y = std::min(grid_min.y, pos_grid.y);
+    grid_max.x = std::max(grid_max.x, pos_grid.x);
+    grid_max.y = std::max(grid_max.y, pos_grid.y);
   }
 
-  return img_tf;
+  // keep a margin of one cell around the mapped cells, so particles can explore beyond them
+  work.bbox.x      = (grid_min.x - 1) * grid_size;
+  work.bbox.y      = (grid_min.y - 1) * grid_size;
+  work.bbox.width  = (grid_max.x - grid_min.x + 3) * grid_size;
+  work.bbox.height = (grid_max.y - grid_min.y + 3) * grid_size;
 }
 
 }
@@ -1,61 +1,392 @@
 #ifndef SRC_MAP_HPP_
 #define SRC_MAP_HPP_
 
+#include <math.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <ros/ros.h>
 #include <opencv2/core/core.hpp>
 #include "fisheye_camera_matrix/camera_matrix.hpp"
 #include "particle.hpp"
 #include "image_evaluator.hpp"
+#include "keyframe_index.hpp"
+#include "map_file.hpp"
 #include "map_piece.hpp"
+#include "mosaic.hpp"
+#include "piece_arena.hpp"
+#include "pose_graph.hpp"
+#include "registration.hpp"
+#include "shared_map.hpp"
 
 namespace cps2 {
 
+const int MAP_CANDIDATES = 2; //!< max number of map pieces to compare a pose with
+
+// registration of a new map piece with its predecessor, see Map::image_distance()
+const float MAP_REGISTRATION_ANGLE_RANGE    = 0.1;  //!< in radians, around the guess
+const float MAP_REGISTRATION_ANGLE_STEP     = 0.02; //!< in radians
+const float MAP_REGISTRATION_BUDGET         = 0.01; //!< in s
+const float MAP_REGISTRATION_MIN_RESPONSE   = 0.05; //!< keep the guess below this peak
+const float MAP_REGISTRATION_MAX_CORRECTION = 0.5;  //!< in grid cells, keep the guess beyond
+
+const int MAP_HOT_RADIUS = 2; //!< pieces within this many cells of the pose are never compressed
+
+// pose graph of the map pieces, see Map::add_to_graph()
+const int   MAP_GRAPH_LOOP_CANDIDATES  = 2;     //!< further neighbours to register a piece with
+const float MAP_GRAPH_ODOMETRY_LIN     = 100;   //!< information of odometry edges, in 1/m^2
+const float MAP_GRAPH_ODOMETRY_ANG     = 100;   //!< in 1/rad^2
+const float MAP_GRAPH_REGISTRATION_LIN = 2500;  //!< information of registration edges, in 1/m^2
+const float MAP_GRAPH_REGISTRATION_ANG = 2500;  //!< in 1/rad^2
+const float MAP_GRAPH_MIN_SHIFT        = 0.002; //!< in m or rad, smaller corrections are dropped
+
+/**
+ * Memory usage of a Map, see Map::get_stats().
+ */
+struct MapStats {
+  MapStats() :
+      pieces(0), pieces_compressed(0), pieces_mapped(0),
+      bytes_hot(0), bytes_compressed(0), bytes_mapped(0), bytes_cache(0), bytes_arena(0),
+      bytes_mosaic(0),
+      arena_slots(0), arena_slots_used(0),
+      compressions(0), decompressions(0), cache_hits(0), cache_misses(0) {}
+
+  size_t pieces;
+  size_t pieces_compressed;
+  size_t pieces_mapped;
+  size_t bytes_hot;        //!< of decoded images on the heap, counted against the budget
+  size_t bytes_compressed; //!< of compressed images, counted against the budget
+  size_t bytes_mapped;     //!< of images mapped from a MapFile, not counted
+  size_t bytes_cache;      //!< of the decoded piece cache
+  size_t bytes_arena;      //!< of the PieceArena holding the decoded native images
+  size_t bytes_mosaic;     //!< of the tiles of the Mosaic
+  size_t arena_slots;
+  size_t arena_slots_used;
+  uint64_t compressions;   //!< pieces compressed so far
+  uint64_t decompressions; //!< pieces decoded again because the pose came near
+  uint64_t cache_hits;     //!< lookups of compressed pieces found in the cache
+  uint64_t cache_misses;   //!< lookups of compressed pieces that had to be decoded
+};
+
+/**
+ * Everything the ParticleFilter reads from a recorded Map. A state is never changed once it
+ * is published, so it can be read without locks while the next one is being built.
+ */
+class MapState {
+public:
+  MapState() : ceiling_cos(0), ceiling_sin(0), generation(0) {}
+
+  cv::Rect2f bbox; //!< see Map::bbox
+
+  /**
+   * Sparse grid of map pieces, keyed by Map::cell_key() of their grid indices, or by keyframe
+   * number for a KeyframeMap. Pieces are shared between states; a changed piece is replaced
+   * by a new one.
+   */
+  std::unordered_map<int64_t, std::shared_ptr<const MapPiece> > grid;
+
+  /**
+   * Candidates per cell, see GridMap::get_candidates(). They point into grid. Empty for a
+   * KeyframeMap.
+   */
+  std::unordered_map<int64_t, std::vector<const MapPiece *> > candidates;
+
+  std::shared_ptr<const KeyframeIndex> keyframes; //!< positions of grid, for a KeyframeMap
+  std::shared_ptr<const Mosaic> mosaic;           //!< of the pieces, for a MosaicMap
+
+  // sums of the map pieces' confidence * (cos, sin) of 4 times the ceiling orientation, which
+  // maps angles that differ by 90 degrees onto the same vector
+  float ceiling_cos;
+  float ceiling_sin;
+
+  MapStats stats; //!< all but the cache and arena statistics
+
+  uint64_t generation; //!< of the SharedMap the state was synced with, see Map::attach_server()
+};
+
+/**
+ * A request to Map::update(), queued for the map worker.
+ */
+struct MapUpdate {
+  cv::Mat image;
+  cv::Point3f pos_world;
+  fisheye_camera_matrix::CameraMatrix camera_matrix;
+  ros::Time stamp;
+};
+
+/**
+ * Settings of a recorded Map, see the Map constructor.
+ */
+struct MapSettings {
+  MapSettings() :
+      grid_size(1), update_interval_min(1), update_interval_max(60), keep_full_res(false),
+      update_lag(0), memory_budget(0), cache_size(0), graph_iterations(0) {}
+
+  float grid_size;           //!< edge length (in m) of a grid cell
+  float update_interval_min; //!< do not replace a map piece until that many s have passed
+  float update_interval_max; //!< always replace a map piece after that many s (unused)
+
+  //! additionally keep the full resolution images of map pieces, e.g. for debugging or
+  //! exporting the map
+  bool keep_full_res;
+
+  //! max number of frames, by which the state read by the filter may lag behind the calls to
+  //! update(). 0 makes update() wait for the worker every frame.
+  int update_lag;
+
+  //! max bytes of map piece images in RAM, 0 for no limit. Pieces within MAP_HOT_RADIUS cells
+  //! of the pose are always kept decoded, so the budget may be exceeded if it is too small.
+  size_t memory_budget;
+
+  int cache_size;       //!< number of compressed pieces to keep decoded for lookups
+  int graph_iterations; //!< Gauss-Newton iterations per batch of frames, 0 to keep the poses
+};
+
+/**
+ * The map of the ceiling. The backends differ in how they store the map pieces and look them
+ * up, see GridMap, KeyframeMap, MosaicMap and BigMap; the node picks one.
+ *
+ * A recorded map is maintained by a worker thread. update() only queues the current frame;
+ * the worker writes the map pieces (see apply() ) and publishes a new MapState. The reading
+ * methods (get_map_pieces(), get_candidates(), get_ceiling_orientation(), bbox) use the state
+ * that was current at the last call to update(), so they never wait for the worker and see the
+ * same map during a whole frame.
+ *
+ * With a memory budget, the worker compresses the least recently visited pieces (PNG, in
+ * RAM) once the pieces exceed the budget. Pieces near the pose are decoded again. Compressed
+ * pieces that are looked up nevertheless are decoded into a small cache. The decoded native
+ * images are kept in a PieceArena.
+ *
+ * The worker also keeps a PoseGraph of the pieces. Each new piece is linked to the previously
+ * written one by the filter's odometry and to overlapping neighbours by registration. After
+ * each batch of frames, a bounded number of iterations corrects the recently linked pieces,
+ * and their corrected poses replace the recorded ones, in memory and in the map file.
+ *
+ * Attached to a map server (see SharedMap), the Map does not record anything itself. The
+ * worker submits the frames to the server and takes over the server's pieces, whose images
+ * stay in shared memory.
+ *
+ * Each piece also keeps the lamps of its image (see detect_lamps() ), relative to the piece,
+ * so the lamps form a landmark map that moves along with the pieces.
+ *
+ * The worker calls the virtual hooks of the backend, so it only starts with the first
+ * update(), and the destructor of each backend stops it with stop_worker().
+ */
 class Map {
 public:
-  Map(cps2::ImageEvaluator *image_evaluator, bool is_big_map,
-      float grid_size, float update_interval_min, float update_interval_max);
+  /**
+   * @param image_evaluator ImageEvaluator, which determines the representation of map pieces
+   * @param settings see MapSettings
+   */
+  Map(cps2::ImageEvaluator *image_evaluator, const MapSettings &settings);
 
   virtual ~Map();
 
   /**
-   * Compute vector between the centers of two images in world frame
+   * Correct the guessed position of an image by registering it with another image, see
+   * Registration. Both images are converted to the native representation first.
    * @param img1 an image
    * @param img2 another image
    * @param pos_prev position of img1 in world frame
    * @param pos_new guessed position of img2 in world frame
-   * @return corrected guess of position of img2 in world frame
+   * @return corrected guess of position of img2 in world frame, or pos_now if the images do
+   *         not fit
    */
   cv::Point3f image_distance(const cv::Mat &img1, const cv::Mat &img2, const cv::Point3f &pos_prev, const cv::Point3f &pos_now);
 
   /**
-   * Get one or more images, which are centered at pos_world in world frame.
+   * Get one or more images, which are centered at pos_world in world frame: the candidates
+   * (see get_candidates() ) transformed to the pose. A BigMap and a MosaicMap return a
+   * single image.
    * @param pos_world pose in world frame
    * @return list of images, which are centered at pos_world in world frame
    */
-  std::vector<cv::Mat> get_map_pieces(const cv::Point3f &pos_world);
+  virtual std::vector<cv::Mat> get_map_pieces(const cv::Point3f &pos_world);
+
+  /**
+   * Get an image of the map around a position, aligned with the world frame, like
+   * get_map_pieces() with a heading of 0. Overlapping map pieces are averaged.
+   * @param center_world center of the image in world frame
+   * @param rows full resolution height of the image
+   * @param cols full resolution width of the image
+   * @return the image, downscaled like the map pieces. 0 where nothing is mapped.
+   */
+  virtual cv::Mat get_map_area(const cv::Point2f &center_world, const int rows, const int cols);
+
+  /**
+   * Position of a point in the images of get_map_pieces() and get_map_area(), relative to the
+   * position of the world origin, like CameraMatrix::relative2image() but not rounded.
+   * @param pos_world point in world frame
+   * @return the position in full resolution pixels
+   */
+  cv::Point2f world2image(const cv::Point2f &pos_world) const;
+
+  /**
+   * Get the distance map of a map piece, see ImageEvaluator::distance_map(). Computed for
+   * compressed pieces and kept in the cache along with their decoded images.
+   * @param map_piece a map piece, e.g. of get_candidates()
+   * @return its distance map, in the native layout of the piece
+   */
+  cv::Mat get_distance_map(const MapPiece &map_piece);
+
+  /**
+   * Announce the area the next lookups will be in, e.g. the extent of the particles. A big
+   * map pages in its tiles of that area in the background. Does nothing otherwise.
+   * @param area_world area in world frame
+   */
+  virtual void prefetch(const cv::Rect2f &area_world) {}
 
   /**
-   * Update the map with crucial data. Should get called every frame. The map decides on
-   * best effort if a update is needed and may return immediately.
+   * Get the map pieces to compare a pose with, at most MAP_CANDIDATES.
+   * @param pos_world pose in world frame
+   * @return list of map pieces, valid until the next call to update(), open_map_file() or
+   *         get_candidates()
+   */
+  virtual const std::vector<const MapPiece *> &get_candidates(const cv::Point3f &pos_world) = 0;
+
+  /**
+   * Update the map with crucial data. Should get called every frame. The frame is queued for
+   * the worker, which decides on best effort if a map piece needs to be written. Afterwards,
+   * the latest published state becomes the one read by the filter. Only waits for the worker
+   * if it lags behind by more than update_lag frames.
    * @param image current undistorted, grayscale image
    * @param pos_world current best guess of the position in world frame
    * @param camera_matrix current camera matrix
    */
-  void update(const cv::Mat &image, const Particle &pos_world,
+  virtual void update(const cv::Mat &image, const Particle &pos_world,
       const fisheye_camera_matrix::CameraMatrix &camera_matrix);
 
+  /**
+   * Load the map pieces of a map file and append all further updates to it. A missing file
+   * is created. Not available for a big map.
+   * @param path path of the map file
+   * @return false, if the file can not be used, e.g. because it was recorded with other
+   *         grid_size or ImageEvaluator settings
+   */
+  virtual bool open_map_file(const std::string &path);
+
+  /**
+   * Use the map of a map server instead of recording one, see SharedMap. Not available for a
+   * big map or together with a map file.
+   * @param name name of the shared memory segment of the server
+   * @return false, if the server can not be used, e.g. because it runs with other grid_size
+   *         or ImageEvaluator settings
+   */
+  virtual bool attach_server(const std::string &name);
+
+  /**
+   * Get the dominant orientation of the ceiling in world frame, modulo 90 degrees, as the
+   * confidence weighted mean over all map pieces.
+   * @param angle output orientation in world frame
+   * @return false, if no map piece has a pronounced orientation
+   */
+  bool get_ceiling_orientation(float &angle) const;
+
+  /**
+   * @return memory usage of the state read by the filter and cache statistics
+   */
+  MapStats get_stats() const;
+
+  /**
+   * @return the state read by the filter, see update()
+   */
+  std::shared_ptr<const MapState> get_state() const {return state;}
+
   cv::Rect2f bbox; //!< Bounding box in world frame covering the yet mapped space
-  std::vector<std::vector<MapPiece> > grid;
 
-private:
+  const int update_lag;
+  const size_t memory_budget;
+  const int cache_size;
+  const int graph_iterations;
+
+protected:
+  /**
+   * Write a queued frame to the working state, see update(). Called by the worker with
+   * state_mutex locked.
+   * @param job the frame
+   * @return true, if a map piece was written
+   */
+  virtual bool apply(const MapUpdate &job) = 0;
+
+  /**
+   * Keep the lookups of the working state up to date after a piece was written or replaced.
+   * @param key key of the piece in MapState::grid
+   */
+  virtual void refresh_candidates(const int64_t key) = 0;
+
+  /**
+   * Get the keys of the working state's pieces near a pose: the cells within some cells of
+   * the cell of pos_world. The keys need not be in the grid.
+   * @param pos_world pose in world frame
+   * @param cells radius in cells
+   * @param keys output list of keys
+   */
+  virtual void nearby_keys(const cv::Point3f &pos_world, const int cells,
+      std::vector<int64_t> &keys);
+
+  /**
+   * Grid indices, which extend the bounding box by a piece read from a map file or server.
+   * @param key key of the piece in MapState::grid
+   * @param map_piece the piece
+   * @return grid indices
+   */
+  virtual cv::Point2i cell_of(const int64_t key, const MapPiece &map_piece) {
+    return key2grid(key);
+  }
+
+  /**
+   * @return MAP_FILE_LAYOUT_* of the keys in map files and on map servers
+   */
+  virtual uint32_t layout() const {return MAP_FILE_LAYOUT_GRID;}
+
   /**
-   * Get grid indices of nearest grid cell for some world coordinates.
-   * It's not guaranteed at any time the computed indices do exist. One should
-   * always check against bbox.
+   * Bring the lookups of the working state up to date, right before it is published.
+   */
+  virtual void snapshot() {}
+
+  /**
+   * Called whenever a piece was written by apply() or read from a map file or server.
+   * @param key key of the piece in MapState::grid
+   */
+  virtual void piece_written(const int64_t key) {}
+
+  /**
+   * Called whenever the pose graph moved a piece. The piece keeps its images.
+   * @param key key of the piece in MapState::grid
+   * @param pos_before pose of the piece before
+   */
+  virtual void piece_moved(const int64_t key, const cv::Point3f &pos_before) {}
+
+  /**
+   * Called by the worker after each batch of frames, before the memory budget is enforced.
+   * @param cm camera matrix of the latest frame
+   * @return true, if the working state changed
+   */
+  virtual bool finish_batch(const fisheye_camera_matrix::CameraMatrix &cm) {return false;}
+
+  /**
+   * Add pieces read from a map file or a map server to the working state.
+   * @param pieces the pieces and the grid indices of their keys
+   */
+  virtual void insert_pieces(const std::vector<std::pair<cv::Point2i, MapPiece> > &pieces);
+
+  /**
+   * Stop the worker after it applied all queued frames. Call it from the destructor of each
+   * backend, before the backend's members are destroyed.
+   */
+  void stop_worker();
+
+  /**
+   * Get grid indices of the grid cell containing some world coordinates. Cell (0, 0) spans
+   * [0, grid_size) in both directions. The cell does not need to exist in grid.
    * @param pos_world input world coordinates
-   * @param grid_x output grid index x
-   * @param grid_y output grid index y
+   * @return grid indices
    */
   inline cv::Point2i world2grid(const cv::Point3f &pos_world);
 
@@ -75,35 +406,223 @@ private:
    * @return euclidean distance between p1 and p2
    */
   inline float dist(const cv::Point3f &p1, const cv::Point3f &p2);
-  
-  /**
-   * Translate and rotate an image, truncating the borders.
-   *
-   * @param img
-   * @param dx
-   * @param dy
-   * @param rotation
-   * @return
-   */
-  cv::Mat transform(const cv::Mat &img, const int dx, const int dy, const float rotation);
-  
+
+  /**
+   * Key of a cell in MapState::grid.
+   * @param pos_grid grid indices
+   * @return both indices packed into 64 bits
+   */
+  inline int64_t cell_key(const cv::Point2i &pos_grid);
+
+  /**
+   * Inverse of cell_key().
+   * @param key key of a cell
+   * @return grid indices
+   */
+  inline cv::Point2i key2grid(const int64_t key);
+
+  /**
+   * Copy a native image into a slot of the arena and make it the image of a piece.
+   * @param map_piece the piece
+   * @param native the image
+   * @param pos_world pose of the piece, places the slot next to its neighbours
+   */
+  void store_native(MapPiece &map_piece, const cv::Mat &native, const cv::Point3f &pos_world);
+
+  /**
+   * Replace the piece of the working state and keep the statistics up to date.
+   * @param key key of the piece in MapState::grid
+   * @param map_piece the new piece
+   */
+  void set_piece(const int64_t key, const std::shared_ptr<const MapPiece> &map_piece);
+
+  /**
+   * Half the size of the area seen by a camera, in m.
+   * @param cm camera matrix
+   * @param dim half the size of the images, in pixels
+   * @return half width and height in world frame
+   */
+  static cv::Point2f footprint(fisheye_camera_matrix::CameraMatrix cm, const cv::Point2i &dim);
+
+  /**
+   * Get the image of a map piece for lookups, decoding it through the cache if needed.
+   * @param map_piece the map piece
+   * @return its native image
+   */
+  cv::Mat get_image(const MapPiece &map_piece);
+
+  /**
+   * Add a newly written piece to the pose graph: an odometry edge from the previously written
+   * piece and registration edges from up to MAP_GRAPH_LOOP_CANDIDATES decoded neighbours. A
+   * rewritten cell keeps its node, but loses its old edges.
+   * @param key key of the piece in MapState::grid
+   * @param map_piece the new piece
+   * @param job the frame it was written from
+   * @param registered_with the piece map_piece was registered with in apply(), or NULL
+   * @param registered_key key of registered_with
+   */
+  void add_to_graph(const int64_t key, const MapPiece &map_piece,
+      const MapUpdate &job, const MapPiece *registered_with, const int64_t registered_key);
+
+  /**
+   * Publish a copy of the working state.
+   */
+  void publish();
+
+  /**
+   * Grow bbox of the working state to cover a newly created cell, plus a margin of one cell.
+   * @param pos_grid grid indices of the new cell
+   */
+  void extend_bbox(const cv::Point2i &pos_grid);
+
+  /**
+   * Like image_distance(), for images in the native representation of the ImageEvaluator.
+   * Uses registration, so only call it with state_mutex locked.
+   * @param pos_corr output corrected position of native2, pos_now if the images do not fit
+   * @return false, if the images do not fit
+   */
+  bool native_distance(const cv::Mat &native1, const cv::Mat &native2,
+      const cv::Point3f &pos_prev, const cv::Point3f &pos_now,
+      fisheye_camera_matrix::CameraMatrix cm, cv::Point3f &pos_corr);
+
+  /**
+   * Add (or remove) the orientation of a map piece to the ceiling orientation of the working
+   * state.
+   * @param map_piece the map piece
+   * @param sign 1 to add, -1 to remove
+   */
+  void add_ceiling_orientation(const MapPiece &map_piece, const float sign);
+
   const float grid_size;
   const float update_interval_min;
   const float update_interval_max;
+  const bool keep_full_res;
 
   bool ready;
   cps2::ImageEvaluator *image_evaluator;
-  fisheye_camera_matrix::CameraMatrix camera_matrix;
+  fisheye_camera_matrix::CameraMatrix camera_matrix; //!< of the last frame, for the filter
+  cv::Point2f camera_footprint;                      //!< footprint() of the last frame
+  cv::Point2i dim_img; //!< half the size of the camera images
+  const std::vector<const MapPiece *> no_candidates;
+
+  std::shared_ptr<const MapState> state;     //!< read by the filter
+  std::shared_ptr<const MapState> published; //!< latest state, only use with std::atomic_*
+
+  // written by the worker only, with state_mutex locked
+  std::mutex state_mutex;
+  MapState work;
   cv::Point3f path_now;
   cv::Point3f path_prev;
+  MapFile map_file;
+  PieceArena arena;
+  SharedMap shared;
+
+private:
+  /**
+   * Mark the cells around a pose as visited, decode their pieces, and compress the least
+   * recently visited pieces while the working state exceeds memory_budget.
+   * @param pos_world pose of the latest frame
+   * @return true, if a piece was replaced
+   */
+  bool enforce_budget(const cv::Point3f &pos_world);
+
+  /**
+   * Run graph_iterations on the pose graph and replace the pieces, which moved noticeably.
+   * The moved pieces are appended to the map file, so they load at their corrected poses.
+   * @return true, if a piece was replaced
+   */
+  bool optimize_graph();
+
+  /**
+   * Take over the pieces the map server changed, and report the oldest generation that a
+   * published state still refers to.
+   * @return true, if a piece was replaced
+   */
+  bool sync_server();
+
+  /**
+   * Apply queued frames until stop_worker() is called.
+   */
+  void worker_loop();
+
+  // decoded images of compressed pieces, most recently used first
+  struct CacheEntry {
+    const MapPiece *map_piece;
+    ros::Time stamp; //!< tells a piece from a later one at the same address
+    cv::Mat img;
+    cv::Mat distance; //!< distance map of img, once asked for
+
+    size_t bytes() const {return img.total() + distance.total() * distance.elemSize();}
+  };
+
+  /**
+   * Find the cache entry of a compressed piece, or decode the piece into a new one.
+   * @param map_piece the compressed piece
+   * @return the entry, only valid until the next lookup
+   */
+  CacheEntry &cache_lookup(const MapPiece &map_piece);
+
+  std::list<CacheEntry> cache;
+  std::unordered_map<const MapPiece *, std::list<CacheEntry>::iterator> cache_index;
+  CacheEntry uncached; //!< the latest lookup, if cache_size is 0
+  size_t bytes_cache;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
 
-  // stuff for the (not yet obsolete?) big map
-  bool is_big_map;
-  cv::Mat big_map;
-  cv::Point2i dim_img;
-  cv::Point2i dim_map;
+  // written by the worker only, with state_mutex locked
+  cv::Point2i grid_min; //!< lowest grid indices of all cells
+  cv::Point2i grid_max; //!< highest grid indices of all cells
+  Registration registration;
+  std::deque<std::pair<uint64_t, std::weak_ptr<const MapState> > > shared_states; //!< published
+  uint64_t frame;                                  //!< frames applied so far
+  std::unordered_map<int64_t, uint64_t> last_used; //!< frame of the last visit, by key
+  PoseGraph graph;
+  std::unordered_map<int64_t, int> graph_nodes; //!< node of each piece, by key
+  std::vector<int64_t> graph_keys;              //!< key of each node
+  int graph_last;                               //!< node of the last written piece, or -1
+  cv::Point3f graph_last_estimate;              //!< filter's pose, when it was written
+
+  // queue of frames for the worker
+  std::thread worker;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cond;   //!< a frame was queued, or the worker shall stop
+  std::condition_variable applied_cond; //!< the worker applied a frame
+  std::deque<MapUpdate> queue;
+  uint64_t frames_queued;
+  uint64_t frames_applied;
+  bool worker_stop;
 };
 
+inline cv::Point2i Map::world2grid(const cv::Point3f &pos_world) {
+  return cv::Point2i(
+      (int)floorf(pos_world.x / grid_size),
+      (int)floorf(pos_world.y / grid_size)
+  );
+}
+
+inline cv::Point3f Map::grid2world(const int &grid_x, const int &grid_y) {
+  return cv::Point3f(
+      (grid_x + 0.5) * grid_size,
+      (grid_y + 0.5) * grid_size,
+      0
+  );
+}
+
+inline int64_t Map::cell_key(const cv::Point2i &pos_grid) {
+  return ( (int64_t)pos_grid.y << 32) | (uint32_t)pos_grid.x;
+}
+
+inline cv::Point2i Map::key2grid(const int64_t key) {
+  return cv::Point2i( (int32_t)(uint32_t)key, (int32_t)(key >> 32) );
+}
+
+inline float Map::dist(const cv::Point3f &p1, const cv::Point3f &p2) {
+  const float x = p1.x - p2.x;
+  const float y = p1.y - p2.y;
+
+  return sqrtf(x * x + y * y);
+}
+
 } /* namespace cps2 */
 
 #endif /* SRC_MAP_HPP_ */
@@ -0,0 +1,599 @@
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cv_bridge/cv_bridge.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <ros/ros.h>
+#include <ros/package.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/Image.h>
+#include <tf/tf.h>
+#include <cps2_particle_msgs/particle_msgs.h>
+#include "fisheye_camera_matrix/camera_matrix.hpp"
+#include "image_evaluator.hpp"
+#include "keyframe_index.hpp"
+#include "map.hpp"
+#include "map_file.hpp"
+#include "mosaic.hpp"
+#include "orientation.hpp"
+#include "pose_graph.hpp"
+#include "registration.hpp"
+#include "tiled_map.hpp"
+
+const float MAP_BUILDER_FRAME_TURN      = 0.2; //!< in radians, also keep frames turned this far
+const float MAP_BUILDER_MAX_POSE_AGE    = 0.2; //!< in s, of the pose paired with a bag's frame
+const float MAP_BUILDER_OVERLAP         = 0.5; //!< register frames closer than this many views
+const int   MAP_BUILDER_LOOP_CANDIDATES = 4;   //!< further neighbours to register a frame with
+const int   MAP_BUILDER_SWEEPS          = 20;  //!< of PoseGraph::optimize_all()
+const float MAP_BUILDER_MIN_COVERAGE    = 0.5; //!< min known part of the map file's pieces
+
+/**
+ * A recorded frame.
+ */
+struct Frame {
+  cv::Mat image;    //!< undistorted and grayscale
+  cv::Point3f pose; //!< recorded pose in world frame, optimized later
+};
+
+/**
+ * A pair of overlapping frames to register.
+ */
+struct FramePair {
+  int from;
+  int to;
+  bool registered;
+  cv::Point3f relative; //!< pose of to in the frame of from, as registered
+};
+
+/**
+ * Run fn(index, thread) for all indices in [0, count) on several threads. The threads take the
+ * next index from a shared counter, so uneven work is balanced.
+ */
+static void parallel_for(const int count, const int threads,
+    const std::function<void(int, int)> &fn)
+{
+  std::atomic<int> next(0);
+  std::vector<std::thread> workers;
+
+  for(int t = 0; t < threads; ++t)
+    workers.push_back(std::thread([&next, &fn, count, t]() {
+      for(int i = next++; i < count; i = next++)
+        fn(i, t);
+    }) );
+
+  for(std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+    it->join();
+}
+
+static float pose_distance(const cv::Point3f &a, const cv::Point3f &b) {
+  return sqrtf( (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) );
+}
+
+/**
+ * Keep a frame only if it moved or turned far enough since the last one kept.
+ */
+static void add_frame(const cv::Mat &image, const cv::Point3f &pose, const float spacing,
+    std::vector<Frame> &frames)
+{
+  if(!frames.empty() && pose_distance(frames.back().pose, pose) < spacing
+      && fabsf(cps2::PoseGraph::relative(frames.back().pose, pose).z) < MAP_BUILDER_FRAME_TURN)
+    return;
+
+  Frame frame;
+
+  frame.image = image;
+  frame.pose  = pose;
+
+  frames.push_back(frame);
+}
+
+/**
+ * Read the frames of a bag: the images of image_topic, each with the latest pose of
+ * pose_topic, which may be a cps2_particle_msgs/particle_msgs or a geometry_msgs/PoseStamped.
+ */
+static bool load_bag(const std::string &path, const std::string &image_topic,
+    const std::string &pose_topic, const float spacing, std::vector<Frame> &frames)
+{
+  rosbag::Bag bag;
+
+  try {
+    bag.open(path, rosbag::bagmode::Read);
+  }
+  catch(const rosbag::BagException &e) {
+    ROS_ERROR("map_builder: can not read %s: %s", path.c_str(), e.what() );
+    return false;
+  }
+
+  std::vector<std::string> topics;
+  topics.push_back(image_topic);
+  topics.push_back(pose_topic);
+
+  rosbag::View view(bag, rosbag::TopicQuery(topics) );
+  cv::Point3f pose;
+  ros::Time stamp_pose;
+
+  for(rosbag::View::iterator it = view.begin(); it != view.end(); ++it) {
+    if(it->getTopic() == pose_topic) {
+      const cps2_particle_msgs::particle_msgs::ConstPtr particle =
+          it->instantiate<cps2_particle_msgs::particle_msgs>();
+      const geometry_msgs::PoseStamped::ConstPtr pose_stamped =
+          it->instantiate<geometry_msgs::PoseStamped>();
+      tf::Quaternion q;
+
+      if(particle) {
+        tf::quaternionMsgToTF(particle->pose.orientation, q);
+        pose = cv::Point3f(particle->pose.position.x, particle->pose.position.y, tf::getYaw(q) );
+      }
+      else if(pose_stamped) {
+        tf::quaternionMsgToTF(pose_stamped->pose.orientation, q);
+        pose = cv::Point3f(pose_stamped->pose.position.x, pose_stamped->pose.position.y,
+            tf::getYaw(q) );
+      }
+      else
+        continue;
+
+      stamp_pose = it->getTime();
+      continue;
+    }
+
+    const sensor_msgs::ImageConstPtr msg = it->instantiate<sensor_msgs::Image>();
+
+    if(!msg || stamp_pose.isZero()
+        || (it->getTime() - stamp_pose).toSec() > MAP_BUILDER_MAX_POSE_AGE)
+      continue;
+
+    add_frame(cv_bridge::toCvCopy(msg, "mono8")->image, pose, spacing, frames);
+  }
+
+  bag.close();
+
+  return true;
+}
+
+/**
+ * Read the frames of a directory of captures/, named after their poses like
+ * "(2,223_0,705_66).png": x and y in m and the heading in degrees, with decimal commas.
+ */
+static bool load_captures(const std::string &path, std::vector<Frame> &frames) {
+  DIR *dir = opendir(path.c_str() );
+
+  if(!dir) {
+    ROS_ERROR("map_builder: can not read %s", path.c_str() );
+    return false;
+  }
+
+  std::vector<std::string> names;
+
+  for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir) )
+    names.push_back(entry->d_name);
+
+  closedir(dir);
+  std::sort(names.begin(), names.end() );
+
+  for(std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+    std::string name = *it;
+    std::replace(name.begin(), name.end(), ',', '.');
+
+    cv::Point3f pose;
+    char end;
+
+    if(sscanf(name.c_str(), "(%f_%f_%f%c", &pose.x, &pose.y, &pose.z, &end) != 4 || end != ')')
+      continue;
+
+    const cv::Mat img = cv::imread(path + "/" + *it);
+
+    if(img.empty() )
+      continue;
+
+    Frame frame;
+
+    cv::cvtColor(img, frame.image, CV_BGR2GRAY);
+    frame.pose   = pose;
+    frame.pose.z = pose.z * M_PI / 180;
+
+    frames.push_back(frame);
+  }
+
+  return true;
+}
+
+/**
+ * Read numbered frames "img1.png", "img2.png", ... of a directory of captures/ together with a
+ * trajectory of logs/, whose line i holds "x y [th]" of frame i.
+ */
+static bool load_numbered(const std::string &path, const std::string &path_trajectory,
+    const float spacing, std::vector<Frame> &frames)
+{
+  std::ifstream file(path_trajectory.c_str() );
+  std::string line;
+
+  if(!file.is_open() ) {
+    ROS_ERROR("map_builder: can not read %s", path_trajectory.c_str() );
+    return false;
+  }
+
+  for(int i = 1; getline(file, line); ++i) {
+    std::stringstream line_ss(line);
+    cv::Point3f pose(0, 0, 0);
+
+    if(!(line_ss >> pose.x >> pose.y) )
+      continue;
+
+    line_ss >> pose.z;
+
+    const cv::Mat img = cv::imread(path + "/img" + std::to_string(i) + ".png");
+
+    if(img.empty() )
+      continue;
+
+    cv::Mat gray;
+    cv::cvtColor(img, gray, CV_BGR2GRAY);
+
+    add_frame(gray, pose, spacing, frames);
+  }
+
+  return true;
+}
+
+/**
+ * Correct the recorded poses: register the frames with their predecessors and their nearest
+ * neighbours in parallel, then optimize the pose graph of all frames.
+ */
+static void register_frames(std::vector<Frame> &frames, const bool sequence,
+    fisheye_camera_matrix::CameraMatrix camera_matrix, const float grid_size,
+    const int downscale, const int kernel_size, const float kernel_stddev, const int threads)
+{
+  if(frames.size() < 2)
+    return;
+
+  // native images and their registration patches
+  std::vector<cps2::ImageEvaluator> evaluators;
+  std::vector<cps2::Registration> registrations;
+
+  for(int t = 0; t < threads; ++t) {
+    evaluators.push_back(cps2::ImageEvaluator(cps2::IE_MODE_PIXELS, downscale, kernel_size,
+        kernel_stddev) );
+    registrations.push_back(cps2::Registration(1, cps2::MAP_REGISTRATION_ANGLE_RANGE,
+        cps2::MAP_REGISTRATION_ANGLE_STEP, cps2::MAP_REGISTRATION_BUDGET) );
+  }
+
+  std::vector<cv::Mat> patches(frames.size() );
+  std::vector<float> scales(frames.size() );
+
+  parallel_for(frames.size(), threads, [&](int i, int t) {
+    const cv::Mat native = evaluators[t].native(frames[i].image);
+    const cv::Rect inner(cps2::IE_NATIVE_MARGIN, cps2::IE_NATIVE_MARGIN,
+        native.cols - 2 * cps2::IE_NATIVE_MARGIN, native.rows - 2 * cps2::IE_NATIVE_MARGIN);
+
+    patches[i] = registrations[t].patch(native(inner) );
+    scales[i]  = registrations[t].getScale(native(inner) );
+  });
+
+  // the predecessor, and the nearest neighbours overlapping enough
+  const float meters_per_pixel = camera_matrix.ceil_height * camera_matrix.scale
+                               / camera_matrix.fl;
+  const float view = 0.5f * std::min(frames[0].image.cols, frames[0].image.rows)
+                   * meters_per_pixel;
+  std::vector<std::pair<cv::Point2f, int64_t> > points;
+
+  for(int i = 0; i < frames.size(); ++i)
+    points.push_back(std::make_pair(cv::Point2f(frames[i].pose.x, frames[i].pose.y), i) );
+
+  const cps2::KeyframeIndex index(points);
+  std::vector<FramePair> pairs;
+
+  for(int i = 1; i < frames.size(); ++i) {
+    std::vector<int64_t> keys;
+    int candidates = 0;
+
+    if(sequence) {
+      FramePair pair = {i - 1, i, false, cv::Point3f()};
+      pairs.push_back(pair);
+    }
+
+    index.nearest(points[i].first, MAP_BUILDER_LOOP_CANDIDATES + 2, keys);
+
+    for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end()
+        && candidates < MAP_BUILDER_LOOP_CANDIDATES; ++it)
+    {
+      if(*it >= i || (sequence && *it == i - 1)
+          || pose_distance(frames[*it].pose, frames[i].pose) > MAP_BUILDER_OVERLAP * view)
+        continue;
+
+      FramePair pair = {(int)*it, i, false, cv::Point3f()};
+      pairs.push_back(pair);
+      ++candidates;
+    }
+  }
+
+  ROS_INFO("map_builder: registering %d pairs of frames", (int)pairs.size() );
+
+  parallel_for(pairs.size(), threads, [&](int k, int t) {
+    FramePair &pair          = pairs[k];
+    const cv::Point3f &prev  = frames[pair.from].pose;
+    const cv::Point3f &now   = frames[pair.to].pose;
+    cv::Point3f shift;
+
+    if(patches[pair.from].size() != patches[pair.to].size()
+        || registrations[t].align(patches[pair.from], patches[pair.to], now.z - prev.z, shift)
+        < cps2::MAP_REGISTRATION_MIN_RESPONSE)
+      return;
+
+    // like Map::native_distance(): rotate the shift into the world frame and scale it to the
+    // full resolution
+    const float scale = downscale / scales[pair.from];
+    const float phc   = cosf(prev.z);
+    const float phs   = sinf(prev.z);
+    fisheye_camera_matrix::CameraMatrix cm = camera_matrix;
+    const cv::Point2i center = cm.relative2image(cv::Point2f(0, 0) );
+    const cv::Point2f rel    = cm.image2relative(center + cv::Point2i(
+        (int)rintf(scale * (shift.x * phc - shift.y * phs) ),
+        (int)rintf(scale * (shift.x * phs + shift.y * phc) ) ) );
+    const cv::Point3f pos_reg(prev.x + rel.x, prev.y + rel.y, prev.z + shift.z);
+
+    if(pose_distance(pos_reg, now) > cps2::MAP_REGISTRATION_MAX_CORRECTION * grid_size)
+      return;
+
+    pair.registered = true;
+    pair.relative   = cps2::PoseGraph::relative(prev, pos_reg);
+  });
+
+  // the recorded poses keep the graph in shape, the registrations correct it
+  cps2::PoseGraph graph;
+  int registered = 0;
+
+  for(int i = 0; i < frames.size(); ++i)
+    graph.add_node(frames[i].pose);
+
+  for(std::vector<FramePair>::const_iterator it = pairs.begin(); it != pairs.end(); ++it) {
+    graph.add_edge(it->from, it->to,
+        cps2::PoseGraph::relative(frames[it->from].pose, frames[it->to].pose),
+        cps2::MAP_GRAPH_ODOMETRY_LIN, cps2::MAP_GRAPH_ODOMETRY_ANG);
+
+    if(it->registered) {
+      graph.add_edge(it->from, it->to, it->relative, cps2::MAP_GRAPH_REGISTRATION_LIN,
+          cps2::MAP_GRAPH_REGISTRATION_ANG);
+      ++registered;
+    }
+  }
+
+  ROS_INFO("map_builder: %d of %d pairs registered, optimizing", registered, (int)pairs.size() );
+
+  graph.optimize_all(MAP_BUILDER_SWEEPS);
+
+  for(int i = 0; i < frames.size(); ++i)
+    frames[i].pose = graph.get_pose(i);
+}
+
+/**
+ * Blend all frames into a mosaic. The tiles are the work items of the threads, so no two
+ * threads write the same pixels.
+ */
+static void blend_frames(const std::vector<Frame> &frames,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix, const int threads,
+    cps2::Mosaic &mosaic)
+{
+  std::unordered_map<int64_t, std::vector<int> > tile_frames;
+  std::vector<int64_t> keys;
+
+  for(int i = 0; i < frames.size(); ++i) {
+    mosaic.cover(frames[i].image.size(), frames[i].pose, camera_matrix, keys);
+    mosaic.allocate(keys);
+
+    for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+      tile_frames[*it].push_back(i);
+  }
+
+  std::vector<std::pair<int64_t, std::vector<int> > > work(tile_frames.begin(),
+      tile_frames.end() );
+
+  ROS_INFO("map_builder: blending %d frames into %d tiles", (int)frames.size(),
+      (int)work.size() );
+
+  parallel_for(work.size(), threads, [&](int k, int t) {
+    for(std::vector<int>::const_iterator it = work[k].second.begin();
+        it != work[k].second.end(); ++it)
+      mosaic.blend(work[k].first, frames[*it].image, frames[*it].pose, camera_matrix);
+  });
+}
+
+/**
+ * Write a map file with a piece per grid cell, cut from the mosaic and aligned with the world
+ * frame, so the localizer can load it with map_file:=.
+ */
+static bool write_map_file(const std::string &path, const cps2::Mosaic &mosaic,
+    const cv::Size &size, fisheye_camera_matrix::CameraMatrix camera_matrix,
+    const float grid_size, const int downscale, const int kernel_size,
+    const float kernel_stddev, const int threads)
+{
+  cps2::MapFile map_file;
+  std::vector<std::pair<cv::Point2i, cps2::MapPiece> > existing;
+
+  // a new map, not an extension of an older one
+  unlink(path.c_str() );
+
+  if(!map_file.open(path, grid_size, downscale, kernel_size, kernel_stddev,
+      cps2::MAP_FILE_LAYOUT_GRID, existing) )
+    return false;
+
+  // cells of the area covered by the mosaic, see Mosaic::world2canvas()
+  const cv::Rect bounds        = mosaic.bounds();
+  const float meters_per_pixel = camera_matrix.ceil_height * camera_matrix.scale
+                               / camera_matrix.fl;
+  const cv::Point2i grid_min(
+      (int)floorf(-(bounds.y + bounds.height) * meters_per_pixel / grid_size),
+      (int)floorf(bounds.x * meters_per_pixel / grid_size) );
+  const cv::Point2i grid_max(
+      (int)floorf(-bounds.y * meters_per_pixel / grid_size),
+      (int)floorf( (bounds.x + bounds.width) * meters_per_pixel / grid_size) );
+  const int cols = grid_max.x - grid_min.x + 1;
+  const int rows = grid_max.y - grid_min.y + 1;
+
+  std::vector<cps2::ImageEvaluator> evaluators;
+  std::vector<cps2::MapPiece> pieces(cols * rows);
+  const ros::Time stamp = ros::Time::now();
+
+  for(int t = 0; t < threads; ++t)
+    evaluators.push_back(cps2::ImageEvaluator(cps2::IE_MODE_PIXELS, downscale, kernel_size,
+        kernel_stddev) );
+
+  parallel_for(cols * rows, threads, [&](int k, int t) {
+    const cv::Point3f pos_world( (grid_min.x + k % cols + 0.5) * grid_size,
+        (grid_min.y + k / cols + 0.5) * grid_size, 0);
+    const cv::Point2f center = mosaic.world2canvas(cv::Point2f(pos_world.x, pos_world.y),
+        camera_matrix);
+    const cv::Mat img = mosaic.render(cv::Rect( (int)rintf(center.x) - size.width / 2,
+        (int)rintf(center.y) - size.height / 2, size.width, size.height) );
+
+    if(cv::countNonZero(img) < MAP_BUILDER_MIN_COVERAGE * img.total() )
+      return;
+
+    cps2::MapPiece &piece = pieces[k];
+
+    piece.img         = evaluators[t].native(img);
+    piece.orientation = cps2::OrientationHistogram(img);
+    piece.pos_world   = pos_world;
+    piece.stamp       = stamp;
+    piece.is_set      = true;
+  });
+
+  int written = 0;
+
+  for(int k = 0; k < pieces.size(); ++k)
+    if(pieces[k].is_set) {
+      if(!map_file.append(cv::Point2i(grid_min.x + k % cols, grid_min.y + k / cols), pieces[k]) )
+        return false;
+
+      ++written;
+    }
+
+  ROS_INFO("map_builder: %d map pieces written to %s", written, path.c_str() );
+
+  return true;
+}
+
+/**
+ * Build a map offline from recorded frames and poses: a ceiling mosaic in the format of
+ * config/map.png for a big map, its tiled pyramid, and a map file to load with map_file:=.
+ */
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "map_builder");
+  ros::Time::init();
+
+  if(argc < 13) {
+    ROS_ERROR("Please use roslaunch: 'roslaunch cps2 map_builder.launch "
+              "[source:=(BAG|DIR)] [trajectory:=FILE] [calib:=FILE] [grid_size:=FLOAT] "
+              "[downscale:=INT] [kernel_size:=INT] [kernel_stddev:=FLOAT] "
+              "[frame_spacing:=FLOAT] [image_topic:=TOPIC] [pose_topic:=TOPIC] "
+              "[output:=NAME] [threads:=INT]'");
+    return 1;
+  }
+
+  std::string source      = argv[1];
+  std::string trajectory  = argv[2];
+  std::string calib       = argv[3];
+  float grid_size         = atof(argv[4]);
+  int downscale           = atoi(argv[5]);
+  int kernel_size         = atoi(argv[6]);
+  float kernel_stddev     = atof(argv[7]);
+  float frame_spacing     = atof(argv[8]);
+  std::string image_topic = argv[9];
+  std::string pose_topic  = argv[10];
+  std::string output      = argv[11];
+  int threads             = atoi(argv[12]);
+
+  if(threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency() );
+
+  ROS_INFO("map_builder: using source: %s, trajectory: %s, calib: %s, grid_size: %f, "
+      "downscale: %d, kernel_size: %d, kernel_stddev: %.2f, frame_spacing: %.2f, "
+      "image_topic: %s, pose_topic: %s, output: %s, threads: %d",
+           source.c_str(), trajectory.c_str(), calib.c_str(), grid_size, downscale,
+           kernel_size, kernel_stddev, frame_spacing, image_topic.c_str(), pose_topic.c_str(),
+           output.c_str(), threads);
+
+  const std::string path_pkg = ros::package::getPath("cps2");
+  fisheye_camera_matrix::CameraMatrix camera_matrix( (ros::package::getPath(
+      "fisheye_camera_matrix") + std::string("/config/") + calib + ".calib").c_str() );
+  std::vector<Frame> frames;
+  bool sequence = true;
+
+  // a bag of logs/, or a directory of captures/
+  if(source.size() > 4 && source.compare(source.size() - 4, 4, ".bag") == 0) {
+    if(!load_bag(path_pkg + "/../../../logs/" + source, image_topic, pose_topic,
+        frame_spacing, frames) )
+      return 1;
+  }
+  else if(trajectory != "none") {
+    if(!load_numbered(path_pkg + "/../../../captures/" + source,
+        path_pkg + "/../../../logs/" + trajectory, frame_spacing, frames) )
+      return 1;
+  }
+  else {
+    if(!load_captures(path_pkg + "/../../../captures/" + source, frames) )
+      return 1;
+
+    sequence = false;
+  }
+
+  if(frames.empty() ) {
+    ROS_ERROR("map_builder: no frames with poses found");
+    return 1;
+  }
+
+  ROS_INFO("map_builder: %d frames loaded", (int)frames.size() );
+
+  register_frames(frames, sequence, camera_matrix, grid_size, downscale, kernel_size,
+      kernel_stddev, threads);
+
+  cps2::Mosaic mosaic(1);
+
+  blend_frames(frames, camera_matrix, threads, mosaic);
+
+  // the world origin is the center of map.png, see Map::get_map_pieces()
+  const cv::Rect bounds = mosaic.bounds();
+  const int half_x      = std::max(-bounds.x, bounds.x + bounds.width);
+  const int half_y      = std::max(-bounds.y, bounds.y + bounds.height);
+  const cv::Mat img     = mosaic.render(cv::Rect(-half_x, -half_y, 2 * half_x, 2 * half_y) );
+
+  const std::string path_img   = path_pkg + "/config/" + output + ".png";
+  const std::string path_tiles = path_pkg + "/config/" + output + ".tiles";
+  const std::string path_map   = path_pkg + "/config/" + output + ".map";
+
+  if(!cv::imwrite(path_img, img) ) {
+    ROS_ERROR("map_builder: can not write %s", path_img.c_str() );
+    return 1;
+  }
+
+  ROS_INFO("map_builder: mosaic of %dx%d pixels written to %s", img.cols, img.rows,
+      path_img.c_str() );
+
+  if(!cps2::TiledMap::build(path_img, path_tiles) ) {
+    ROS_ERROR("map_builder: can not write %s", path_tiles.c_str() );
+    return 1;
+  }
+
+  if(!write_map_file(path_map, mosaic, frames[0].image.size(), camera_matrix, grid_size,
+      downscale, kernel_size, kernel_stddev, threads) )
+  {
+    ROS_ERROR("map_builder: can not write %s", path_map.c_str() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <ros/ros.h>
+#include "map_file.hpp"
+
+namespace cps2 {
+
+const uint32_t MAP_FILE_RECORD_MAGIC = 0x45434950; // "PICE"
+
+MapFile::MapFile() :
+    fd(-1),
+    data(MAP_FAILED),
+    size(0)
+{
+  memset(&header, 0, sizeof(header) );
+}
+
+MapFile::~MapFile() {
+  close();
+}
+
+uint32_t MapFile::crc32(uint32_t crc, const void *data, const size_t size) {
+  static uint32_t table[256] = { };
+
+  if(table[1] == 0)
+    for(uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+
+      for(int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+      table[i] = c;
+    }
+
+  const uint8_t *p = (const uint8_t *)data;
+
+  crc = ~crc;
+
+  for(size_t i = 0; i < size; ++i)
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+/**
+ * Write all of buf to fd, retrying on partial writes.
+ */
+static bool write_all(const int fd, const void *buf, const size_t count) {
+  const char *p = (const char *)buf;
+  size_t done   = 0;
+
+  while(done < count) {
+    const ssize_t n = write(fd, p + done, count - done);
+
+    if(n < 0 && errno == EINTR)
+      continue;
+
+    if(n <= 0)
+      return false;
+
+    done += n;
+  }
+
+  return true;
+}
+
+/**
+ * Serialize a map piece to a record, including payload and padding.
+ */
+static void make_record(const cv::Point2i &pos_grid, const MapPiece &map_piece,
+    std::vector<char> &buf)
+{
+  const cv::Mat img      = map_piece.img.isContinuous() ? map_piece.img : map_piece.img.clone();
+  const cv::Mat img_full = map_piece.img_full.isContinuous() ? map_piece.img_full
+                                                             : map_piece.img_full.clone();
+  const size_t payload   = img.total() + img_full.total();
+
+  MapFileRecord record;
+  memset(&record, 0, sizeof(record) );
+
+  record.magic                  = MAP_FILE_RECORD_MAGIC;
+  record.size                   = (sizeof(record) + payload + 7) & ~(size_t)7;
+  record.cell_x                 = pos_grid.x;
+  record.cell_y                 = pos_grid.y;
+  record.x                      = map_piece.pos_world.x;
+  record.y                      = map_piece.pos_world.y;
+  record.z                      = map_piece.pos_world.z;
+  record.stamp                  = map_piece.stamp.toNSec();
+  record.orientation_angle      = map_piece.orientation.angle;
+  record.orientation_confidence = map_piece.orientation.confidence;
+  record.native_rows            = img.rows;
+  record.native_cols            = img.cols;
+  record.full_rows              = img_full.rows;
+  record.full_cols              = img_full.cols;
+
+  buf.assign(record.size, 0);
+
+  if(img.total() > 0)
+    memcpy(&buf[sizeof(record)], img.data, img.total() );
+
+  if(img_full.total() > 0)
+    memcpy(&buf[sizeof(record) + img.total()], img_full.data, img_full.total() );
+
+  record.crc = MapFile::crc32(MapFile::crc32(0, &record, offsetof(MapFileRecord, crc) ),
+      &buf[sizeof(record)], payload);
+
+  memcpy(&buf[0], &record, sizeof(record) );
+}
+
+bool MapFile::open(const std::string &_path, const float grid_size, const int resize_scale,
+    const int kernel_size, const float kernel_stddev, const uint32_t layout,
+    std::vector<std::pair<cv::Point2i, MapPiece> > &pieces)
+{
+  close();
+
+  path = _path;
+
+  memset(&header, 0, sizeof(header) );
+  strncpy(header.magic, "CPS2MAP", sizeof(header.magic) );
+  header.version       = MAP_FILE_VERSION;
+  header.header_size   = sizeof(header);
+  header.grid_size     = grid_size;
+  header.resize_scale  = resize_scale;
+  header.kernel_size   = kernel_size;
+  header.kernel_stddev = kernel_stddev;
+  header.layout        = layout;
+  header.crc           = crc32(0, &header, offsetof(MapFileHeader, crc) );
+
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+
+  if(fd < 0) {
+    ROS_ERROR("MapFile: can not open %s: %s", path.c_str(), strerror(errno) );
+    return false;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (st.st_size == 0 && !write_all(fd, &header, sizeof(header) ) ) ) {
+    ROS_ERROR("MapFile: can not initialize %s: %s", path.c_str(), strerror(errno) );
+    close();
+    return false;
+  }
+
+  int records;
+
+  if(!load(pieces, records) ) {
+    close();
+    return false;
+  }
+
+  // rewrite the file without replaced records, if they make up most of it
+  if(records > 2 * (int)pieces.size() ) {
+    const std::string path_tmp = path + ".tmp";
+    const int fd_tmp = ::open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok          = fd_tmp >= 0 && write_all(fd_tmp, &header, sizeof(header) );
+    std::vector<char> buf;
+
+    for(int i = 0; ok && i < pieces.size(); ++i) {
+      make_record(pieces[i].first, pieces[i].second, buf);
+      ok = write_all(fd_tmp, &buf[0], buf.size() );
+    }
+
+    if(fd_tmp >= 0)
+      ok = fsync(fd_tmp) == 0 && ::close(fd_tmp) == 0 && ok;
+
+    if(ok && rename(path_tmp.c_str(), path.c_str() ) == 0) {
+      ROS_INFO("MapFile: compacted %s from %d to %d records", path.c_str(), records,
+          (int)pieces.size() );
+
+      // the pieces point into the old mapping, load them again from the new file
+      pieces.clear();
+      close();
+
+      fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+
+      if(fd < 0 || !load(pieces, records) ) {
+        close();
+        return false;
+      }
+    }
+    else {
+      ROS_WARN("MapFile: compacting %s failed, keeping it as is", path.c_str() );
+      unlink(path_tmp.c_str() );
+    }
+  }
+
+  ROS_INFO("MapFile: loaded %d map pieces from %s", (int)pieces.size(), path.c_str() );
+
+  return true;
+}
+
+bool MapFile::load(std::vector<std::pair<cv::Point2i, MapPiece> > &pieces, int &records) {
+  struct stat st;
+  records = 0;
+
+  if(fstat(fd, &st) != 0 || st.st_size < sizeof(MapFileHeader) ) {
+    ROS_ERROR("MapFile: %s is too short", path.c_str() );
+    return false;
+  }
+
+  size = st.st_size;
+  data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if(data == MAP_FAILED) {
+    ROS_ERROR("MapFile: can not map %s: %s", path.c_str(), strerror(errno) );
+    return false;
+  }
+
+  // check the header against the current settings
+  MapFileHeader stored;
+  memcpy(&stored, data, sizeof(stored) );
+
+  if(memcmp(stored.magic, header.magic, sizeof(header.magic) ) != 0
+      || stored.crc != crc32(0, &stored, offsetof(MapFileHeader, crc) ) )
+  {
+    ROS_ERROR("MapFile: %s is not a map file or its header is corrupted", path.c_str() );
+    return false;
+  }
+
+  if(stored.version != MAP_FILE_VERSION) {
+    ROS_ERROR("MapFile: %s has version %u, expected %u", path.c_str(), stored.version,
+        MAP_FILE_VERSION);
+    return false;
+  }
+
+  if(memcmp(&stored, &header, sizeof(header) ) != 0) {
+    ROS_ERROR("MapFile: %s was recorded with grid_size %.2f, downscale %d, kernel_size %d, "
+        "kernel_stddev %.2f, layout %u", path.c_str(), stored.grid_size, stored.resize_scale,
+        stored.kernel_size, stored.kernel_stddev, stored.layout);
+    return false;
+  }
+
+  // read records until the first invalid one. Later records of a cell replace earlier ones.
+  std::unordered_map<int64_t, int> index;
+  size_t offset = stored.header_size;
+  uint8_t *base = (uint8_t *)data;
+
+  while(offset + sizeof(MapFileRecord) <= size) {
+    MapFileRecord record;
+    memcpy(&record, base + offset, sizeof(record) );
+
+    const size_t native  = (size_t)record.native_rows * record.native_cols;
+    const size_t full    = (size_t)record.full_rows * record.full_cols;
+    const size_t payload = native + full;
+
+    if(record.magic != MAP_FILE_RECORD_MAGIC || record.size < sizeof(record) + payload
+        || offset + record.size > size
+        || record.crc != crc32(crc32(0, &record, offsetof(MapFileRecord, crc) ),
+            base + offset + sizeof(record), payload) )
+      break;
+
+    MapPiece map_piece;
+
+    map_piece.is_set                 = true;
+    map_piece.mapped                 = true;
+    map_piece.pos_world              = cv::Point3f(record.x, record.y, record.z);
+    map_piece.stamp.fromNSec(record.stamp);
+    map_piece.orientation.angle      = record.orientation_angle;
+    map_piece.orientation.confidence = record.orientation_confidence;
+    map_piece.img = cv::Mat(record.native_rows, record.native_cols, CV_8UC1,
+        base + offset + sizeof(record) );
+
+    if(full > 0)
+      map_piece.img_full = cv::Mat(record.full_rows, record.full_cols, CV_8UC1,
+          base + offset + sizeof(record) + native);
+
+    const cv::Point2i pos_grid(record.cell_x, record.cell_y);
+    const int64_t key = ( (int64_t)pos_grid.y << 32) | (uint32_t)pos_grid.x;
+    const std::unordered_map<int64_t, int>::const_iterator it = index.find(key);
+
+    if(it == index.end() ) {
+      index[key] = pieces.size();
+      pieces.push_back(std::make_pair(pos_grid, map_piece) );
+    }
+    else
+      pieces[it->second].second = map_piece;
+
+    offset += record.size;
+    ++records;
+  }
+
+  // drop a broken tail, so that new records are appended right after the valid ones
+  if(offset < size) {
+    ROS_WARN("MapFile: dropping %d bytes of invalid data at the end of %s",
+        (int)(size - offset), path.c_str() );
+
+    if(ftruncate(fd, offset) != 0)
+      ROS_ERROR("MapFile: can not truncate %s: %s", path.c_str(), strerror(errno) );
+  }
+
+  return true;
+}
+
+bool MapFile::append(const cv::Point2i &pos_grid, const MapPiece &map_piece) {
+  if(fd < 0)
+    return false;
+
+  std::vector<char> buf;
+  make_record(pos_grid, map_piece, buf);
+
+  if(!write_all(fd, &buf[0], buf.size() ) ) {
+    ROS_ERROR("MapFile: can not write to %s: %s", path.c_str(), strerror(errno) );
+    return false;
+  }
+
+  return true;
+}
+
+void MapFile::close() {
+  if(data != MAP_FAILED)
+    munmap(data, size);
+
+  if(fd >= 0)
+    ::close(fd);
+
+  data = MAP_FAILED;
+  size = 0;
+  fd   = -1;
+}
+
+} /* namespace cps2 */
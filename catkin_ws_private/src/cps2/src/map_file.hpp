@@ -0,0 +1,135 @@
+#ifndef SRC_MAP_FILE_HPP_
+#define SRC_MAP_FILE_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "map_piece.hpp"
+
+namespace cps2 {
+
+const uint32_t MAP_FILE_VERSION = 1;
+
+// how the records' cell indices are to be read, see MapFileHeader::layout
+const uint32_t MAP_FILE_LAYOUT_GRID      = 0; //!< grid indices of the cell
+const uint32_t MAP_FILE_LAYOUT_KEYFRAMES = 1; //!< Map::key2grid() of the keyframe number
+
+/**
+ * Header at the start of a map file. A map file is only valid for the grid and the evaluator
+ * settings it was recorded with, since it stores native images (see ImageEvaluator::native).
+ */
+struct MapFileHeader {
+  char magic[8];        //!< "CPS2MAP"
+  uint32_t version;     //!< MAP_FILE_VERSION
+  uint32_t header_size; //!< sizeof(MapFileHeader)
+  float grid_size;
+  int32_t resize_scale;
+  int32_t kernel_size;
+  float kernel_stddev;
+  uint32_t layout;      //!< MAP_FILE_LAYOUT_*
+  uint32_t crc;         //!< crc32 of all fields above
+};
+
+/**
+ * Header of a map piece record. Records are appended whenever a piece is written; a later
+ * record for the same cell replaces earlier ones. The payload follows the header: the native
+ * image, then the full resolution image, if any, padded to a multiple of 8 bytes.
+ */
+struct MapFileRecord {
+  uint32_t magic;       //!< MAP_FILE_RECORD_MAGIC
+  uint32_t size;        //!< size of header, payload and padding
+  int32_t cell_x;
+  int32_t cell_y;
+  float x;
+  float y;
+  float z;
+  uint32_t reserved;
+  uint64_t stamp;       //!< in ns
+  float orientation_angle;
+  float orientation_confidence;
+  uint16_t native_rows;
+  uint16_t native_cols;
+  uint16_t full_rows;
+  uint16_t full_cols;
+  uint32_t crc;         //!< crc32 of all fields above and the payload
+  uint32_t reserved2;
+};
+
+/**
+ * Persistent, append-only storage of map pieces.
+ *
+ * Existing pieces are memory mapped read-only. Their images point directly into the mapping,
+ * so they are only paged in when first used. Reading stops at the first record that is
+ * truncated or fails its checksum, e.g. after a crash while writing.
+ */
+class MapFile {
+public:
+  MapFile();
+  virtual ~MapFile();
+
+  /**
+   * Open a map file, or create it if it does not exist. If more than half of the records
+   * are replaced by later ones, the file is compacted first.
+   *
+   * @param path path of the file
+   * @param grid_size edge length of grid cells of the map
+   * @param resize_scale resize_scale of the ImageEvaluator
+   * @param kernel_size kernel_size of the ImageEvaluator
+   * @param kernel_stddev kernel_stddev of the ImageEvaluator
+   * @param layout MAP_FILE_LAYOUT_*
+   * @param pieces output list of the stored pieces and their grid indices
+   * @return false, if the file can not be opened or was recorded with other settings
+   */
+  bool open(const std::string &path, const float grid_size, const int resize_scale,
+      const int kernel_size, const float kernel_stddev, const uint32_t layout,
+      std::vector<std::pair<cv::Point2i, MapPiece> > &pieces);
+
+  /**
+   * Append a piece to the file.
+   *
+   * @param pos_grid grid indices of the piece
+   * @param map_piece the piece
+   * @return false on write errors
+   */
+  bool append(const cv::Point2i &pos_grid, const MapPiece &map_piece);
+
+  bool is_open() const {return fd >= 0;}
+
+  /**
+   * crc32 (as used by zlib) of a buffer.
+   *
+   * @param crc crc of the preceding data, 0 at the beginning
+   * @param data the buffer
+   * @param size size of data in bytes
+   * @return updated crc
+   */
+  static uint32_t crc32(uint32_t crc, const void *data, const size_t size);
+
+private:
+  /**
+   * Map the file and read all valid records.
+   *
+   * @param pieces output list of pieces, with only the latest record per cell
+   * @param records output number of valid records
+   * @return false, if the header does not match
+   */
+  bool load(std::vector<std::pair<cv::Point2i, MapPiece> > &pieces, int &records);
+
+  /**
+   * Unmap and close the file.
+   */
+  void close();
+
+  std::string path;
+  MapFileHeader header;
+  int fd;
+  void *data;
+  size_t size;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_MAP_FILE_HPP_ */
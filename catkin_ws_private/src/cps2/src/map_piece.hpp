@@ -1,8 +1,12 @@
 #ifndef SRC_MAP_PIECE_HPP_
 #define SRC_MAP_PIECE_HPP_
 
+#include <memory>
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include <ros/time.h>
+#include "lamps.hpp"
+#include "orientation.hpp"
 
 namespace cps2 {
 
@@ -10,16 +14,32 @@ class MapPiece {
 public:
   MapPiece() :
     is_set(false),
+    mapped(false),
     pos_world(cv::Point3f() ),
     img(cv::Mat(0, 0, CV_8UC1) ),
+    img_full(cv::Mat(0, 0, CV_8UC1) ),
     stamp(ros::Time() ) {}
 
   virtual ~MapPiece() {}
 
+  /**
+   * @return true, if the images are only kept compressed, see Map::get_stats()
+   */
+  bool is_compressed() const {return !img_compressed.empty();}
+
   bool is_set;
+  bool mapped;      //!< the images point into a MapFile and are paged by the kernel
   cv::Point3f pos_world;
-  cv::Mat img;
+  cv::Mat img;      //!< image in the native representation of the ImageEvaluator
+  std::shared_ptr<void> img_slot; //!< keeps the slot of img alive, if it is in a PieceArena
+  cv::Mat img_full; //!< full resolution image, only kept if the Map is told so
+  std::vector<uchar> img_compressed;      //!< img as PNG, while img is empty
+  std::vector<uchar> img_full_compressed; //!< img_full as PNG, while img_full is empty
   ros::Time stamp;
+  OrientationHistogram orientation;
+  std::vector<float> histogram; //!< ImageEvaluator::histogram() of img, to reject poses cheaply
+  std::vector<Lamp> lamps;      //!< detect_lamps() of img, relative to the center of the piece
+  cv::Mat distance; //!< ImageEvaluator::distance_map() of img, only for IE_MODE_CHAMFER
 };
 }
 
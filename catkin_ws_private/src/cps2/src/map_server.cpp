@@ -0,0 +1,133 @@
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <opencv2/core/core.hpp>
+#include <ros/ros.h>
+#include <ros/package.h>
+#include "grid_map.hpp"
+#include "image_evaluator.hpp"
+#include "keyframe_map.hpp"
+#include "map.hpp"
+#include "map_file.hpp"
+#include "shared_map.hpp"
+
+const int MAP_SERVER_IDLE_SLEEP = 2000; //!< in us, when no client submitted a frame
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "map_server_cps2");
+
+  // all settings are private parameters, see map_server.launch
+  ros::NodeHandle nh_private("~");
+  std::string name, map_file;
+  float grid_size, update_interval_min, update_interval_max, kernel_stddev;
+  int errorfunction, downscale, kernel_size, map_keyframes, map_graph_iterations, max_pieces;
+  int queue_length, image_width, image_height;
+
+  nh_private.param("name",                 name,                 std::string("/cps2_map") );
+  nh_private.param("grid_size",            grid_size,            1.0f);
+  nh_private.param("update_interval_min",  update_interval_min,  2.0f);
+  nh_private.param("update_interval_max",  update_interval_max,  120.0f);
+  nh_private.param("errorfunction",        errorfunction,        0);
+  nh_private.param("downscale",            downscale,            25);
+  nh_private.param("kernel_size",          kernel_size,          5);
+  nh_private.param("kernel_stddev",        kernel_stddev,        2.5f);
+  nh_private.param("map_keyframes",        map_keyframes,        0);
+  nh_private.param("map_graph_iterations", map_graph_iterations, 0);
+  nh_private.param("max_pieces",           max_pieces,           4096);
+  nh_private.param("queue_length",         queue_length,         16);
+  nh_private.param("image_width",          image_width,          640);
+  nh_private.param("image_height",         image_height,         480);
+  nh_private.param("map_file",             map_file,             std::string("none") );
+
+  ROS_INFO("map_server_cps2: using name: %s, grid_size: %f, update_interval_min: %f, "
+      "update_interval_max: %f, errorfunction: %s, downscale: %d, kernel_size: %d, "
+      "kernel_stddev: %.2f, map_keyframes: %s, map_graph_iterations: %d, max_pieces: %d, "
+      "queue_length: %d, image: %dx%d, map_file: %s",
+           name.c_str(), grid_size, update_interval_min, update_interval_max,
+           (errorfunction == cps2::IE_MODE_CENTROIDS ? "centroids" :
+            errorfunction == cps2::IE_MODE_CHAMFER ? "chamfer" : "pixels"), downscale,
+           kernel_size, kernel_stddev, map_keyframes ? "yes" : "no", map_graph_iterations,
+           max_pieces, queue_length, image_width, image_height, map_file.c_str() );
+
+  cps2::ImageEvaluator image_evaluator(errorfunction, downscale, kernel_size, kernel_stddev);
+  cps2::MapSettings map_settings;
+
+  map_settings.grid_size           = grid_size;
+  map_settings.update_interval_min = update_interval_min;
+  map_settings.update_interval_max = update_interval_max;
+  map_settings.graph_iterations    = map_graph_iterations;
+
+  cps2::Map *map;
+
+  if(map_keyframes)
+    map = new cps2::KeyframeMap(&image_evaluator, map_settings);
+  else
+    map = new cps2::GridMap(&image_evaluator, map_settings);
+
+  if(map_file != "none"
+      && !map->open_map_file(ros::package::getPath("cps2") + std::string("/config/") + map_file) )
+  {
+    delete map;
+    return 1;
+  }
+
+  // the clients must use the same settings, see SharedMap::attach()
+  const cv::Mat native = image_evaluator.native(
+      cv::Mat::zeros(image_height, image_width, CV_8UC1) );
+  cps2::SharedMapSettings settings;
+
+  memset(&settings, 0, sizeof(settings) );
+  settings.grid_size     = grid_size;
+  settings.resize_scale  = downscale;
+  settings.kernel_size   = kernel_size;
+  settings.kernel_stddev = kernel_stddev;
+  settings.layout        = map_keyframes ? cps2::MAP_FILE_LAYOUT_KEYFRAMES
+                                         : cps2::MAP_FILE_LAYOUT_GRID;
+  settings.image_rows    = image_height;
+  settings.image_cols    = image_width;
+  settings.native_rows   = native.rows;
+  settings.native_cols   = native.cols;
+  settings.max_pieces    = max_pieces;
+  settings.queue_length  = queue_length;
+
+  cps2::SharedMap shared;
+
+  if(!shared.create(name, settings) ) {
+    delete map;
+    return 1;
+  }
+
+  shared.publish(map->get_state()->grid);
+
+  cv::Mat image;
+  cv::Point3f pos_world;
+  fisheye_camera_matrix::CameraMatrix camera_matrix;
+
+  while(ros::ok() ) {
+    int frames = 0;
+
+    while(shared.pop(image, pos_world, camera_matrix) ) {
+      map->update(image, cps2::Particle(pos_world.x, pos_world.y, pos_world.z), camera_matrix);
+      ++frames;
+    }
+
+    // also retries the pieces that did not fit, once clients moved on and freed their slots
+    const int written = shared.publish(map->get_state()->grid);
+
+    if(written > 0)
+      ROS_DEBUG("map_server_cps2: published %d pieces in generation %lu", written,
+          (unsigned long)shared.get_generation() );
+
+    const cps2::MapStats map_stats = map->get_stats();
+
+    ROS_INFO_THROTTLE(10, "map_server_cps2: map pieces: %d, free slots: %d, generation: %lu",
+        (int)map_stats.pieces, (int)shared.get_free_slots(),
+        (unsigned long)shared.get_generation() );
+
+    if(frames == 0)
+      usleep(MAP_SERVER_IDLE_SLEEP);
+  }
+
+  shared.close();
+  delete map;
+}
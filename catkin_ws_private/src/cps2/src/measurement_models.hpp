@@ -0,0 +1,683 @@
+#ifndef SRC_MEASUREMENT_MODELS_HPP_
+#define SRC_MEASUREMENT_MODELS_HPP_
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "image_evaluator.hpp"
+#include "lamps.hpp"
+#include "map.hpp"
+#include "particle.hpp"
+
+namespace cps2 {
+
+// likelihood field, see FieldMeasurement
+const int   FIELD_MAX_EXTENT   = 120;  //!< in pixels of the map pieces, wider clouds fall back
+const float FIELD_HEADING_STEP = 0.03; //!< in radians, between the headings of the field
+const int   FIELD_MAX_HEADINGS = 48;   //!< the step grows for clouds spread over more headings
+const float FIELD_MIN_OVERLAP  = 0.5;  //!< fraction of the frame that must overlap the map
+
+// lamp landmarks, see LampMeasurement
+const float LAMP_MAX_DISTANCE = 3; //!< in pixels of the map pieces, farther lamps do not match
+const float LAMP_ANGLE_WEIGHT = 2; //!< pixels per radian of orientation difference
+
+/*
+ * Measurement policies for ParticleFilterT. Each one is constructed from the Map, the
+ * ImageEvaluator, the (squared) particle_belief_scale and the heading_window of the filter and
+ * provides
+ *
+ *   void prepare(const cv::Mat &img, const std::vector<Particle> &particles);
+ *   bool measure(cv::Point3f &pos_world, float &belief);
+ *
+ * prepare() is called once per frame with the undistorted, grayscale image and the Particles
+ * about to be measured. measure()
+ * computes the belief of a single pose and returns false if there is no map data for it.
+ * It may replace the heading of the pose by the best heading nearby.
+ */
+
+/**
+ * Compare the current image with the map pieces near a pose, using an ImageEvaluator.
+ *
+ * With a heading_window, each pose is scored for all headings within +-heading_window at once:
+ * the map pieces and the image are compared in polar coordinates, where a rotation is a cyclic
+ * shift of rows. The pose takes the heading with the highest belief.
+ *
+ * With IE_MODE_CHAMFER, the edge points of the image are extracted once per frame and each
+ * pose places them on the distance maps of the map pieces (see Map::get_distance_map() ), so
+ * no map piece is transformed and the heading_window is not used. A big map or a mosaic has no
+ * distance maps, so it cannot be used with IE_MODE_CHAMFER.
+ */
+class ImageMeasurement {
+public:
+  ImageMeasurement(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator,
+      const float _belief_scale, const float _heading_window) :
+    map(_map),
+    image_evaluator(_image_evaluator),
+    belief_scale(_belief_scale),
+    heading_window(_heading_window > 0 ? _heading_window : 0),
+    heading_steps(0),
+    heading_step(0) {}
+
+  void prepare(const cv::Mat &img, const std::vector<Particle> &particles) {
+    // set up img by applying the same blur and downscale which were applied to the mappieces
+    img_tf = image_evaluator->transform(img, cv::Point2i(img.cols / 2, img.rows / 2), 0, 0);
+
+    if(image_evaluator->getMode() == IE_MODE_CHAMFER) {
+      image_evaluator->edge_points(img_tf, edge_points);
+      heading_steps = 0;
+    }
+    else if(heading_window > 0) {
+      img_polar     = image_evaluator->polar(img_tf);
+      heading_step  = image_evaluator->getPolarStep(img_tf);
+      heading_steps = (int)roundf(heading_window / heading_step);
+    }
+  }
+
+  bool measure(cv::Point3f &pos_world, float &belief) {
+    if(image_evaluator->getMode() == IE_MODE_CHAMFER)
+      return measure_chamfer(pos_world, belief);
+
+    // get a list of mappieces near this pose
+    const std::vector<cv::Mat> mappieces = map->get_map_pieces(pos_world);
+
+    if(mappieces.empty() )
+      return false;
+
+    if(heading_steps > 0)
+      return measure_heading(mappieces, pos_world, belief);
+
+    // do the actual evaluation. Sum up the beliefs to compute a mean
+    belief = 0;
+
+    for(std::vector<cv::Mat>::const_iterator it = mappieces.begin(); it != mappieces.end(); ++it) {
+      const float e = image_evaluator->evaluate(img_tf, *it);
+
+      belief += expf(-belief_scale * e * e);
+    }
+
+    belief /= mappieces.size();
+
+    return true;
+  }
+
+private:
+  bool measure_chamfer(const cv::Point3f &pos_world, float &belief) {
+    const std::vector<const MapPiece *> &candidates = map->get_candidates(pos_world);
+
+    if(candidates.empty() )
+      return false;
+
+    belief = 0;
+
+    for(std::vector<const MapPiece *>::const_iterator it = candidates.begin();
+        it != candidates.end(); ++it)
+    {
+      // like Map::get_map_pieces()
+      const cv::Point2f offset = map->world2image(cv::Point2f(pos_world.x - (*it)->pos_world.x,
+          pos_world.y - (*it)->pos_world.y) );
+      const float e = image_evaluator->evaluate_chamfer(map->get_distance_map(**it),
+          edge_points, offset, pos_world.z, -(*it)->pos_world.z);
+
+      belief += expf(-belief_scale * e * e);
+    }
+
+    belief /= candidates.size();
+
+    return true;
+  }
+
+  bool measure_heading(const std::vector<cv::Mat> &mappieces, cv::Point3f &pos_world,
+      float &belief)
+  {
+    std::vector<float> beliefs(2 * heading_steps + 1, 0);
+    std::vector<float> errors;
+
+    // sum up the beliefs of all mappieces per heading, so they agree on one heading
+    for(std::vector<cv::Mat>::const_iterator it = mappieces.begin(); it != mappieces.end(); ++it) {
+      image_evaluator->evaluate_rotations(img_polar, image_evaluator->polar(*it), heading_steps,
+          errors);
+
+      for(int k = 0; k < beliefs.size(); ++k)
+        beliefs[k] += expf(-belief_scale * errors[k] * errors[k]);
+    }
+
+    const int best = std::max_element(beliefs.begin(), beliefs.end() ) - beliefs.begin();
+
+    belief       = beliefs[best] / mappieces.size();
+    pos_world.z += (best - heading_steps) * heading_step;
+
+    return true;
+  }
+
+  cps2::Map *map;
+  cps2::ImageEvaluator *image_evaluator;
+  const float belief_scale;
+  const float heading_window;
+  int heading_steps;
+  float heading_step;
+  cv::Mat img_tf;
+  cv::Mat img_polar;
+  std::vector<cv::Point2f> edge_points; //!< of img_tf, with IE_MODE_CHAMFER
+};
+
+/**
+ * Compare the current image with the map once per frame for the whole Particle cloud.
+ *
+ * prepare() computes a dense likelihood field over the area spanned by the Particles, at a set
+ * of headings spanning theirs: for each heading, the rotated image is correlated with an image
+ * of the map around the area (see Map::get_map_area()), and each position gets the belief of
+ * the mean squared pixel error of the overlap. The correlations are products in the frequency
+ * domain, and the spectra of the map are computed once per frame. measure() only interpolates
+ * the field bilinearly in the position and linearly in the heading, so the cost hardly depends
+ * on the number of Particles.
+ *
+ * The belief is based on the mean squared pixel error, not on the mean absolute one of
+ * IE_MODE_PIXELS, so it is somewhat lower than the one of ImageMeasurement. Clouds wider than
+ * FIELD_MAX_EXTENT pixels of the map pieces, and other modes of the ImageEvaluator, fall back
+ * to an ImageMeasurement.
+ *
+ * With a heading_window, a pose takes the best heading of the field within +-heading_window.
+ */
+class FieldMeasurement {
+public:
+  FieldMeasurement(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator,
+      const float _belief_scale, const float _heading_window) :
+    map(_map),
+    image_evaluator(_image_evaluator),
+    fallback(_map, _image_evaluator, _belief_scale, _heading_window),
+    belief_scale(_belief_scale),
+    heading_window(_heading_window > 0 ? _heading_window : 0),
+    use_field(false),
+    heading_min(0),
+    heading_step(FIELD_HEADING_STEP),
+    resize_scale(std::max(1, _image_evaluator->getResizeScale() ) ) {}
+
+  void prepare(const cv::Mat &img, const std::vector<Particle> &particles) {
+    use_field = image_evaluator->getMode() == IE_MODE_PIXELS && !particles.empty()
+        && prepare_field(img, particles);
+
+    if(!use_field)
+      fallback.prepare(img, particles);
+  }
+
+  bool measure(cv::Point3f &pos_world, float &belief) {
+    if(!use_field)
+      return fallback.measure(pos_world, belief);
+
+    // position in the field
+    const cv::Point2f pos = (map->world2image(cv::Point2f(pos_world.x, pos_world.y) )
+        - center_image) * (1.0f / resize_scale) + field_origin;
+    const float turn = 2 * M_PI / heading_step;
+    float k          = normalize_angle(pos_world.z - heading_min) / heading_step;
+
+    // closer to the first heading than to the last one
+    if(k > 0.5f * (fields.size() - 1 + turn) )
+      k -= turn;
+
+    if(heading_window > 0) {
+      // the best heading within the window
+      const int window = (int)ceilf(heading_window / heading_step);
+      const int k0     = (int)roundf(k);
+      int best         = -1;
+
+      belief = 0;
+
+      for(int i = std::max(0, k0 - window); i <= std::min<int>(fields.size() - 1, k0 + window);
+          ++i)
+      {
+        float b;
+
+        if(sample(fields[i], pos, b) && (best < 0 || b > belief) ) {
+          best   = i;
+          belief = b;
+        }
+      }
+
+      if(best < 0)
+        return false;
+
+      pos_world.z = heading_min + best * heading_step;
+
+      return true;
+    }
+
+    // interpolate between the two nearest headings
+    const int k0   = std::max(0, std::min<int>(fields.size() - 1, (int)floorf(k) ) );
+    const int k1   = std::min<int>(fields.size() - 1, k0 + 1);
+    const float fk = std::max(0.0f, std::min(1.0f, k - k0) );
+    float b0, b1;
+
+    const bool has0 = sample(fields[k0], pos, b0);
+    const bool has1 = sample(fields[k1], pos, b1);
+
+    if(!has0 && !has1)
+      return false;
+
+    belief = has0 && has1 ? (1 - fk) * b0 + fk * b1 : (has0 ? b0 : b1);
+
+    return true;
+  }
+
+private:
+  /**
+   * Normalize an angle to [0, 2 pi).
+   */
+  static float normalize_angle(const float th) {
+    return th - 2 * M_PI * floorf(th / (2 * M_PI) );
+  }
+
+  /**
+   * Compute the fields for the Particles.
+   * @return false, if the cloud is too wide or there is no map around it
+   */
+  bool prepare_field(const cv::Mat &img, const std::vector<Particle> &particles) {
+    // extent of the cloud, in pixels of the map pieces, and the spread of its headings
+    cv::Point2f p_min = map->world2image(cv::Point2f(particles[0].p.x, particles[0].p.y) );
+    cv::Point2f p_max = p_min;
+    float mean_cos    = 0;
+    float mean_sin    = 0;
+
+    for(std::vector<Particle>::const_iterator it = particles.begin(); it != particles.end();
+        ++it)
+    {
+      const cv::Point2f p = map->world2image(cv::Point2f(it->p.x, it->p.y) );
+
+      p_min.x   = fminf(p_min.x, p.x);
+      p_min.y   = fminf(p_min.y, p.y);
+      p_max.x   = fmaxf(p_max.x, p.x);
+      p_max.y   = fmaxf(p_max.y, p.y);
+      mean_cos += cosf(it->p.z);
+      mean_sin += sinf(it->p.z);
+    }
+
+    const float extent_x = (p_max.x - p_min.x) / resize_scale;
+    const float extent_y = (p_max.y - p_min.y) / resize_scale;
+
+    if(extent_x > FIELD_MAX_EXTENT || extent_y > FIELD_MAX_EXTENT)
+      return false;
+
+    const float heading_mean = atan2f(mean_sin, mean_cos);
+    float spread             = 0;
+
+    for(std::vector<Particle>::const_iterator it = particles.begin(); it != particles.end();
+        ++it)
+      spread = fmaxf(spread, fabsf(normalize_angle(it->p.z - heading_mean + M_PI) - M_PI) );
+
+    int headings = (int)ceilf(2 * spread / FIELD_HEADING_STEP) + 1;
+
+    heading_step = FIELD_HEADING_STEP;
+
+    if(headings > FIELD_MAX_HEADINGS) {
+      headings     = FIELD_MAX_HEADINGS;
+      heading_step = 2 * spread / (headings - 1);
+    }
+
+    heading_min = heading_mean - 0.5f * (headings - 1) * heading_step;
+
+    // the image, like ImageMeasurement, and the map around the cloud with room for the image
+    // rotated by any heading
+    const cv::Mat img_tf = image_evaluator->transform(img, cv::Point2i(img.cols / 2,
+        img.rows / 2), 0, 0);
+    const int size       = 2 * ( (int)ceilf(0.5f * sqrtf(img_tf.cols * img_tf.cols
+        + img_tf.rows * img_tf.rows) ) ) + 1;
+    const int area_x     = 2 * ( (int)ceilf(0.5f * extent_x) + size / 2 + 2);
+    const int area_y     = 2 * ( (int)ceilf(0.5f * extent_y) + size / 2 + 2);
+
+    center_image = 0.5f * (p_min + p_max);
+
+    const cv::Point2f center_world(-center_image.y * world_per_image(),
+        center_image.x * world_per_image() );
+    const cv::Mat area = map->get_map_area(center_world, area_y * resize_scale,
+        area_x * resize_scale);
+
+    if(cv::countNonZero(area) == 0)
+      return false;
+
+    // the area as pixel values, their squares and the mask of known pixels, zero padded to a
+    // size the DFT handles fast. The image never wraps around, as the field ends where the
+    // image would leave the area.
+    const int dft_rows = cv::getOptimalDFTSize(area.rows);
+    const int dft_cols = cv::getOptimalDFTSize(area.cols);
+
+    cv::Mat area_v  = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+    cv::Mat area_v2 = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+    cv::Mat area_m  = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+
+    split_known(area, area_v, area_v2, area_m);
+    cv::dft(area_v, area_v);
+    cv::dft(area_v2, area_v2);
+    cv::dft(area_m, area_m);
+
+    // a pose at field pixel (0, 0) has the image centered at area pixel (size / 2, size / 2)
+    field_origin = cv::Point2f(area.cols / 2 - size / 2, area.rows / 2 - size / 2);
+
+    fields.resize(headings);
+
+    cv::Mat img_v, img_v2, img_m;
+    cv::Mat spectrum, product, error, overlap;
+
+    for(int k = 0; k < headings; ++k) {
+      img_v  = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+      img_v2 = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+      img_m  = cv::Mat::zeros(dft_rows, dft_cols, CV_32FC1);
+
+      split_known(rotate(img_tf, heading_min + k * heading_step, size), img_v, img_v2, img_m);
+
+      const float min_overlap = FIELD_MIN_OVERLAP * cv::sum(img_m)[0];
+
+      cv::dft(img_v, img_v);
+      cv::dft(img_v2, img_v2);
+      cv::dft(img_m, img_m);
+
+      // correlation over the overlap of (map - image)^2 = map^2 - 2 map image + image^2
+      cv::mulSpectrums(area_v2, img_m, spectrum, 0, true);
+      cv::mulSpectrums(area_v, img_v, product, 0, true);
+      cv::addWeighted(spectrum, 1, product, -2, 0, spectrum);
+      cv::mulSpectrums(area_m, img_v2, product, 0, true);
+      cv::add(spectrum, product, spectrum);
+      cv::idft(spectrum, error, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+      // number of overlapping pixels
+      cv::mulSpectrums(area_m, img_m, product, 0, true);
+      cv::idft(product, overlap, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+      cv::Mat &field = fields[k];
+
+      field.create(area.rows - size + 1, area.cols - size + 1, CV_32FC1);
+
+      for(int r = 0; r < field.rows; ++r) {
+        const float *e = error.ptr<float>(r);
+        const float *n = overlap.ptr<float>(r);
+        float *row     = field.ptr<float>(r);
+
+        // -1 where the map does not overlap the image enough
+        for(int c = 0; c < field.cols; ++c)
+          row[c] = n[c] < min_overlap ? -1 : expf(-belief_scale * fmaxf(0, e[c]) / n[c]);
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * @return meters per full resolution pixel of the map pieces
+   */
+  float world_per_image() const {
+    return 1.0f / map->world2image(cv::Point2f(0, 1) ).x;
+  }
+
+  /**
+   * Rotate a transformed image like the map pieces of a pose with heading th are rotated, see
+   * Map::get_map_pieces(), into a square image. Unknown pixels stay 0.
+   * @param img the image
+   * @param th heading
+   * @param size edge length of the result, large enough for any heading
+   * @return the rotated image
+   */
+  static cv::Mat rotate(const cv::Mat &img, const float th, const int size) {
+    const float ths = sinf(th);
+    const float thc = cosf(th);
+    const int c2    = size / 2;
+
+    cv::Mat img_rot(size, size, CV_8UC1);
+
+    for(int r = 0; r < size; ++r) {
+      const int qy = r - c2;
+      uchar *row   = img_rot.ptr<uchar>(r);
+
+      for(int c = 0; c < size; ++c) {
+        const int qx   = c - c2;
+        const float xx = qx * thc + qy * ths + img.cols / 2;
+        const float yy = -qx * ths + qy * thc + img.rows / 2;
+        const int x0   = (int)floorf(xx);
+        const int y0   = (int)floorf(yy);
+
+        row[c] = 0;
+
+        if(x0 < 0 || y0 < 0 || x0 + 1 >= img.cols || y0 + 1 >= img.rows)
+          continue;
+
+        const uchar *n0 = img.ptr<uchar>(y0);
+        const uchar *n1 = img.ptr<uchar>(y0 + 1);
+
+        // do not blend known pixels with unknown ones
+        if(n0[x0] == 0 || n0[x0 + 1] == 0 || n1[x0] == 0 || n1[x0 + 1] == 0)
+          continue;
+
+        const float fx = xx - x0;
+        const float fy = yy - y0;
+        const float v  = (1 - fy) * ( (1 - fx) * n0[x0] + fx * n0[x0 + 1])
+                       + fy * ( (1 - fx) * n1[x0] + fx * n1[x0 + 1]);
+
+        row[c] = std::max(1, (int)(v + 0.5f) );
+      }
+    }
+
+    return img_rot;
+  }
+
+  /**
+   * Split an image into its pixel values (scaled to [0, 1]), their squares and the mask of
+   * known pixels, 0 where a pixel is unknown.
+   */
+  static void split_known(const cv::Mat &img, cv::Mat &v, cv::Mat &v2, cv::Mat &m) {
+    for(int r = 0; r < img.rows; ++r) {
+      const uchar *row = img.ptr<uchar>(r);
+      float *row_v     = v.ptr<float>(r);
+      float *row_v2    = v2.ptr<float>(r);
+      float *row_m     = m.ptr<float>(r);
+
+      for(int c = 0; c < img.cols; ++c) {
+        row_v[c]  = row[c] / 255.0f;
+        row_v2[c] = row_v[c] * row_v[c];
+        row_m[c]  = row[c] != 0 ? 1 : 0;
+      }
+    }
+  }
+
+  /**
+   * Interpolate a field bilinearly, skipping the pixels without enough overlap.
+   * @param field the field of one heading
+   * @param pos position in the field
+   * @param belief output belief
+   * @return false, if no neighbouring pixel has a belief
+   */
+  static bool sample(const cv::Mat &field, const cv::Point2f &pos, float &belief) {
+    const int x0   = (int)floorf(pos.x);
+    const int y0   = (int)floorf(pos.y);
+    const float fx = pos.x - x0;
+    const float fy = pos.y - y0;
+    float sum      = 0;
+    float weights  = 0;
+
+    for(int dy = 0; dy < 2; ++dy)
+      for(int dx = 0; dx < 2; ++dx) {
+        const int x = x0 + dx;
+        const int y = y0 + dy;
+
+        if(x < 0 || y < 0 || x >= field.cols || y >= field.rows)
+          continue;
+
+        const float b = field.at<float>(y, x);
+        const float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+
+        if(b < 0)
+          continue;
+
+        sum     += w * b;
+        weights += w;
+      }
+
+    if(weights <= 0)
+      return false;
+
+    belief = sum / weights;
+
+    return true;
+  }
+
+  cps2::Map *map;
+  cps2::ImageEvaluator *image_evaluator;
+  ImageMeasurement fallback;
+  const float belief_scale;
+  const float heading_window;
+  bool use_field;
+  std::vector<cv::Mat> fields;  //!< one per heading, beliefs or -1 where the map is missing
+  float heading_min;            //!< heading of fields[0]
+  float heading_step;           //!< between the headings of fields
+  cv::Point2f center_image;     //!< Map::world2image() of the center of the cloud
+  cv::Point2f field_origin;     //!< field position of center_image
+  const int resize_scale;
+};
+
+/**
+ * Compare the lamps of the current image with the lamps of the map pieces near a pose, see
+ * detect_lamps() and MapPiece::lamps.
+ *
+ * The lamps of a candidate piece are projected into the image at the pose, like
+ * Map::get_map_pieces() would place them (see Map::world2image() ), and the lamps of the image
+ * into the piece. Each lamp within the other image is matched with the nearest lamp there,
+ * including the difference of the orientations of elongated lamps. The error is the mean
+ * distance, capped at LAMP_MAX_DISTANCE, relative to LAMP_MAX_DISTANCE. Unmatched lamps in
+ * either direction thus count fully. Without any lamp in the overlap, e.g. for a piece or an
+ * image without lamps, there is no evidence for the pose, so the error is the maximum. The
+ * beliefs of the candidates are averaged, like in ImageMeasurement.
+ *
+ * A pose costs a few dozen float operations per pair of lamps, no image is transformed. The
+ * heading_window is not used.
+ */
+class LampMeasurement {
+public:
+  LampMeasurement(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator,
+      const float _belief_scale, const float _heading_window) :
+    map(_map),
+    image_evaluator(_image_evaluator),
+    belief_scale(_belief_scale),
+    resize_scale(std::max(1, _image_evaluator->getResizeScale() ) ) {}
+
+  void prepare(const cv::Mat &img, const std::vector<Particle> &particles) {
+    // the same blur and downscale as the map pieces
+    const cv::Mat img_tf = image_evaluator->transform(img, cv::Point2i(img.cols / 2,
+        img.rows / 2), 0, 0);
+
+    detect_lamps(img_tf, lamps);
+    half_size = cv::Point2f(img_tf.cols / 2, img_tf.rows / 2);
+  }
+
+  bool measure(cv::Point3f &pos_world, float &belief) {
+    const std::vector<const MapPiece *> &candidates = map->get_candidates(pos_world);
+
+    if(candidates.empty() )
+      return false;
+
+    const cv::Point2f pos_image = map->world2image(cv::Point2f(pos_world.x, pos_world.y) );
+
+    belief = 0;
+
+    for(std::vector<const MapPiece *>::const_iterator it = candidates.begin();
+        it != candidates.end(); ++it)
+    {
+      // center of the piece relative to the pose, in the world aligned map images
+      const cv::Point2f offset = (map->world2image(cv::Point2f((*it)->pos_world.x,
+          (*it)->pos_world.y) ) - pos_image) * (1.0f / resize_scale);
+      const float e = error(**it, offset, pos_world.z);
+
+      belief += expf(-belief_scale * e * e);
+    }
+
+    belief /= candidates.size();
+
+    return true;
+  }
+
+private:
+  /**
+   * Error between the lamps of the image and the ones of a map piece.
+   * @param map_piece the map piece
+   * @param offset center of the piece relative to the pose, see measure()
+   * @param th heading of the pose
+   * @return error between 0 and 1, 1 if no lamp lies within the other image
+   */
+  float error(const MapPiece &map_piece, const cv::Point2f &offset, const float th) const {
+    if(map_piece.lamps.empty() || lamps.empty() )
+      return 1;
+
+    const float c  = cosf(th);
+    const float s  = sinf(th);
+    const float pc = cosf(map_piece.pos_world.z);
+    const float ps = sinf(map_piece.pos_world.z);
+    float sum      = 0;
+    int count      = 0;
+
+    // the lamps of the piece, seen from the pose
+    for(std::vector<Lamp>::const_iterator it = map_piece.lamps.begin();
+        it != map_piece.lamps.end(); ++it)
+    {
+      const float qx = pc * it->pos.x - ps * it->pos.y + offset.x;
+      const float qy = ps * it->pos.x + pc * it->pos.y + offset.y;
+      Lamp seen      = *it;
+
+      seen.pos   = cv::Point2f(c * qx + s * qy, -s * qx + c * qy);
+      seen.angle = it->angle + map_piece.pos_world.z - th;
+
+      if(fabsf(seen.pos.x) >= half_size.x || fabsf(seen.pos.y) >= half_size.y)
+        continue;
+
+      sum += nearest(seen, lamps);
+      ++count;
+    }
+
+    // the lamps of the image, seen from the piece
+    for(std::vector<Lamp>::const_iterator it = lamps.begin(); it != lamps.end(); ++it) {
+      const float qx = c * it->pos.x - s * it->pos.y - offset.x;
+      const float qy = s * it->pos.x + c * it->pos.y - offset.y;
+      Lamp seen      = *it;
+
+      seen.pos   = cv::Point2f(pc * qx + ps * qy, -ps * qx + pc * qy);
+      seen.angle = it->angle + th - map_piece.pos_world.z;
+
+      if(fabsf(seen.pos.x) >= half_size.x || fabsf(seen.pos.y) >= half_size.y)
+        continue;
+
+      sum += nearest(seen, map_piece.lamps);
+      ++count;
+    }
+
+    return count > 0 ? sum / (count * LAMP_MAX_DISTANCE) : 1;
+  }
+
+  /**
+   * @return distance of a lamp to the nearest one of a list, at most LAMP_MAX_DISTANCE
+   */
+  static float nearest(const Lamp &lamp, const std::vector<Lamp> &others) {
+    float best = LAMP_MAX_DISTANCE * LAMP_MAX_DISTANCE;
+
+    for(std::vector<Lamp>::const_iterator it = others.begin(); it != others.end(); ++it) {
+      const float dx = it->pos.x - lamp.pos.x;
+      const float dy = it->pos.y - lamp.pos.y;
+      float d2       = dx * dx + dy * dy;
+
+      if(lamp.elongation >= LAMP_MIN_ELONGATION && it->elongation >= LAMP_MIN_ELONGATION) {
+        const float da = LAMP_ANGLE_WEIGHT * axis_diff(lamp.angle, it->angle);
+
+        d2 += da * da;
+      }
+
+      best = std::min(best, d2);
+    }
+
+    return sqrtf(best);
+  }
+
+  cps2::Map *map;
+  cps2::ImageEvaluator *image_evaluator;
+  const float belief_scale;
+  const int resize_scale;
+  std::vector<Lamp> lamps; //!< of the current image
+  cv::Point2f half_size;   //!< of the current image, in pixels of the map pieces
+};
+
+} // namespace cps2
+
+#endif
@@ -0,0 +1,280 @@
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include "mosaic.hpp"
+
+namespace cps2 {
+
+/**
+ * Index of the tile holding a canvas coordinate, also for negative ones.
+ */
+static int tile_index(const float c) {
+  return (int)floorf(c / MOSAIC_TILE_SIZE);
+}
+
+Mosaic::Mosaic(int _downscale) : downscale(std::max(1, _downscale) ) {
+
+}
+
+float Mosaic::pixels_per_meter(const fisheye_camera_matrix::CameraMatrix &camera_matrix) const {
+  return camera_matrix.fl / (camera_matrix.scale * camera_matrix.ceil_height * downscale);
+}
+
+cv::Point2f Mosaic::world2canvas(const cv::Point2f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix) const
+{
+  const float k = pixels_per_meter(camera_matrix);
+
+  return cv::Point2f(k * pos_world.y, -k * pos_world.x);
+}
+
+int64_t Mosaic::tile_key(const cv::Point2i &tile) {
+  return ( (int64_t)tile.y << 32) | (uint32_t)tile.x;
+}
+
+cv::Point2i Mosaic::key2tile(const int64_t key) {
+  return cv::Point2i( (int32_t)(uint32_t)key, (int32_t)(key >> 32) );
+}
+
+void Mosaic::cover(const cv::Size &size, const cv::Point3f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix, std::vector<int64_t> &keys) const
+{
+  const cv::Point2f center = world2canvas(cv::Point2f(pos_world.x, pos_world.y), camera_matrix);
+
+  // the frame may be rotated arbitrarily, so take the circle around its corners
+  const float radius = 0.5f * sqrtf(size.width * size.width + size.height * size.height);
+
+  keys.clear();
+
+  for(int y = tile_index(center.y - radius); y <= tile_index(center.y + radius); ++y)
+    for(int x = tile_index(center.x - radius); x <= tile_index(center.x + radius); ++x)
+      keys.push_back(tile_key(cv::Point2i(x, y) ) );
+}
+
+void Mosaic::allocate(const std::vector<int64_t> &keys) {
+  for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+    std::shared_ptr<MosaicTile> &tile = tiles[*it];
+
+    if(!tile) {
+      tile = std::make_shared<MosaicTile>();
+      tile->sum    = cv::Mat::zeros(MOSAIC_TILE_SIZE, MOSAIC_TILE_SIZE, CV_32FC1);
+      tile->weight = cv::Mat::zeros(MOSAIC_TILE_SIZE, MOSAIC_TILE_SIZE, CV_32FC1);
+      tile->img    = cv::Mat::zeros(MOSAIC_TILE_SIZE, MOSAIC_TILE_SIZE, CV_8UC1);
+    }
+  }
+}
+
+void Mosaic::blend(const int64_t key, const cv::Mat &image, const cv::Point3f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix, const float sign)
+{
+  const std::unordered_map<int64_t, std::shared_ptr<MosaicTile> >::iterator found =
+      tiles.find(key);
+
+  if(found == tiles.end() || image.empty() )
+    return;
+
+  const cv::Point2i origin = key2tile(key) * MOSAIC_TILE_SIZE;
+  const cv::Point2f center = world2canvas(cv::Point2f(pos_world.x, pos_world.y), camera_matrix);
+  const float cx           = image.cols / 2;
+  const float cy           = image.rows / 2;
+  const float radius2      = cx * cx + cy * cy + 1;
+  const float c            = cosf(pos_world.z);
+  const float s            = sinf(pos_world.z);
+
+  // skip tiles out of reach of the frame
+  const float dx = std::max(0.0f, std::max(origin.x - center.x,
+      center.x - origin.x - MOSAIC_TILE_SIZE) );
+  const float dy = std::max(0.0f, std::max(origin.y - center.y,
+      center.y - origin.y - MOSAIC_TILE_SIZE) );
+
+  if(dx * dx + dy * dy >= radius2)
+    return;
+
+  // the tile is still shared with a copy of the mosaic
+  if(found->second.use_count() > 1) {
+    const std::shared_ptr<MosaicTile> copy = std::make_shared<MosaicTile>();
+
+    copy->sum    = found->second->sum.clone();
+    copy->weight = found->second->weight.clone();
+    copy->img    = found->second->img.clone();
+    found->second = copy;
+  }
+
+  MosaicTile &tile = *found->second;
+
+  for(int r = 0; r < MOSAIC_TILE_SIZE; ++r) {
+    float *sum     = tile.sum.ptr<float>(r);
+    float *weight  = tile.weight.ptr<float>(r);
+    uchar *row_img = tile.img.ptr<uchar>(r);
+    const float qy = origin.y + r - center.y;
+
+    for(int col = 0; col < MOSAIC_TILE_SIZE; ++col) {
+      const float qx = origin.x + col - center.x;
+
+      // the canvas is aligned with the world frame, the frame is rotated by its heading, see
+      // ImageEvaluator::transform_native()
+      const float x  = qx * c + qy * s;
+      const float y  = -qx * s + qy * c;
+      const float xx = x + cx;
+      const float yy = y + cy;
+      const int x0   = (int)floorf(xx);
+      const int y0   = (int)floorf(yy);
+
+      if(x0 < 0 || y0 < 0 || x0 + 1 >= image.cols || y0 + 1 >= image.rows)
+        continue;
+
+      const uchar *n0 = image.ptr<uchar>(y0);
+      const uchar *n1 = image.ptr<uchar>(y0 + 1);
+
+      // do not blend known pixels with unknown ones
+      if(n0[x0] == 0 || n0[x0 + 1] == 0 || n1[x0] == 0 || n1[x0 + 1] == 0)
+        continue;
+
+      const float fx = xx - x0;
+      const float fy = yy - y0;
+      const float v  = (1 - fy) * ( (1 - fx) * n0[x0] + fx * n0[x0 + 1])
+                     + fy * ( (1 - fx) * n1[x0] + fx * n1[x0 + 1]);
+
+      // feather towards the border of the frame
+      const float w = sign * (1 - (x * x + y * y) / radius2);
+
+      sum[col]    += w * v;
+      weight[col] += w;
+
+      // 0 is unknown, so known pixels are at least 1
+      row_img[col] = weight[col] < MOSAIC_MIN_WEIGHT ? 0
+          : std::min(255, std::max(1, (int)(sum[col] / weight[col] + 0.5f) ) );
+    }
+  }
+}
+
+void Mosaic::add(const cv::Mat &image, const cv::Point3f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix)
+{
+  std::vector<int64_t> keys;
+
+  cover(image.size(), pos_world, camera_matrix, keys);
+  allocate(keys);
+
+  for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+    blend(*it, image, pos_world, camera_matrix);
+}
+
+void Mosaic::remove(const cv::Mat &image, const cv::Point3f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix)
+{
+  std::vector<int64_t> keys;
+
+  // the tiles exist since add()
+  cover(image.size(), pos_world, camera_matrix, keys);
+
+  for(std::vector<int64_t>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+    blend(*it, image, pos_world, camera_matrix, -1);
+}
+
+cv::Mat Mosaic::render(const cv::Rect &area) const {
+  cv::Mat img = cv::Mat::zeros(area.height, area.width, CV_8UC1);
+
+  for(int ty = tile_index(area.y); ty <= tile_index(area.y + area.height - 1); ++ty)
+    for(int tx = tile_index(area.x); tx <= tile_index(area.x + area.width - 1); ++tx) {
+      const std::unordered_map<int64_t, std::shared_ptr<MosaicTile> >::const_iterator it =
+          tiles.find(tile_key(cv::Point2i(tx, ty) ) );
+
+      if(it == tiles.end() )
+        continue;
+
+      const cv::Rect rect = cv::Rect(tx * MOSAIC_TILE_SIZE, ty * MOSAIC_TILE_SIZE,
+          MOSAIC_TILE_SIZE, MOSAIC_TILE_SIZE) & area;
+
+      it->second->img(rect - cv::Point2i(tx * MOSAIC_TILE_SIZE, ty * MOSAIC_TILE_SIZE) ).copyTo(
+          img(rect - area.tl() ) );
+    }
+
+  return img;
+}
+
+inline uchar Mosaic::pixel(const int x, const int y, const MosaicTile *&tile,
+    cv::Point2i &cached) const
+{
+  const cv::Point2i index(x >= 0 ? x / MOSAIC_TILE_SIZE : (x + 1) / MOSAIC_TILE_SIZE - 1,
+      y >= 0 ? y / MOSAIC_TILE_SIZE : (y + 1) / MOSAIC_TILE_SIZE - 1);
+
+  if(index != cached) {
+    const std::unordered_map<int64_t, std::shared_ptr<MosaicTile> >::const_iterator it =
+        tiles.find(tile_key(index) );
+
+    tile   = it == tiles.end() ? NULL : it->second.get();
+    cached = index;
+  }
+
+  return tile ? tile->img.ptr<uchar>(y - index.y * MOSAIC_TILE_SIZE)[x - index.x
+      * MOSAIC_TILE_SIZE] : 0;
+}
+
+cv::Mat Mosaic::transform(const cv::Point2f &center, const float th, const int rows,
+    const int cols) const
+{
+  const int dim_x = cols / downscale;
+  const int dim_y = rows / downscale;
+  const int cx2   = dim_x / 2;
+  const int cy2   = dim_y / 2;
+  const float ths = sinf(th);
+  const float thc = cosf(th);
+  const MosaicTile *tile = NULL;
+  cv::Point2i cached(INT_MIN, INT_MIN);
+
+  cv::Mat img_tf(dim_y, dim_x, CV_8UC1);
+
+  for(int r = 0; r < dim_y; ++r) {
+    const int sy = r - cy2;
+    uchar *row   = img_tf.ptr<uchar>(r);
+
+    for(int c = 0; c < dim_x; ++c) {
+      const int sx    = c - cx2;
+      const float xx  = sx * thc - sy * ths + center.x;
+      const float yy  = sx * ths + sy * thc + center.y;
+      const int x0    = (int)floorf(xx);
+      const int y0    = (int)floorf(yy);
+      const uchar p00 = pixel(x0,     y0,     tile, cached);
+      const uchar p01 = pixel(x0 + 1, y0,     tile, cached);
+      const uchar p10 = pixel(x0,     y0 + 1, tile, cached);
+      const uchar p11 = pixel(x0 + 1, y0 + 1, tile, cached);
+
+      row[c] = 0;
+
+      // do not blend known pixels with unknown ones
+      if(p00 == 0 || p01 == 0 || p10 == 0 || p11 == 0)
+        continue;
+
+      const float fx = xx - x0;
+      const float fy = yy - y0;
+      const float v  = (1 - fy) * ( (1 - fx) * p00 + fx * p01) + fy * ( (1 - fx) * p10 + fx * p11);
+
+      row[c] = std::max(1, (int)(v + 0.5f) );
+    }
+  }
+
+  return img_tf;
+}
+
+size_t Mosaic::bytes() const {
+  // sum, weight and img
+  return tiles.size() * MOSAIC_TILE_SIZE * MOSAIC_TILE_SIZE * (2 * sizeof(float) + 1);
+}
+
+cv::Rect Mosaic::bounds() const {
+  cv::Rect rect;
+
+  for(std::unordered_map<int64_t, std::shared_ptr<MosaicTile> >::const_iterator it =
+      tiles.begin(); it != tiles.end(); ++it)
+  {
+    const cv::Point2i origin = key2tile(it->first) * MOSAIC_TILE_SIZE;
+    const cv::Rect tile(origin.x, origin.y, MOSAIC_TILE_SIZE, MOSAIC_TILE_SIZE);
+
+    rect = rect.area() == 0 ? tile : (rect | tile);
+  }
+
+  return rect;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,152 @@
+#ifndef SRC_MOSAIC_HPP_
+#define SRC_MOSAIC_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "fisheye_camera_matrix/camera_matrix.hpp"
+
+namespace cps2 {
+
+const int   MOSAIC_TILE_SIZE  = 256;  //!< edge length of tiles in canvas pixels
+const float MOSAIC_MIN_WEIGHT = 0.05; //!< pixels with less accumulated weight are unknown
+
+/**
+ * A tile of the canvas.
+ */
+struct MosaicTile {
+  cv::Mat sum;    //!< CV_32FC1, weighted sum of the blended pixels
+  cv::Mat weight; //!< CV_32FC1, sum of the weights, i.e. the confidence of each pixel
+  cv::Mat img;    //!< CV_8UC1, sum / weight, 0 where the weight is below MOSAIC_MIN_WEIGHT
+};
+
+/**
+ * Ceiling mosaic on a sparse, growing canvas of tiles, aligned with the world frame.
+ *
+ * Frames are warped onto the canvas by their pose and blended with a weight falling off
+ * towards their border, so overlapping frames fade into each other instead of meeting at
+ * seams. The accumulated weight of a pixel is its confidence. Like in a big map, canvas pixel
+ * (0, 0) is the world origin and the axes follow CameraMatrix::relative2image().
+ *
+ * Different tiles can be blended concurrently, see blend(). Copies of a mosaic share their
+ * tiles until one of them blends into a tile, so a copy is a cheap snapshot.
+ */
+class Mosaic {
+public:
+  /**
+   * @param _downscale a canvas pixel is this many pixels of a full resolution frame wide
+   */
+  Mosaic(int _downscale);
+
+  /**
+   * @param pos_world point in world frame
+   * @param camera_matrix camera matrix of the frames
+   * @return position of the point on the canvas
+   */
+  cv::Point2f world2canvas(const cv::Point2f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix) const;
+
+  /**
+   * Get the tiles a frame covers.
+   * @param size size of the frame, in canvas pixels
+   * @param pos_world pose of the frame in world frame
+   * @param camera_matrix camera matrix of the frame
+   * @param keys output list of tile keys, see tile_key()
+   */
+  void cover(const cv::Size &size, const cv::Point3f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix,
+      std::vector<int64_t> &keys) const;
+
+  /**
+   * Create missing tiles. Not thread safe.
+   * @param keys tile keys
+   */
+  void allocate(const std::vector<int64_t> &keys);
+
+  /**
+   * Blend a frame into one existing tile. Several threads may blend into different tiles at
+   * the same time.
+   * @param key key of the tile
+   * @param image grayscale frame, already downscaled to the canvas resolution. Pixels of 0 are
+   *        unknown, e.g. outside of the undistorted image.
+   * @param pos_world pose of the frame in world frame
+   * @param camera_matrix camera matrix of the frame
+   * @param sign 1 to blend the frame in, -1 to take it out again
+   */
+  void blend(const int64_t key, const cv::Mat &image, const cv::Point3f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix, const float sign = 1);
+
+  /**
+   * Blend a frame into all tiles it covers, creating them on demand.
+   */
+  void add(const cv::Mat &image, const cv::Point3f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix);
+
+  /**
+   * Take a frame, which add() blended in before, out of the tiles again, e.g. to blend it
+   * at a corrected pose. Needs the same image, pose and camera matrix.
+   */
+  void remove(const cv::Mat &image, const cv::Point3f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix);
+
+  /**
+   * Render an area of the canvas.
+   * @param area area in canvas pixels
+   * @return the blended image, 0 where the weight is below MOSAIC_MIN_WEIGHT
+   */
+  cv::Mat render(const cv::Rect &area) const;
+
+  /**
+   * Compute a rotated subimage, like TiledMap::transform(), but from the canvas.
+   * @param center center of the new image on the canvas
+   * @param th rotate the resulting image around this angle
+   * @param rows full resolution height of the resulting image
+   * @param cols full resolution width of the resulting image
+   * @return the transformed image, downscaled by downscale
+   */
+  cv::Mat transform(const cv::Point2f &center, const float th, const int rows,
+      const int cols) const;
+
+  /**
+   * @return memory used by the tiles, in bytes
+   */
+  size_t bytes() const;
+
+  /**
+   * @return bounding box of all tiles, in canvas pixels
+   */
+  cv::Rect bounds() const;
+
+  /**
+   * @return tile indices of a key
+   */
+  static cv::Point2i key2tile(const int64_t key);
+
+  static int64_t tile_key(const cv::Point2i &tile);
+
+  size_t size() const {return tiles.size();}
+
+  const int downscale;
+
+private:
+  /**
+   * Canvas pixels per meter, see CameraMatrix::relative2image().
+   */
+  float pixels_per_meter(const fisheye_camera_matrix::CameraMatrix &camera_matrix) const;
+
+  /**
+   * Rendered pixel of the canvas, 0 outside of the tiles.
+   * @param tile the tile of the previous call, to save the lookup of neighbouring pixels
+   */
+  inline uchar pixel(const int x, const int y, const MosaicTile *&tile,
+      cv::Point2i &cached) const;
+
+  std::unordered_map<int64_t, std::shared_ptr<MosaicTile> > tiles;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_MOSAIC_HPP_ */
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <opencv2/highgui/highgui.hpp>
+#include "mosaic_map.hpp"
+
+namespace cps2 {
+
+/**
+ * @return the native image of a piece, decoded if it is compressed
+ */
+static cv::Mat native_image(const MapPiece &map_piece) {
+  if(!map_piece.is_compressed() )
+    return map_piece.img;
+
+  return cv::imdecode(map_piece.img_compressed, cv::IMREAD_GRAYSCALE);
+}
+
+template<class Layout>
+MosaicMap<Layout>::MosaicMap(cps2::ImageEvaluator *_image_evaluator,
+    const MapSettings &settings)
+    : Layout(_image_evaluator, settings),
+      mosaic(_image_evaluator->getResizeScale() ),
+      mosaic_dirty(false)
+{
+}
+
+template<class Layout>
+MosaicMap<Layout>::~MosaicMap() {
+  this->stop_worker();
+}
+
+template<class Layout>
+std::vector<cv::Mat> MosaicMap<Layout>::get_map_pieces(const cv::Point3f &pos_world) {
+  std::vector<cv::Mat> map_piece_images;
+
+  if(!this->ready || !this->state->mosaic)
+    return map_piece_images;
+
+  const Mosaic &mosaic_state = *this->state->mosaic;
+  cv::Mat map_piece = mosaic_state.transform(mosaic_state.world2canvas(
+      cv::Point2f(pos_world.x, pos_world.y), this->camera_matrix), pos_world.z,
+      2 * this->dim_img.y, 2 * this->dim_img.x);
+
+  // nothing mapped around pos_world yet
+  if(cv::countNonZero(map_piece) > 0)
+    map_piece_images.push_back(map_piece);
+
+  return map_piece_images;
+}
+
+template<class Layout>
+cv::Mat MosaicMap<Layout>::get_map_area(const cv::Point2f &center_world, const int rows,
+    const int cols)
+{
+  const int resize_scale = this->image_evaluator->getResizeScale();
+
+  if(!this->ready || !this->state->mosaic)
+    return cv::Mat::zeros(rows / resize_scale, cols / resize_scale, CV_8UC1);
+
+  return this->state->mosaic->transform(this->state->mosaic->world2canvas(center_world,
+      this->camera_matrix), 0, rows, cols);
+}
+
+template<class Layout>
+void MosaicMap<Layout>::snapshot() {
+  Layout::snapshot();
+
+  // the snapshot shares the tiles, until the worker blends into them again
+  if(mosaic_dirty) {
+    this->work.mosaic = std::make_shared<const Mosaic>(mosaic);
+    mosaic_dirty      = false;
+  }
+}
+
+template<class Layout>
+void MosaicMap<Layout>::piece_written(const int64_t key) {
+  Layout::piece_written(key);
+  mosaic_pending.push_back(key);
+}
+
+template<class Layout>
+void MosaicMap<Layout>::piece_moved(const int64_t key, const cv::Point3f &pos_before) {
+  Layout::piece_moved(key, pos_before);
+
+  // a piece that is not blended yet is blended at its latest pose anyway
+  if(std::find(mosaic_pending.begin(), mosaic_pending.end(), key) != mosaic_pending.end() )
+    return;
+
+  mosaic_moved.push_back(std::make_pair(key, pos_before) );
+  mosaic_pending.push_back(key);
+}
+
+template<class Layout>
+bool MosaicMap<Layout>::finish_batch(const fisheye_camera_matrix::CameraMatrix &cm) {
+  bool blended = false;
+
+  // moved pieces keep their images, so take them out where they were blended
+  for(std::vector<std::pair<int64_t, cv::Point3f> >::const_iterator it = mosaic_moved.begin();
+      it != mosaic_moved.end(); ++it)
+  {
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator found =
+        this->work.grid.find(it->first);
+
+    if(found == this->work.grid.end() || !found->second)
+      continue;
+
+    mosaic.remove(native_image(*found->second), it->second, cm);
+    blended = true;
+  }
+
+  for(std::vector<int64_t>::const_iterator it = mosaic_pending.begin();
+      it != mosaic_pending.end(); ++it)
+  {
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator found =
+        this->work.grid.find(*it);
+
+    // pieces are blended at their latest pose
+    if(found == this->work.grid.end() || !found->second)
+      continue;
+
+    const cv::Mat img = native_image(*found->second);
+
+    if(img.empty() )
+      continue;
+
+    mosaic.add(img, found->second->pos_world, cm);
+    blended = true;
+  }
+
+  mosaic_pending.clear();
+  mosaic_moved.clear();
+
+  if(blended) {
+    this->work.stats.bytes_mosaic = mosaic.bytes();
+    mosaic_dirty                  = true;
+  }
+
+  return Layout::finish_batch(cm) || blended;
+}
+
+template class MosaicMap<GridMap>;
+template class MosaicMap<KeyframeMap>;
+
+} /* namespace cps2 */
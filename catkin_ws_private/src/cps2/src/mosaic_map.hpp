@@ -0,0 +1,76 @@
+#ifndef SRC_MOSAIC_MAP_HPP_
+#define SRC_MOSAIC_MAP_HPP_
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "grid_map.hpp"
+#include "keyframe_map.hpp"
+#include "map.hpp"
+#include "mosaic.hpp"
+
+namespace cps2 {
+
+/**
+ * A recorded Map, which additionally blends the native images of all pieces into one Mosaic.
+ * Lookups then crop a single patch at the pose from the mosaic instead of transforming every
+ * candidate piece, so a particle is evaluated once, against all pieces covering its view.
+ *
+ * The pieces are still recorded, stored and looked up by the Layout (GridMap or KeyframeMap),
+ * e.g. for get_candidates(), the pose graph and map files. The mosaic only replaces
+ * get_map_pieces() and get_map_area().
+ */
+template<class Layout>
+class MosaicMap : public Layout {
+public:
+  /**
+   * @param image_evaluator ImageEvaluator, which determines the representation of map pieces
+   * @param settings see MapSettings
+   */
+  MosaicMap(cps2::ImageEvaluator *image_evaluator, const MapSettings &settings);
+
+  virtual ~MosaicMap();
+
+  /**
+   * Crop a single image at the pose from the mosaic.
+   * @return the image, or none if nothing is mapped around pos_world yet
+   */
+  virtual std::vector<cv::Mat> get_map_pieces(const cv::Point3f &pos_world);
+
+  virtual cv::Mat get_map_area(const cv::Point2f &center_world, const int rows, const int cols);
+
+protected:
+  virtual void snapshot();
+
+  virtual void piece_written(const int64_t key);
+
+  /**
+   * Blend the piece again at its new pose, see finish_batch().
+   */
+  virtual void piece_moved(const int64_t key, const cv::Point3f &pos_before);
+
+  /**
+   * Blend the pieces written since the last call into the mosaic. Moved pieces are taken out
+   * at their previous pose first. Pieces read from a map file wait for the camera matrix of
+   * the first frame.
+   * @param cm camera matrix of the latest frame
+   * @return true, if the mosaic changed
+   */
+  virtual bool finish_batch(const fisheye_camera_matrix::CameraMatrix &cm);
+
+private:
+  // written by the worker only, with state_mutex locked
+  Mosaic mosaic;
+  std::vector<int64_t> mosaic_pending; //!< keys of the pieces not yet blended
+  std::vector<std::pair<int64_t, cv::Point3f> > mosaic_moved; //!< and where they were blended
+  bool mosaic_dirty;                   //!< work.mosaic is outdated
+};
+
+// instantiated in mosaic_map.cpp
+extern template class MosaicMap<GridMap>;
+extern template class MosaicMap<KeyframeMap>;
+
+} /* namespace cps2 */
+
+#endif /* SRC_MOSAIC_MAP_HPP_ */
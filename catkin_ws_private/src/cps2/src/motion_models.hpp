@@ -0,0 +1,32 @@
+#ifndef SRC_MOTION_MODELS_HPP_
+#define SRC_MOTION_MODELS_HPP_
+
+#include <math.h>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+/*
+ * Motion policies for ParticleFilterT, providing
+ *
+ *   void apply(cv::Point3f &pos_world, const float dx, const float dy, const float dth) const;
+ */
+
+/**
+ * Turn by dth, then drive dx straight ahead and dy to the left.
+ */
+struct OdometryMotion {
+  void apply(cv::Point3f &pos_world, const float dx, const float dy, const float dth) const {
+    pos_world.z += dth;
+
+    const float c = cosf(pos_world.z);
+    const float s = sinf(pos_world.z);
+
+    pos_world.x += dx * c - dy * s;
+    pos_world.y += dx * s + dy * c;
+  }
+};
+
+} // namespace cps2
+
+#endif
@@ -0,0 +1,73 @@
+#include <math.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "orientation.hpp"
+
+namespace cps2 {
+
+OrientationHistogram::OrientationHistogram(const cv::Mat &img) :
+    bins(ORIENTATION_BINS, 0),
+    angle(0),
+    confidence(0)
+{
+  const float bin_width = M_PI / 2 / ORIENTATION_BINS;
+
+  cv::Mat small;
+  cv::resize(img, small, cv::Size(img.cols / ORIENTATION_DOWNSCALE,
+      img.rows / ORIENTATION_DOWNSCALE), 0, 0, cv::INTER_AREA);
+
+  // sobel operator, accumulate the magnitude per orientation
+  float total = 0;
+
+  for(int r = 1; r < small.rows - 1; ++r) {
+    const uchar *p0 = small.ptr<uchar>(r - 1);
+    const uchar *p1 = small.ptr<uchar>(r);
+    const uchar *p2 = small.ptr<uchar>(r + 1);
+
+    for(int c = 1; c < small.cols - 1; ++c) {
+      // the border of unknown pixels would be the strongest edge of all
+      if(p0[c] == 0 || p1[c - 1] == 0 || p1[c] == 0 || p1[c + 1] == 0 || p2[c] == 0)
+        continue;
+
+      const float gx = (p0[c + 1] + 2 * p1[c + 1] + p2[c + 1])
+                     - (p0[c - 1] + 2 * p1[c - 1] + p2[c - 1]);
+      const float gy = (p2[c - 1] + 2 * p2[c] + p2[c + 1])
+                     - (p0[c - 1] + 2 * p0[c] + p0[c + 1]);
+      const float magnitude = sqrtf(gx * gx + gy * gy);
+
+      if(magnitude < ORIENTATION_MIN_MAGNITUDE)
+        continue;
+
+      // fold the orientation into [0, pi/2)
+      float a = fmodf(atan2f(gy, gx), M_PI / 2);
+
+      if(a < 0)
+        a += M_PI / 2;
+
+      bins[std::min(ORIENTATION_BINS - 1, (int)(a / bin_width) )] += magnitude;
+      total += magnitude;
+    }
+  }
+
+  if(total == 0)
+    return;
+
+  // find the peak, refined by a parabola through its neighbours
+  const int peak = std::max_element(bins.begin(), bins.end() ) - bins.begin();
+  const float l  = bins[(peak + ORIENTATION_BINS - 1) % ORIENTATION_BINS];
+  const float m  = bins[peak];
+  const float u  = bins[(peak + 1) % ORIENTATION_BINS];
+  const float d  = l - 2 * m + u;
+  const float o  = d < 0 ? 0.5f * (l - u) / d : 0;
+
+  angle      = fmodf( (peak + 0.5f + o) * bin_width + M_PI / 2, M_PI / 2);
+  confidence = (l + m + u) / total;
+}
+
+float quarter_diff(const float from, const float to) {
+  const float d = to - from;
+
+  return d - M_PI / 2 * roundf(d / (M_PI / 2) );
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,52 @@
+#ifndef SRC_ORIENTATION_HPP_
+#define SRC_ORIENTATION_HPP_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+const int   ORIENTATION_BINS           = 36;  //!< bins over [0, pi/2)
+const int   ORIENTATION_DOWNSCALE      = 2;   //!< reduce images by this factor first
+const float ORIENTATION_MIN_MAGNITUDE  = 32;  //!< ignore weaker (sobel) gradients
+const float ORIENTATION_MIN_CONFIDENCE = 0.2; //!< see OrientationHistogram::valid()
+
+/**
+ * Histogram of gradient orientations modulo 90 degrees, weighted by gradient magnitude.
+ *
+ * The ceilings are mostly made of lines at right angles, so the histogram of an image has a
+ * dominant peak that rotates with the camera. Comparing the peak of the current image with the
+ * peak of a map piece gives the heading relative to the map piece, up to multiples of 90
+ * degrees.
+ */
+class OrientationHistogram {
+public:
+  OrientationHistogram() : angle(0), confidence(0) {}
+
+  /**
+   * Compute the histogram of an image. Pixels next to unknown (zero) pixels are ignored.
+   * @param img a grayscale image
+   */
+  OrientationHistogram(const cv::Mat &img);
+
+  /**
+   * @return true, if the peak is pronounced enough to be used
+   */
+  bool valid() const {return confidence >= ORIENTATION_MIN_CONFIDENCE;}
+
+  std::vector<float> bins;
+  float angle;      //!< dominant orientation in image coordinates, in [0, pi/2)
+  float confidence; //!< share of the gradient magnitude in the peak, in [0, 1]
+};
+
+/**
+ * Difference between two angles modulo 90 degrees.
+ * @param from an angle
+ * @param to another angle
+ * @return d in [-pi/4, pi/4], such that from + d = to (mod pi/2)
+ */
+float quarter_diff(const float from, const float to);
+
+} /* namespace cps2 */
+
+#endif /* SRC_ORIENTATION_HPP_ */
@@ -6,12 +6,17 @@
 namespace cps2 {
 
 struct Particle {
-  Particle(const float x, const float y, const float th):p(x, y, th), belief(0){}
-  Particle(const cps2::Particle& particle):p(particle.p),belief(particle.belief){}
+  Particle(const float x, const float y, const float th):
+    p(x, y, th), belief(0), weight(0), log_weight(0){}
+  Particle(const cps2::Particle& particle):
+    p(particle.p), belief(particle.belief), weight(particle.weight),
+    log_weight(particle.log_weight){}
   ~Particle() {}
 
   cv::Point3f p;
-  float belief;
+  float belief;     //!< likelihood of the latest evaluation
+  float weight;     //!< normalized importance weight, accumulated since the last resampling
+  float log_weight; //!< log(weight)
 };
 
 } // namespace cps2
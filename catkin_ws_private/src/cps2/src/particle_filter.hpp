@@ -6,10 +6,57 @@
 #include "map.hpp"
 #include "image_evaluator.hpp"
 #include "particle.hpp"
+#include "measurement_models.hpp"
+#include "motion_models.hpp"
+#include "resamplers.hpp"
+#include "estimators.hpp"
+#include "orientation.hpp"
 
 namespace cps2 {
 
-class ParticleFilter {
+/**
+ * The interface of all ParticleFilterT instantiations, so that localization_publisher can
+ * choose the policies at runtime. See ParticleFilterT for the documentation.
+ */
+class ParticleFilterBase {
+public:
+  ParticleFilterBase(int _particles_num) : particles_num(_particles_num) {}
+  virtual ~ParticleFilterBase() {}
+
+  virtual void addNewRandomParticles() = 0;
+  virtual void update_heading_prior(const cv::Mat &img) = 0;
+  virtual void motion_update(const float dx, const float dth) = 0;
+  virtual void motion_update(const float dx, const float dy, const float dth) = 0;
+  virtual void evaluate(const cv::Mat &img) = 0;
+  virtual void resample() = 0;
+  virtual bool resample_needed() const = 0;
+  virtual float getEffectiveSampleSize() const = 0;
+  virtual Particle getBest() = 0;
+  virtual Particle getBestSignle() = 0;
+  virtual float getEvaluatedRatio() = 0;
+  virtual int getCascadePassed() const = 0;
+  virtual int getCascadeRejected() const = 0;
+
+  const int particles_num;
+
+  std::vector<Particle> particles;
+};
+
+/**
+ * Particle filter, parameterized by
+ *
+ * - MeasurementModel: computes the belief of a pose for the current image
+ *   (see measurement_models.hpp)
+ * - MotionModel: moves a pose by odometry (see motion_models.hpp)
+ * - Resampler: decides how often each Particle is drawn (see resamplers.hpp)
+ * - Estimator: computes the pose estimate from the Particles (see estimators.hpp)
+ *
+ * All of them are resolved at compile time. ParticleFilter is the instantiation used by
+ * localization_publisher. The member functions are defined in particle_filter_impl.hpp, which
+ * only needs to be included to instantiate other combinations.
+ */
+template<class MeasurementModel, class MotionModel, class Resampler, class Estimator>
+class ParticleFilterT : public ParticleFilterBase {
 public:
 
   /**
@@ -27,13 +74,28 @@ public:
    * @param _punishEdgeParticlesRate multiplier for belief of particles, which are pushed outside of the map by motion_updates
    * @param _setStartPos true in case of a known start position
    * @param _startPos the start position, if known
+   * @param _eval_budget time budget (in s) for evaluate(). Choose 0 to evaluate all Particles.
+   * @param _eval_explore fraction of the evaluation order drawn randomly instead of by belief
+   * @param _belief_decay multiplier for the belief of Particles that were not evaluated in time
+   * @param _resample_ess resample only if the effective sample size drops below this fraction
+   *        of particles_num
+   * @param _heading_window score each Particle over all headings within +-heading_window (in
+   *        radians) and keep the best one. Choose 0 to score only the Particle's own heading.
+   * @param _heading_prior how strongly to pull the Particles' headings towards the headings
+   *        admitted by the ceiling orientation, in [0, 1]. Choose 0 to disable.
+   * @param _cascade_threshold reject a Particle before measuring it, if the histogram of each
+   *        of its candidate map pieces differs from the one of the image by more than this
+   *        (see ImageEvaluator::histogram_distance() ), in (0, 1]. Choose 0 to disable.
    */
-  ParticleFilter(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator, int _particles_num,
-                 float _particles_keep, float _particle_belief_scale, float _particle_stdev_lin,
-                 float _particle_stdev_ang, bool _hamid_sampling, float _bin_size,
-                 float _punishEdgeParticlesRate, bool _setStartPos, cv::Point3f _startPos);
+  ParticleFilterT(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator, int _particles_num,
+                  float _particles_keep, float _particle_belief_scale, float _particle_stdev_lin,
+                  float _particle_stdev_ang, bool _hamid_sampling, float _bin_size,
+                  float _punishEdgeParticlesRate, bool _setStartPos, cv::Point3f _startPos,
+                  float _eval_budget, float _eval_explore, float _belief_decay,
+                  float _resample_ess, float _heading_window, float _heading_prior,
+                  float _cascade_threshold);
 
-  ~ParticleFilter();
+  ~ParticleFilterT();
 
   /**
    * Generate an amount of "particles.size() - particles_num" new Particles, uniformly
@@ -43,6 +105,15 @@ public:
    */
   void addNewRandomParticles();
 
+  /**
+   * Compare the dominant orientation of img with the ceiling orientation of the map. This
+   * admits four headings, 90 degrees apart, which are used by motion_update(), resample() and
+   * addNewRandomParticles() until the next call. Call it before motion_update().
+   *
+   * @param img new, undistorted, grayscale image of ceiling cam
+   */
+  void update_heading_prior(const cv::Mat &img);
+
   /**
    * Update all Particles with the latest odometry.
    *
@@ -52,59 +123,161 @@ public:
   void motion_update(const float dx, const float dth);
 
   /**
-   * Compute a belief for each Particle using the given ImageEvaluator and newest sensor data.
+   * Update all Particles with a motion that includes a sideways part, e.g. from VisualOdometry.
+   * Afterwards, the map is asked to prefetch the area the Particles will likely cover in the
+   * next frame, see Map::prefetch().
+   *
+   * @param dx distance traveled straight ahead since last update
+   * @param dy distance traveled to the left since last update
+   * @param dth heading change since last update
+   */
+  void motion_update(const float dx, const float dy, const float dth);
+
+  /**
+   * Compute a belief for each Particle using the MeasurementModel and newest sensor data.
+   *
+   * With an eval_budget set, the Particles are evaluated in order of their previous belief
+   * (interleaved with a random exploration slice) until the budget is used up. The remaining
+   * Particles keep their previous belief, decayed by belief_decay, which stands in for this
+   * frame's measurement in their weights. They never become the best single Particle.
+   *
+   * With a cascade_threshold set, Particles whose candidate map pieces all fail the histogram
+   * test get CASCADE_BELIEF instead of being measured.
+   *
+   * The beliefs of the evaluated Particles are multiplied onto their importance weights, which
+   * are carried over from frame to frame until the next resampling.
    *
    * @param img new, undistorted, grayscale image of ceiling cam to evaluate against.
    */
   void evaluate(const cv::Mat &img);
 
   /**
-   * Resample the Particles.
+   * Resample the Particles according to their weights. Afterwards, all weights are uniform.
    */
   void resample();
 
   /**
-   * Get the Particle with the highest belief, after calling evaluate(). Make sure not to call
-   * resample() in between evaluate() and getBest(), or the evaluation results will be lost.
+   * Check whether the weights have degenerated enough to make resampling worth its cost.
    *
-   * The best Particle is taken from Binning, if turned on. Otherwise the Particle with the
-   * highest belief is returned.
+   * @return true, if the effective sample size is below resample_ess * particles_num
+   */
+  bool resample_needed() const;
+
+  /**
+   * @return effective sample size 1 / sum(w^2) of the normalized weights
+   */
+  float getEffectiveSampleSize() const {return ess;}
+
+  /**
+   * Get the pose estimate of the Estimator, after calling evaluate(). For the default
+   * BinningEstimator, this is the weighted mean of the best cluster or, with binning turned
+   * off, the Particle with the highest belief.
    *
    * @return A Particle representing the best guess for the cars position in world frame.
    */
   Particle getBest();
 
   Particle getBestSignle(){return best_single;}
-  
-  const int particles_num;
+
+  /**
+   * @return fraction of Particles which were evaluated in the last call to evaluate()
+   */
+  float getEvaluatedRatio(){return evaluated_ratio;}
+
+  /**
+   * @return number of Particles, which passed the histogram test in the last call to
+   *         evaluate()
+   */
+  int getCascadePassed() const {return cascade_passed;}
+
+  /**
+   * @return number of Particles, which the histogram test rejected in the last call to
+   *         evaluate()
+   */
+  int getCascadeRejected() const {return cascade_rejected;}
+
   const int particles_keep;
   const float particle_belief_scale;
   const float particle_stdev_lin;
   const float particle_stdev_ang;
   const float punishEdgeParticlesRate;
   const bool hamid_sampling;
-  const bool binning_enabled;
   const float bin_size;
   const cv::Point3f startPos;
-  
-  std::vector<Particle> particles;
+  const float eval_budget;
+  const float eval_explore;
+  const float belief_decay;
+  const float resample_ess;
+  const float heading_window;
+  const float heading_prior;
+  const float cascade_threshold;
 
 private:
   /**
-   * Use a grid to detect clusters of Particles. Find the cluster with the maximum total belief
-   * and compute a new Particle from the weighted mean of the Particles from this cluster.
+   * Compute the belief of a single Particle and keep track of best_single.
+   *
+   * @param particle the Particle to evaluate
+   */
+  void evaluate_particle(Particle &particle);
+
+  /**
+   * Compare the histogram of the image with the ones of the candidate map pieces of a pose,
+   * see Map::get_candidates().
+   *
+   * @param pos_world the pose
+   * @return false, if all candidates differ by more than cascade_threshold
+   */
+  bool cascade(const cv::Point3f &pos_world);
+
+  /**
+   * Compute the order in which evaluate() visits the Particles. Without an eval_budget this is
+   * just the order of particles. Otherwise, Particles with a high previous belief come first
+   * and a random eval_explore fraction is spread evenly among them.
    *
-   * Binning tends to avoid cluster-jumping and additionally smooths the result in comparison
-   * to the naive approach.
+   * @param order output list of indices into particles
+   */
+  void evaluation_order(std::vector<int> &order);
+
+  /**
+   * Normalize the Particles' log weights, such that the weights sum up to 1, and update ess.
+   * Computed in log domain by subtracting the maximum first, so that long runs without
+   * resampling neither under- nor overflow.
    */
-  void binning();
+  void normalize_weights();
+
+  /**
+   * Reset all weights to 1 / particles.size().
+   */
+  void reset_weights();
+
+  /**
+   * @return bounding box of all Particles in world frame
+   */
+  cv::Rect2f extent() const;
+
+  /**
+   * Pull a heading towards the nearest admitted heading, by heading_prior.
+   *
+   * @param th the heading
+   */
+  void apply_heading_prior(float &th);
 
   cps2::Map *map;
   cps2::ImageEvaluator *image_evaluator;
 
+  MeasurementModel measurement;
+  MotionModel motion;
+  Estimator estimator;
+
   bool setStartPos;
   Particle best_single;
-  Particle best_binning;
+  float evaluated_ratio;
+  float ess;
+  std::vector<float> histogram; //!< of the image, for cascade()
+  int cascade_passed;
+  int cascade_rejected;
+  bool has_heading_prior;
+  float heading_base; //!< admitted headings are heading_base + k * pi/2
   std::random_device rd;
   std::mt19937 gen;
   std::uniform_real_distribution<float> udist_x;
@@ -112,6 +285,29 @@ private:
   std::uniform_real_distribution<float> udist_t;
 };
 
+typedef ParticleFilterT<ImageMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator> ParticleFilter;
+
+/**
+ * ParticleFilter evaluating the Particles on a FieldMeasurement.
+ */
+typedef ParticleFilterT<FieldMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator> FieldParticleFilter;
+
+/**
+ * ParticleFilter evaluating the Particles on a LampMeasurement.
+ */
+typedef ParticleFilterT<LampMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator> LampParticleFilter;
+
+// instantiated in particle_filter.cpp
+extern template class ParticleFilterT<ImageMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator>;
+extern template class ParticleFilterT<FieldMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator>;
+extern template class ParticleFilterT<LampMeasurement, OdometryMotion, SystematicResampler,
+    BinningEstimator>;
+
 } // namespace cps2
 
 #endif
@@ -0,0 +1,462 @@
+#ifndef SRC_PARTICLEFILTER_IMPL_HPP_
+#define SRC_PARTICLEFILTER_IMPL_HPP_
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "particle_filter.hpp"
+
+namespace cps2 {
+
+// lower bound for beliefs before taking the log, so a zero belief does not yield -inf
+const float MIN_BELIEF = 1e-30;
+
+// belief of Particles rejected by the cascade, low but still able to recover
+const float CASCADE_BELIEF = 1e-3;
+
+#define PF_TEMPLATE \
+  template<class MeasurementModel, class MotionModel, class Resampler, class Estimator>
+#define PF_CLASS ParticleFilterT<MeasurementModel, MotionModel, Resampler, Estimator>
+
+PF_TEMPLATE
+PF_CLASS::ParticleFilterT(cps2::Map *_map, cps2::ImageEvaluator *_image_evaluator,
+    int _particles_num, float _particles_keep, float _particle_belief_scale,
+    float _particle_stdev_lin, float _particle_stdev_ang, bool _hamid_sampling,
+    float _bin_size, float _punishEdgeParticlesRate, bool _setStartPos, cv::Point3f _startPos,
+    float _eval_budget, float _eval_explore, float _belief_decay, float _resample_ess,
+    float _heading_window, float _heading_prior, float _cascade_threshold):
+        ParticleFilterBase(_particles_num),
+        map(_map),
+        image_evaluator(_image_evaluator),
+        measurement(_map, _image_evaluator, _particle_belief_scale * _particle_belief_scale,
+            _heading_window),
+        estimator(_bin_size),
+        particles_keep( (int)(_particles_keep * _particles_num) ),
+        particle_belief_scale(_particle_belief_scale * _particle_belief_scale),
+        particle_stdev_lin(_particle_stdev_lin),
+        particle_stdev_ang(_particle_stdev_ang),
+        gen(rd() ),
+        udist_t(0, 2 * M_PI),
+        best_single(0, 0, 0),
+        hamid_sampling(_hamid_sampling),
+        bin_size(_bin_size > 0 ? _bin_size : 0),
+        punishEdgeParticlesRate(_punishEdgeParticlesRate),
+        setStartPos(_setStartPos), startPos(_startPos),
+        eval_budget(_eval_budget > 0 ? _eval_budget : 0),
+        eval_explore(std::max(0.0f, std::min(1.0f, _eval_explore) ) ),
+        belief_decay(_belief_decay),
+        resample_ess(_resample_ess),
+        heading_window(_heading_window > 0 ? _heading_window : 0),
+        heading_prior(std::max(0.0f, std::min(1.0f, _heading_prior) ) ),
+        cascade_threshold(_cascade_threshold > 0 ? _cascade_threshold : 0),
+        cascade_passed(0),
+        cascade_rejected(0),
+        has_heading_prior(false),
+        heading_base(0),
+        evaluated_ratio(1),
+        ess(_particles_num)
+{}
+
+PF_TEMPLATE
+PF_CLASS::~ParticleFilterT() {}
+
+PF_TEMPLATE
+void PF_CLASS::addNewRandomParticles() {
+#ifdef DEBUG_PF_STATIC
+  // generate fixed Particles on a circle around startPos
+  particles.clear();
+  particles.push_back(Particle(startPos.x +   0, startPos.y - 1.0,  0 * M_PI/4) );
+  particles.push_back(Particle(startPos.x + 0.7, startPos.y - 0.7,  1 * M_PI/4) );
+  particles.push_back(Particle(startPos.x + 1.0, startPos.y +   0,  2 * M_PI/4) );
+  particles.push_back(Particle(startPos.x + 0.7, startPos.y + 0.7,  3 * M_PI/4) );
+  particles.push_back(Particle(startPos.x +   0, startPos.y + 1.0,  4 * M_PI/4) );
+  particles.push_back(Particle(startPos.x - 0.7, startPos.y + 0.7, -3 * M_PI/4) );
+  particles.push_back(Particle(startPos.x - 1.0, startPos.y +   0, -2 * M_PI/4) );
+  particles.push_back(Particle(startPos.x - 0.7, startPos.y - 0.7, -1 * M_PI/4) );
+  return;
+#endif
+
+  // fill particles with new, uniformly distributed particles.
+  if(setStartPos) {
+    // only in first frame: generate near startPos
+    const float psdl2 = particle_stdev_lin / 2;
+
+    udist_x.param(std::uniform_real_distribution<float>::param_type(
+        startPos.x - psdl2, startPos.x + psdl2) );
+    udist_y.param(std::uniform_real_distribution<float>::param_type(
+        startPos.y - psdl2, startPos.y + psdl2) );
+
+    setStartPos = false;
+  } else {
+    // generate all over the map
+    udist_x.param(std::uniform_real_distribution<float>::param_type(
+        map->bbox.x, map->bbox.x + map->bbox.width) );
+    udist_y.param(std::uniform_real_distribution<float>::param_type(
+        map->bbox.y, map->bbox.y + map->bbox.height) );
+    }
+
+  // with a heading prior, only draw admitted headings (plus some noise)
+  std::uniform_int_distribution<int> udist_k(0, 3);
+  std::normal_distribution<float> ndist_t(0, particle_stdev_ang);
+  const bool use_prior = has_heading_prior && heading_prior > 0;
+
+  for(int i = 0; i < particles_num - particles.size(); ++i) {
+    const float th = use_prior ? heading_base + udist_k(gen) * M_PI / 2 + ndist_t(gen)
+                               : udist_t(gen);
+    const Particle p(udist_x(gen), udist_y(gen), th);
+
+    particles.push_back(p);
+  }
+
+  reset_weights();
+}
+
+PF_TEMPLATE
+void PF_CLASS::motion_update(const float dx, const float dth) {
+  motion_update(dx, 0, dth);
+}
+
+PF_TEMPLATE
+void PF_CLASS::motion_update(const float dx, const float dy, const float dth) {
+  const cv::Rect2f before = extent();
+
+  for(std::vector<Particle>::iterator it = particles.begin(); it < particles.end(); ++it) {
+    motion.apply(it->p, dx, dy, dth);
+    apply_heading_prior(it->p.z);
+  }
+
+  // the next frame will likely move the particles by about as much again
+  const cv::Rect2f now = extent();
+  const float shift_x  = (now.x + now.width  / 2) - (before.x + before.width  / 2);
+  const float shift_y  = (now.y + now.height / 2) - (before.y + before.height / 2);
+
+  map->prefetch(cv::Rect2f(
+      now.x + fminf(0, shift_x), now.y + fminf(0, shift_y),
+      now.width + fabsf(shift_x), now.height + fabsf(shift_y) ) );
+}
+
+PF_TEMPLATE
+cv::Rect2f PF_CLASS::extent() const {
+  if(particles.empty() )
+    return cv::Rect2f();
+
+  float x_min = particles[0].p.x, x_max = particles[0].p.x;
+  float y_min = particles[0].p.y, y_max = particles[0].p.y;
+
+  for(std::vector<Particle>::const_iterator it = particles.begin(); it != particles.end(); ++it) {
+    x_min = fminf(x_min, it->p.x);
+    x_max = fmaxf(x_max, it->p.x);
+    y_min = fminf(y_min, it->p.y);
+    y_max = fmaxf(y_max, it->p.y);
+  }
+
+  return cv::Rect2f(x_min, y_min, x_max - x_min, y_max - y_min);
+}
+
+PF_TEMPLATE
+void PF_CLASS::update_heading_prior(const cv::Mat &img) {
+  has_heading_prior = false;
+
+  if(heading_prior == 0)
+    return;
+
+  float ceiling;
+
+  if(!map->get_ceiling_orientation(ceiling) )
+    return;
+
+  const OrientationHistogram orientation(img);
+
+  if(!orientation.valid() )
+    return;
+
+  // the ceiling appears rotated by -heading in the image
+  heading_base      = ceiling - orientation.angle;
+  has_heading_prior = true;
+}
+
+PF_TEMPLATE
+void PF_CLASS::apply_heading_prior(float &th) {
+  if(has_heading_prior)
+    th += heading_prior * quarter_diff(th, heading_base);
+}
+
+PF_TEMPLATE
+void PF_CLASS::evaluate(const cv::Mat &img) {
+  const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+      + std::chrono::microseconds( (long)(1e6 * eval_budget) );
+
+  best_single.belief = 0;
+  cascade_passed     = 0;
+  cascade_rejected   = 0;
+
+  measurement.prepare(img, particles);
+
+  if(cascade_threshold > 0)
+    image_evaluator->histogram(image_evaluator->transform(img,
+        cv::Point2i(img.cols / 2, img.rows / 2), 0, 0), histogram);
+
+  std::vector<int> order;
+  evaluation_order(order);
+
+  // evaluate particles against img until all are done or the budget is used up. The first
+  // particle is always evaluated, so there is at least one fresh belief per frame.
+  int evaluated = 0;
+
+  for(; evaluated < order.size(); ++evaluated) {
+    if(eval_budget > 0 && evaluated > 0 && std::chrono::steady_clock::now() > deadline)
+      break;
+
+    evaluate_particle(particles[order[evaluated] ]);
+  }
+
+  // carry the weights over from the last frames, adding only this frame's measurements
+  for(int i = 0; i < evaluated; ++i) {
+    Particle &particle = particles[order[i] ];
+
+    particle.log_weight += logf(std::max(MIN_BELIEF, particle.belief) );
+  }
+
+  // particles left over gained no evidence. They are weighted by their previous belief,
+  // decayed, instead of keeping their weights, which would put them ahead of every evaluated
+  // particle. best_single is one of the evaluated particles
+  for(int i = evaluated; i < order.size(); ++i) {
+    Particle &particle = particles[order[i] ];
+
+    particle.belief     *= belief_decay;
+    particle.log_weight += logf(std::max(MIN_BELIEF, particle.belief) );
+  }
+
+  evaluated_ratio = order.empty() ? 1 : (float)evaluated / order.size();
+
+  normalize_weights();
+
+  estimator.update(particles, best_single, map->bbox);
+}
+
+PF_TEMPLATE
+void PF_CLASS::evaluate_particle(Particle &particle) {
+  particle.belief = 0;
+
+  // skip the measurement for poses that cannot match
+  if(cascade_threshold > 0) {
+    if(!cascade(particle.p) ) {
+      particle.belief = CASCADE_BELIEF;
+      ++cascade_rejected;
+      return;
+    }
+
+    ++cascade_passed;
+  }
+
+  if(!measurement.measure(particle.p, particle.belief) )
+    return;
+
+  // punish particles that are outside the map
+  if (particle.p.x >= (map->bbox.x + map->bbox.width)
+      || particle.p.y >= (map->bbox.y + map->bbox.height)
+      || particle.p.x < map->bbox.x || particle.p.y < map->bbox.y
+  )
+    particle.belief *= punishEdgeParticlesRate;
+
+  // track the best particle
+  if(particle.belief > best_single.belief)
+    best_single = particle;
+}
+
+PF_TEMPLATE
+bool PF_CLASS::cascade(const cv::Point3f &pos_world) {
+  const std::vector<const MapPiece *> &candidates = map->get_candidates(pos_world);
+  bool tested = false;
+
+  for(std::vector<const MapPiece *>::const_iterator it = candidates.begin();
+      it != candidates.end(); ++it)
+  {
+    if((*it)->histogram.empty() )
+      continue;
+
+    if(ImageEvaluator::histogram_distance(histogram, (*it)->histogram) <= cascade_threshold)
+      return true;
+
+    tested = true;
+  }
+
+  // without any histogram to compare with, leave the decision to the measurement
+  return !tested;
+}
+
+PF_TEMPLATE
+void PF_CLASS::evaluation_order(std::vector<int> &order) {
+  const int n = particles.size();
+
+  order.resize(n);
+
+  for(int i = 0; i < n; ++i)
+    order[i] = i;
+
+  if(eval_budget == 0 || n == 0)
+    return;
+
+  // pick the exploration slice by a partial Fisher-Yates shuffle
+  const int n_explore = (int)(eval_explore * n);
+  std::vector<int> explore(order);
+  std::vector<bool> is_explore(n, false);
+
+  for(int i = 0; i < n_explore; ++i) {
+    std::uniform_int_distribution<int> rnd(i, n - 1);
+
+    std::swap(explore[i], explore[rnd(gen)]);
+    is_explore[explore[i] ] = true;
+  }
+
+  // sort by previous belief, highest first
+  std::vector<int> prior(order);
+
+  std::stable_sort(prior.begin(), prior.end(), [this](const int a, const int b) {
+    return particles[a].belief > particles[b].belief;
+  });
+
+  // interleave both lists, such that a short budget still sees some exploration
+  const int stride = n_explore > 0 ? std::max(1, (n - n_explore) / n_explore) : n;
+  int e = 0;
+  int k = 0;
+
+  order.clear();
+
+  for(std::vector<int>::const_iterator it = prior.begin(); it != prior.end(); ++it) {
+    if(is_explore[*it])
+      continue;
+
+    order.push_back(*it);
+
+    if(++k % stride == 0 && e < n_explore)
+      order.push_back(explore[e++]);
+  }
+
+  while(e < n_explore)
+    order.push_back(explore[e++]);
+}
+
+PF_TEMPLATE
+void PF_CLASS::normalize_weights() {
+  if(particles.empty() )
+    return;
+
+  float max_log_weight = -std::numeric_limits<float>::infinity();
+
+  for(std::vector<Particle>::const_iterator it = particles.begin(); it != particles.end(); ++it)
+    max_log_weight = std::max(max_log_weight, it->log_weight);
+
+  // the maximum contributes exp(0) = 1, so sum_weights >= 1
+  float sum_weights = 0;
+
+  for(std::vector<Particle>::iterator it = particles.begin(); it != particles.end(); ++it) {
+    it->weight   = expf(it->log_weight - max_log_weight);
+    sum_weights += it->weight;
+  }
+
+  const float log_sum_weights = max_log_weight + logf(sum_weights);
+  float sum_squares           = 0;
+
+  for(std::vector<Particle>::iterator it = particles.begin(); it != particles.end(); ++it) {
+    it->log_weight -= log_sum_weights;
+    it->weight     /= sum_weights;
+    sum_squares    += it->weight * it->weight;
+  }
+
+  ess = 1 / sum_squares;
+}
+
+PF_TEMPLATE
+void PF_CLASS::reset_weights() {
+  const float weight     = 1.0f / particles.size();
+  const float log_weight = logf(weight);
+
+  for(std::vector<Particle>::iterator it = particles.begin(); it != particles.end(); ++it) {
+    it->weight     = weight;
+    it->log_weight = log_weight;
+  }
+
+  ess = particles.size();
+}
+
+PF_TEMPLATE
+bool PF_CLASS::resample_needed() const {
+  return ess < resample_ess * particles_num;
+}
+
+PF_TEMPLATE
+void PF_CLASS::resample() {
+  std::vector<uint32_t> hits(particles.size(), 0);
+
+  // sum up the weights of all Particles
+  float sum_weights = 0;
+
+  for(std::vector<Particle>::const_iterator it = particles.begin(); it < particles.end(); ++it)
+    sum_weights += it->weight;
+
+  if(sum_weights == 0.0)
+    return;
+
+  // count how often each Particle gets drawn. Particles with a higher weight will be hit
+  // more often.
+  Resampler::hits(particles, sum_weights, particles_keep, hits, gen);
+
+  // distribute new particles near good particles. With hamid sampling, the first hit of each
+  // Particle is kept as is.
+  const uint32_t keep_parent = hamid_sampling ? 1 : 0;
+  std::vector<Particle> new_particles;
+
+  new_particles.reserve(particles_num);
+
+  for(int i = 0; i < particles.size(); ++i) {
+    if(hits[i] == 0)
+      continue;
+
+    const Particle &p = particles[i];
+    const uint32_t kept = std::min(keep_parent, hits[i]);
+
+    for(uint32_t h = 0; h < kept; ++h)
+      new_particles.push_back(p);
+
+    // apply some noise. The amount of noise is scaled by the belief of a Particle
+    std::normal_distribution<float> ndist_x(p.p.x, particle_stdev_lin * (1 - p.belief) );
+    std::normal_distribution<float> ndist_y(p.p.y, particle_stdev_lin * (1 - p.belief) );
+    std::normal_distribution<float> ndist_t(p.p.z, particle_stdev_ang * (1 - p.belief) );
+
+    // generate a particle for each remaining hit
+    for(uint32_t h = kept; h < hits[i]; ++h) {
+      Particle new_particle(
+          fmax(map->bbox.x, fmin(map->bbox.x + map->bbox.width,  ndist_x(gen) ) ),
+          fmax(map->bbox.y, fmin(map->bbox.y + map->bbox.height, ndist_y(gen) ) ),
+          ndist_t(gen) );
+
+      apply_heading_prior(new_particle.p.z);
+
+      // keep the parents belief as a prior for the evaluation order
+      new_particle.belief = p.belief;
+
+      new_particles.push_back(new_particle);
+    }
+  }
+
+  // randomize the remainder
+  particles = new_particles;
+
+  addNewRandomParticles();
+}
+
+PF_TEMPLATE
+Particle PF_CLASS::getBest(){
+  return estimator.get();
+}
+
+#undef PF_TEMPLATE
+#undef PF_CLASS
+
+} // namespace cps2
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <ros/ros.h>
+#include "piece_arena.hpp"
+
+namespace cps2 {
+
+/**
+ * Round up to a multiple of PIECE_ARENA_ALIGN.
+ */
+static size_t align(const size_t size) {
+  return (size + PIECE_ARENA_ALIGN - 1) / PIECE_ARENA_ALIGN * PIECE_ARENA_ALIGN;
+}
+
+/**
+ * State of the arena, shared with the handles of its slots.
+ */
+struct PieceArena::Pool {
+  Pool() : rows(0), cols(0), type(-1), step(0), slot_size(0), bytes(0), slots(0) {}
+
+  ~Pool() {
+    for(std::vector<uchar *>::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+      free(*it);
+  }
+
+  uchar *new_block(const int count) {
+    void *block = NULL;
+
+    if(posix_memalign(&block, PIECE_ARENA_ALIGN, count * slot_size) != 0)
+      return NULL;
+
+    blocks.push_back( (uchar *)block);
+    bytes += count * slot_size;
+    slots += count;
+
+    return (uchar *)block;
+  }
+
+  void release(uchar *slot, const bool spare) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    used.erase(slot);
+
+    if(spare)
+      spare_free.push_back(slot);
+  }
+
+  mutable std::mutex mutex;
+
+  int rows;
+  int cols;
+  int type;
+  size_t step;      //!< of the image rows
+  size_t slot_size;
+  size_t bytes;
+  size_t slots;
+
+  std::vector<uchar *> blocks;
+  std::unordered_map<int64_t, uchar *> tiles; //!< block of each tile
+  std::unordered_set<const uchar *> used;     //!< slots with a live handle
+  std::vector<uchar *> spare_free;            //!< free slots of spare blocks
+};
+
+PieceArena::PieceArena() : pool(std::make_shared<Pool>() ) {
+
+}
+
+cv::Mat PieceArena::allocate(const cv::Point2i &pos_grid, const int rows, const int cols,
+    const int type, std::shared_ptr<void> &handle)
+{
+  // before locking, the old slot releases itself
+  handle.reset();
+
+  std::lock_guard<std::mutex> lock(pool->mutex);
+
+  if(pool->type < 0) {
+    pool->rows      = rows;
+    pool->cols      = cols;
+    pool->type      = type;
+    pool->step      = align(cols * CV_ELEM_SIZE(type) );
+    pool->slot_size = align(rows * pool->step);
+  }
+
+  if(rows != pool->rows || cols != pool->cols || type != pool->type || rows * cols == 0)
+    return cv::Mat();
+
+  // the home slot of the cell
+  const cv::Point2i tile(
+      pos_grid.x >= 0 ? pos_grid.x / PIECE_ARENA_TILE : (pos_grid.x + 1) / PIECE_ARENA_TILE - 1,
+      pos_grid.y >= 0 ? pos_grid.y / PIECE_ARENA_TILE : (pos_grid.y + 1) / PIECE_ARENA_TILE - 1);
+  const int64_t key = ( (int64_t)tile.y << 32) | (uint32_t)tile.x;
+  uchar *&block     = pool->tiles[key];
+
+  if(!block)
+    block = pool->new_block(PIECE_ARENA_TILE * PIECE_ARENA_TILE);
+
+  if(!block) {
+    ROS_ERROR("PieceArena: out of memory");
+    return cv::Mat();
+  }
+
+  const int index = (pos_grid.y - tile.y * PIECE_ARENA_TILE) * PIECE_ARENA_TILE
+                  + pos_grid.x - tile.x * PIECE_ARENA_TILE;
+  uchar *slot     = block + index * pool->slot_size;
+  bool spare      = false;
+
+  // still used by the piece that is being replaced
+  if(pool->used.count(slot) ) {
+    if(pool->spare_free.empty() ) {
+      uchar *spares = pool->new_block(PIECE_ARENA_SPARE);
+
+      if(!spares) {
+        ROS_ERROR("PieceArena: out of memory");
+        return cv::Mat();
+      }
+
+      for(int i = PIECE_ARENA_SPARE - 1; i >= 0; --i)
+        pool->spare_free.push_back(spares + i * pool->slot_size);
+    }
+
+    slot  = pool->spare_free.back();
+    spare = true;
+    pool->spare_free.pop_back();
+  }
+
+  pool->used.insert(slot);
+
+  const std::shared_ptr<Pool> owner = pool;
+
+  handle = std::shared_ptr<void>(slot, [owner, spare](void *p) {
+    owner->release( (uchar *)p, spare);
+  });
+
+  return cv::Mat(rows, cols, type, slot, pool->step);
+}
+
+PieceArenaStats PieceArena::get_stats() const {
+  std::lock_guard<std::mutex> lock(pool->mutex);
+  PieceArenaStats stats;
+
+  stats.bytes      = pool->bytes;
+  stats.slots      = pool->slots;
+  stats.slots_used = pool->used.size();
+
+  return stats;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,64 @@
+#ifndef SRC_PIECE_ARENA_HPP_
+#define SRC_PIECE_ARENA_HPP_
+
+#include <stddef.h>
+#include <memory>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+const int PIECE_ARENA_ALIGN = 64; //!< alignment of slots and image rows, in bytes
+const int PIECE_ARENA_TILE  = 4;  //!< a block holds the slots of TILE x TILE neighbouring cells
+const int PIECE_ARENA_SPARE = 16; //!< slots per spare block
+
+/**
+ * Memory usage of a PieceArena.
+ */
+struct PieceArenaStats {
+  PieceArenaStats() : bytes(0), slots(0), slots_used(0) {}
+
+  size_t bytes;      //!< of all blocks
+  size_t slots;
+  size_t slots_used;
+};
+
+/**
+ * Pool of equally sized image slots for the native images of map pieces.
+ *
+ * Slots are aligned to PIECE_ARENA_ALIGN bytes, and so are the image rows, so each row
+ * starts on a cache line. They are carved from large blocks: every cell of the grid has a
+ * home slot in the block of its PIECE_ARENA_TILE x PIECE_ARENA_TILE tile, so neighbouring
+ * pieces, which are looked up together, are close in memory. If the home slot is still used
+ * by the piece that is being replaced, a slot of a spare block is taken instead.
+ *
+ * A slot is recycled as soon as the last copy of its handle is gone. Handles may be dropped
+ * by any thread and may outlive the arena.
+ */
+class PieceArena {
+public:
+  PieceArena();
+
+  /**
+   * Get an image in a free slot. The size of the first image fixes the size of all slots.
+   * @param pos_grid grid indices of the cell of the piece
+   * @param rows rows of the image
+   * @param cols columns of the image
+   * @param type type of the image
+   * @param handle output handle of the slot, keep it as long as the image is used
+   * @return image pointing into the slot, or an empty image, if the size or type does not
+   *         match the slots
+   */
+  cv::Mat allocate(const cv::Point2i &pos_grid, const int rows, const int cols, const int type,
+      std::shared_ptr<void> &handle);
+
+  PieceArenaStats get_stats() const;
+
+private:
+  struct Pool;
+
+  std::shared_ptr<Pool> pool;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_PIECE_ARENA_HPP_ */
@@ -0,0 +1,233 @@
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+#include "pose_graph.hpp"
+
+namespace cps2 {
+
+/**
+ * Normalize an angle to [-pi, pi).
+ */
+static float normalize_angle(const float th) {
+  return th - 2 * M_PI * floorf( (th + M_PI) / (2 * M_PI) );
+}
+
+PoseGraph::PoseGraph() {
+
+}
+
+int PoseGraph::add_node(const cv::Point3f &pose) {
+  nodes.push_back(pose);
+  adjacent.push_back(std::vector<int>() );
+  touch(nodes.size() - 1);
+
+  return nodes.size() - 1;
+}
+
+void PoseGraph::reset_node(const int node, const cv::Point3f &pose) {
+  nodes[node] = pose;
+
+  // the edges are not needed anymore, their slots stay to keep the indices
+  for(std::vector<int>::const_iterator it = adjacent[node].begin(); it != adjacent[node].end();
+      ++it)
+  {
+    Edge &edge      = edges[*it];
+    const int other = edge.from == node ? edge.to : edge.from;
+
+    if(other != node) {
+      std::vector<int> &list = adjacent[other];
+      list.erase(std::remove(list.begin(), list.end(), *it), list.end() );
+    }
+
+    edge.from = -1;
+  }
+
+  adjacent[node].clear();
+  touch(node);
+}
+
+void PoseGraph::add_edge(const int from, const int to, const cv::Point3f &relative,
+    const float info_lin, const float info_ang)
+{
+  if(from == to)
+    return;
+
+  Edge edge;
+
+  edge.from     = from;
+  edge.to       = to;
+  edge.relative = relative;
+  edge.info_lin = info_lin;
+  edge.info_ang = info_ang;
+
+  edges.push_back(edge);
+  adjacent[from].push_back(edges.size() - 1);
+  adjacent[to].push_back(edges.size() - 1);
+
+  touch(from);
+  touch(to);
+}
+
+void PoseGraph::touch(const int node) {
+  // node 0 anchors the graph
+  if(node == 0)
+    return;
+
+  std::deque<int>::iterator it = std::find(window.begin(), window.end(), node);
+
+  if(it != window.end() )
+    window.erase(it);
+
+  window.push_back(node);
+
+  if(window.size() > POSE_GRAPH_WINDOW)
+    window.pop_front();
+}
+
+cv::Point3f PoseGraph::relative(const cv::Point3f &a, const cv::Point3f &b) {
+  const float c  = cosf(a.z);
+  const float s  = sinf(a.z);
+  const float dx = b.x - a.x;
+  const float dy = b.y - a.y;
+
+  return cv::Point3f(c * dx + s * dy, -s * dx + c * dy, normalize_angle(b.z - a.z) );
+}
+
+void PoseGraph::optimize(const int iterations, std::vector<int> &moved) {
+  moved.clear();
+
+  if(window.empty() )
+    return;
+
+  // position of the nodes of the window in the system
+  std::unordered_map<int, int> index;
+
+  for(int k = 0; k < window.size(); ++k)
+    index[window[k] ] = k;
+
+  // all edges with at least one node in the window
+  std::vector<int> active;
+
+  for(std::deque<int>::const_iterator it = window.begin(); it != window.end(); ++it)
+    for(std::vector<int>::const_iterator e = adjacent[*it].begin(); e != adjacent[*it].end(); ++e)
+      active.push_back(*e);
+
+  std::sort(active.begin(), active.end() );
+  active.erase(std::unique(active.begin(), active.end() ), active.end() );
+
+  if(active.empty() )
+    return;
+
+  const int n = 3 * window.size();
+  std::vector<bool> changed(window.size(), false);
+
+  for(int iteration = 0; iteration < iterations; ++iteration) {
+    cv::Mat H = cv::Mat::eye(n, n, CV_64F) * POSE_GRAPH_DAMPING;
+    cv::Mat b = cv::Mat::zeros(n, 1, CV_64F);
+
+    for(std::vector<int>::const_iterator it = active.begin(); it != active.end(); ++it) {
+      const Edge &edge      = edges[*it];
+      const cv::Point3f &xi = nodes[edge.from];
+      const cv::Point3f &xj = nodes[edge.to];
+      const double c        = cos(xi.z);
+      const double s        = sin(xi.z);
+      const double dx       = xj.x - xi.x;
+      const double dy       = xj.y - xi.y;
+
+      // error of the measured pose of to in the frame of from
+      const double e[3] = {
+           c * dx + s * dy - edge.relative.x,
+          -s * dx + c * dy - edge.relative.y,
+          normalize_angle(xj.z - xi.z - edge.relative.z)
+      };
+
+      // jacobians with respect to from (A) and to (B)
+      const double A[3][3] = {
+          { -c, -s, -s * dx + c * dy},
+          {  s, -c, -c * dx - s * dy},
+          {  0,  0, -1}
+      };
+      const double B[3][3] = {
+          {  c,  s, 0},
+          { -s,  c, 0},
+          {  0,  0, 1}
+      };
+      const double info[3] = {edge.info_lin, edge.info_lin, edge.info_ang};
+
+      const std::unordered_map<int, int>::const_iterator fi = index.find(edge.from);
+      const std::unordered_map<int, int>::const_iterator ti = index.find(edge.to);
+      const int blocks[2]              = {fi == index.end() ? -1 : 3 * fi->second,
+                                          ti == index.end() ? -1 : 3 * ti->second};
+      const double (*J[2])[3][3]       = {&A, &B};
+
+      // H += J_u^T * info * J_v, b += J_u^T * info * e
+      for(int u = 0; u < 2; ++u) {
+        if(blocks[u] < 0)
+          continue;
+
+        for(int r = 0; r < 3; ++r) {
+          for(int k = 0; k < 3; ++k)
+            b.at<double>(blocks[u] + r) += (*J[u])[k][r] * info[k] * e[k];
+
+          for(int v = 0; v < 2; ++v) {
+            if(blocks[v] < 0)
+              continue;
+
+            for(int q = 0; q < 3; ++q) {
+              double h = 0;
+
+              for(int k = 0; k < 3; ++k)
+                h += (*J[u])[k][r] * info[k] * (*J[v])[k][q];
+
+              H.at<double>(blocks[u] + r, blocks[v] + q) += h;
+            }
+          }
+        }
+      }
+    }
+
+    cv::Mat delta;
+
+    if(!cv::solve(H, -b, delta, cv::DECOMP_CHOLESKY) )
+      break;
+
+    for(int k = 0; k < window.size(); ++k) {
+      cv::Point3f &x = nodes[window[k] ];
+      const cv::Point3f d(delta.at<double>(3 * k), delta.at<double>(3 * k + 1),
+          delta.at<double>(3 * k + 2) );
+
+      if(d.x == 0 && d.y == 0 && d.z == 0)
+        continue;
+
+      x.x += d.x;
+      x.y += d.y;
+      x.z  = normalize_angle(x.z + d.z);
+
+      changed[k] = true;
+    }
+  }
+
+  for(int k = 0; k < window.size(); ++k)
+    if(changed[k])
+      moved.push_back(window[k]);
+}
+
+void PoseGraph::optimize_all(const int sweeps) {
+  const std::deque<int> recent = window;
+  std::vector<int> moved;
+
+  for(int sweep = 0; sweep < sweeps; ++sweep)
+    for(int begin = 1; begin < nodes.size(); begin += POSE_GRAPH_WINDOW) {
+      window.clear();
+
+      for(int node = begin; node < std::min<int>(begin + POSE_GRAPH_WINDOW, nodes.size() );
+          ++node)
+        window.push_back(node);
+
+      optimize(1, moved);
+    }
+
+  window = recent;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,100 @@
+#ifndef SRC_POSE_GRAPH_HPP_
+#define SRC_POSE_GRAPH_HPP_
+
+#include <deque>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+const int   POSE_GRAPH_WINDOW  = 32;   //!< max number of nodes optimized per iteration
+const float POSE_GRAPH_DAMPING = 1e-3; //!< added to the diagonal, keeps lone nodes in place
+
+/**
+ * Sparse graph of 2D poses (x, y, th), connected by measured relative poses.
+ *
+ * optimize() runs Gauss-Newton on the POSE_GRAPH_WINDOW most recently touched nodes only,
+ * while all other nodes stay fixed. The cost of an iteration is therefore bounded by the
+ * window and the edges of its nodes, not by the size of the graph. Node 0 is always fixed
+ * and anchors the graph.
+ */
+class PoseGraph {
+public:
+  PoseGraph();
+
+  /**
+   * Add a node.
+   * @param pose initial pose in world frame
+   * @return index of the node
+   */
+  int add_node(const cv::Point3f &pose);
+
+  /**
+   * Move a node to a new pose and remove all its edges, e.g. because the data it stands for
+   * was replaced.
+   * @param node index of the node
+   * @param pose new pose in world frame
+   */
+  void reset_node(const int node, const cv::Point3f &pose);
+
+  /**
+   * Add a measurement of the pose of node to in the frame of node from.
+   * @param from index of a node
+   * @param to index of another node
+   * @param relative pose of to relative to from
+   * @param info_lin information (inverse variance, in 1/m^2) of the translation
+   * @param info_ang information (in 1/rad^2) of the rotation
+   */
+  void add_edge(const int from, const int to, const cv::Point3f &relative, const float info_lin,
+      const float info_ang);
+
+  /**
+   * Run Gauss-Newton iterations on the window of recently touched nodes.
+   * @param iterations number of iterations
+   * @param moved output list of nodes in the window, whose poses changed
+   */
+  void optimize(const int iterations, std::vector<int> &moved);
+
+  /**
+   * Optimize all nodes, e.g. offline: sweep over the nodes in runs of POSE_GRAPH_WINDOW
+   * consecutive indices and run one iteration on each run, like optimize() on its window.
+   * @param sweeps number of sweeps
+   */
+  void optimize_all(const int sweeps);
+
+  /**
+   * @param node index of a node
+   * @return current pose of the node
+   */
+  const cv::Point3f &get_pose(const int node) const {return nodes[node];}
+
+  int size() const {return nodes.size();}
+
+  /**
+   * Relative pose of b in the frame of a.
+   */
+  static cv::Point3f relative(const cv::Point3f &a, const cv::Point3f &b);
+
+private:
+  struct Edge {
+    int from;
+    int to;
+    cv::Point3f relative;
+    float info_lin;
+    float info_ang;
+  };
+
+  /**
+   * Move a node to the end of the window.
+   */
+  void touch(const int node);
+
+  std::vector<cv::Point3f> nodes;
+  std::vector<Edge> edges;                 //!< removed edges have from == -1
+  std::vector<std::vector<int> > adjacent; //!< edges of each node
+  std::deque<int> window;                  //!< recently touched nodes, oldest first
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_POSE_GRAPH_HPP_ */
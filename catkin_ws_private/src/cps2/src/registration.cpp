@@ -0,0 +1,134 @@
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "registration.hpp"
+
+namespace cps2 {
+
+Registration::Registration(int _downscale, float _angle_range, float _angle_step,
+    float _budget)
+    : downscale(std::max(1, _downscale) ),
+      angle_range(std::max(0.0f, _angle_range) ),
+      angle_step(std::max(1e-3f, _angle_step) ),
+      budget(_budget)
+{
+
+}
+
+cv::Mat Registration::patch(const cv::Mat &img) {
+  const int side       = std::min(img.rows, img.cols);
+  const int patch_size = cv::getOptimalDFTSize(std::max(8, side / downscale) );
+
+  cv::Mat small;
+  cv::Mat result;
+
+  cv::resize(img(cv::Rect( (img.cols - side) / 2, (img.rows - side) / 2, side, side) ), small,
+      cv::Size(patch_size, patch_size), 0, 0, cv::INTER_AREA);
+  small.convertTo(result, CV_32F);
+
+  return result;
+}
+
+float Registration::getScale(const cv::Mat &img) const {
+  const int side = std::min(img.rows, img.cols);
+
+  return (float)cv::getOptimalDFTSize(std::max(8, side / downscale) ) / side;
+}
+
+float Registration::correlate(const cv::Mat &patch1, const cv::Mat &patch2, const float th,
+    cv::Point2d &shift)
+{
+  const cv::Point2f center(patch1.cols / 2.0f, patch1.rows / 2.0f);
+
+  // the window only depends on the patch size
+  if(window.size() != patch1.size() )
+    cv::createHanningWindow(window, patch1.size(), CV_32F);
+
+  cv::warpAffine(patch1, rotated, cv::getRotationMatrix2D(center, th * 180 / M_PI, 1),
+      patch1.size() );
+
+  double response;
+  shift = cv::phaseCorrelate(rotated, patch2, window, &response);
+
+  return response;
+}
+
+float Registration::align(const cv::Mat &patch1, const cv::Mat &patch2, const float th_guess,
+    cv::Point3f &result)
+{
+  result = cv::Point3f(0, 0, th_guess);
+
+  if(patch1.empty() || patch1.size() != patch2.size() )
+    return 0;
+
+  const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+      + std::chrono::microseconds( (long)(1e6 * budget) );
+  const int steps = (int)(angle_range / angle_step + 0.5f);
+
+  float best_response = -1;
+  float best_th       = th_guess;
+  cv::Point2d best_shift;
+  cv::Point2d shift;
+
+  // try the guess first, then alternate around it
+  for(int i = 0; i <= 2 * steps; ++i) {
+    if(i > 0 && std::chrono::steady_clock::now() > deadline)
+      break;
+
+    const int step   = (i + 1) / 2 * (i % 2 == 1 ? 1 : -1);
+    const float th   = th_guess + step * angle_step;
+    const float resp = correlate(patch1, patch2, th, shift);
+
+    if(resp > best_response) {
+      best_response = resp;
+      best_th       = th;
+      best_shift    = shift;
+    }
+  }
+
+  // refine the angle in between the steps of the bank
+  for(float delta = angle_step / 2; delta > angle_step / 5; delta /= 2) {
+    const float center = best_th;
+
+    for(int sign = -1; sign <= 1; sign += 2) {
+      if(std::chrono::steady_clock::now() > deadline)
+        break;
+
+      const float th   = center + sign * delta;
+      const float resp = correlate(patch1, patch2, th, shift);
+
+      if(resp > best_response) {
+        best_response = resp;
+        best_th       = th;
+        best_shift    = shift;
+      }
+    }
+  }
+
+  // patch2(x) = rotated(x - shift), so the center of patch2 lies at -shift in the rotated
+  // patch, which is -R(th) * shift in patch1
+  const float c = cosf(best_th);
+  const float s = sinf(best_th);
+
+  result = cv::Point3f(
+      -(c * best_shift.x - s * best_shift.y),
+      -(s * best_shift.x + c * best_shift.y),
+      best_th);
+
+  return std::max(0.0f, best_response);
+}
+
+float Registration::register_images(const cv::Mat &img1, const cv::Mat &img2,
+    const float th_guess, cv::Point3f &result)
+{
+  const float response = align(patch(img1), patch(img2), th_guess, result);
+  const float scale    = getScale(img1);
+
+  result.x /= scale;
+  result.y /= scale;
+
+  return response;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,88 @@
+#ifndef SRC_REGISTRATION_HPP_
+#define SRC_REGISTRATION_HPP_
+
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+/**
+ * Register two images of the ceiling, i.e. find the rotation and translation between them.
+ *
+ * Both images are reduced to a small, square, windowed patch around their center. The first
+ * patch is rotated by a bank of angles around a guess, and the translation for each angle is
+ * found by phase correlation. The angle with the strongest correlation peak is refined by a
+ * local search at half and quarter the angle step. The work is fixed by the patch size and the
+ * number of angles, and additionally capped by a time budget.
+ */
+class Registration {
+public:
+  /**
+   * @param _downscale reduce the images by this factor before registration
+   * @param _angle_range angles up to this far (in radians) from the guess are tried
+   * @param _angle_step distance (in radians) of the angles in the bank
+   * @param _budget time budget (in s) per registration. The guess is always tried, further
+   *        angles only while time is left.
+   */
+  Registration(int _downscale, float _angle_range, float _angle_step, float _budget);
+
+  /**
+   * Cut the largest centered square out of img, downscale it and convert it to float. Patches
+   * can be cached and registered repeatedly with align().
+   *
+   * @param img grayscale image
+   * @return the patch
+   */
+  cv::Mat patch(const cv::Mat &img);
+
+  /**
+   * @param img grayscale image
+   * @return size of patch(img) divided by the size of the square cut out of img
+   */
+  float getScale(const cv::Mat &img) const;
+
+  /**
+   * Register two patches of the same size. The result (dx, dy, th) relates them by
+   * patch2(s) = patch1(R(th) * s + (dx, dy) + center), for s relative to the center and R a
+   * rotation like in ImageEvaluator::transform().
+   *
+   * @param patch1 a patch
+   * @param patch2 another patch
+   * @param th_guess guessed rotation
+   * @param result output translation (in pixels of the patches) and rotation
+   * @return strength of the correlation peak, 0 if the patches do not fit
+   */
+  float align(const cv::Mat &patch1, const cv::Mat &patch2, const float th_guess,
+      cv::Point3f &result);
+
+  /**
+   * Like align(), but for two images of the same size. The translation is in pixels of the
+   * images.
+   */
+  float register_images(const cv::Mat &img1, const cv::Mat &img2, const float th_guess,
+      cv::Point3f &result);
+
+  const int downscale;
+  const float angle_range;
+  const float angle_step;
+  const float budget;
+
+private:
+  /**
+   * Rotate patch1 by th and correlate it with patch2.
+   *
+   * @param patch1 a patch
+   * @param patch2 another patch
+   * @param th rotation of patch1
+   * @param shift output shift of patch2 relative to the rotated patch1
+   * @return strength of the correlation peak
+   */
+  float correlate(const cv::Mat &patch1, const cv::Mat &patch2, const float th,
+      cv::Point2d &shift);
+
+  cv::Mat window;
+  cv::Mat rotated;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_REGISTRATION_HPP_ */
@@ -0,0 +1,171 @@
+#ifndef SRC_RESAMPLERS_HPP_
+#define SRC_RESAMPLERS_HPP_
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "particle.hpp"
+
+namespace cps2 {
+
+/*
+ * Resampling policies for ParticleFilterT. Each one counts how often every Particle gets
+ * drawn when drawing n times proportional to the Particles' weights:
+ *
+ *   template<class Generator>
+ *   static void hits(const std::vector<Particle> &particles, const float sum_weights,
+ *       const int n, std::vector<uint32_t> &hits, Generator &gen);
+ *
+ * hits has the size of particles and is zero-initialized by the caller.
+ */
+
+/**
+ * Walk through the cumulative sum of weights and the sorted positions u at the same time.
+ *
+ * @param weights weights to draw from
+ * @param u sorted positions in [0, sum(weights) )
+ * @param hits output, incremented for each position that falls into a weight
+ */
+inline void cumulative_walk(const std::vector<float> &weights, const std::vector<float> &u,
+    std::vector<uint32_t> &hits)
+{
+  float target = 0;
+  int j        = 0;
+
+  for(int i = 0; i < weights.size() && j < u.size(); ++i) {
+    target += weights[i];
+
+    while(j < u.size() && u[j] < target) {
+      ++hits[i];
+      ++j;
+    }
+  }
+
+  // float rounding may leave the last positions beyond the total sum
+  if(j < u.size() && !hits.empty() )
+    hits.back() += u.size() - j;
+}
+
+/**
+ * Stochastic universal sampling: one random offset, then equidistant steps. Lowest variance
+ * and a single random number per resampling.
+ */
+struct SystematicResampler {
+  template<class Generator>
+  static void hits(const std::vector<Particle> &particles, const float sum_weights,
+      const int n, std::vector<uint32_t> &hits, Generator &gen)
+  {
+    // calculate the size of 'one unit' and generate a random start value in that range
+    const float step = sum_weights / n;
+
+    std::uniform_real_distribution<float> rnd(0, step);
+
+    float current = rnd(gen);
+    float target  = 0;
+
+    // iterate over the Particles and count how often they got 'hit' by SUS. Particles with a
+    // higher weight will be hit more often.
+    for(int i = 0; i < particles.size(); ++i) {
+      target += particles[i].weight;
+
+      while(current < target) {
+        ++hits[i];
+        current += step;
+      }
+    }
+  }
+};
+
+/**
+ * Like SystematicResampler, but with an individual random offset in each of the n strata.
+ */
+struct StratifiedResampler {
+  template<class Generator>
+  static void hits(const std::vector<Particle> &particles, const float sum_weights,
+      const int n, std::vector<uint32_t> &hits, Generator &gen)
+  {
+    const float step = sum_weights / n;
+
+    std::uniform_real_distribution<float> rnd(0, 1);
+
+    int j         = 0;
+    float current = rnd(gen) * step;
+    float target  = 0;
+
+    for(int i = 0; i < particles.size() && j < n; ++i) {
+      target += particles[i].weight;
+
+      while(j < n && current < target) {
+        ++hits[i];
+        ++j;
+        current = (j + rnd(gen) ) * step;
+      }
+    }
+  }
+};
+
+/**
+ * n independent draws. Highest variance, mainly useful as a baseline.
+ */
+struct MultinomialResampler {
+  template<class Generator>
+  static void hits(const std::vector<Particle> &particles, const float sum_weights,
+      const int n, std::vector<uint32_t> &hits, Generator &gen)
+  {
+    std::vector<float> weights(particles.size() );
+
+    for(int i = 0; i < particles.size(); ++i)
+      weights[i] = particles[i].weight;
+
+    draw(weights, sum_weights, n, hits, gen);
+  }
+
+  template<class Generator>
+  static void draw(const std::vector<float> &weights, const float sum_weights,
+      const int n, std::vector<uint32_t> &hits, Generator &gen)
+  {
+    std::uniform_real_distribution<float> rnd(0, sum_weights);
+    std::vector<float> u(n);
+
+    for(int j = 0; j < n; ++j)
+      u[j] = rnd(gen);
+
+    std::sort(u.begin(), u.end() );
+
+    cumulative_walk(weights, u, hits);
+  }
+};
+
+/**
+ * Deterministically take floor(n * w) copies of each Particle and draw the remainder
+ * multinomially from the residual weights.
+ */
+struct ResidualResampler {
+  template<class Generator>
+  static void hits(const std::vector<Particle> &particles, const float sum_weights,
+      const int n, std::vector<uint32_t> &hits, Generator &gen)
+  {
+    std::vector<float> residuals(particles.size() );
+    float sum_residuals = 0;
+    int drawn           = 0;
+
+    for(int i = 0; i < particles.size(); ++i) {
+      const float expected = n * particles[i].weight / sum_weights;
+      const int copies     = std::min(n - drawn, (int)floorf(expected) );
+
+      hits[i]        += copies;
+      drawn          += copies;
+      residuals[i]    = expected - copies;
+      sum_residuals  += residuals[i];
+    }
+
+    if(drawn < n && sum_residuals > 0)
+      MultinomialResampler::draw(residuals, sum_residuals, n - drawn, hits, gen);
+  }
+};
+
+} // namespace cps2
+
+#endif
@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <ros/ros.h>
+#include "shared_map.hpp"
+
+namespace cps2 {
+
+/**
+ * Round up to a multiple of align.
+ */
+static uint64_t align_up(const uint64_t size, const uint64_t align) {
+  return (size + align - 1) / align * align;
+}
+
+/**
+ * @return true, if a process with this pid exists
+ */
+static bool process_alive(const int32_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+SharedMap::SharedMap() :
+    is_server(false),
+    header(NULL),
+    rw_size(0),
+    ro(NULL),
+    ro_size(0),
+    generation(0),
+    dequeue_pos(0),
+    client(-1)
+{
+
+}
+
+SharedMap::~SharedMap() {
+  close();
+}
+
+SharedMapEntry *SharedMap::entries() const {
+  return (SharedMapEntry *)ro;
+}
+
+SharedMapClient *SharedMap::clients() const {
+  return (SharedMapClient *)( (uint8_t *)header + header->clients_offset);
+}
+
+SharedMapUpdate *SharedMap::cell(const uint64_t pos) const {
+  return (SharedMapUpdate *)( (uint8_t *)header + header->queue_offset
+      + (pos % header->settings.queue_length) * header->cell_size);
+}
+
+const uint8_t *SharedMap::slot(const uint32_t index) const {
+  return ro + (header->slots_offset - header->entries_offset) + index * header->slot_size;
+}
+
+bool SharedMap::create(const std::string &_name, const SharedMapSettings &settings) {
+  close();
+
+  name      = _name;
+  is_server = true;
+
+  const uint64_t page   = sysconf(_SC_PAGESIZE);
+  const uint32_t step   = align_up(settings.native_cols, 64);
+  const uint32_t slots  = settings.max_pieces + settings.max_pieces / 4 + 16;
+  const uint64_t slot_size = align_up( (uint64_t)settings.native_rows * step, 64);
+  const uint64_t cell_size = align_up(sizeof(SharedMapUpdate)
+      + (uint64_t)settings.image_rows * settings.image_cols, 64);
+
+  const uint64_t clients_offset = align_up(sizeof(SharedMapHeader), 64);
+  const uint64_t queue_offset   = align_up(clients_offset
+      + SHARED_MAP_MAX_CLIENTS * sizeof(SharedMapClient), 64);
+  const uint64_t entries_offset = align_up(queue_offset
+      + settings.queue_length * cell_size, page);
+  const uint64_t slots_offset   = align_up(entries_offset
+      + settings.max_pieces * sizeof(SharedMapEntry), 64);
+  const uint64_t size           = align_up(slots_offset + slots * slot_size, page);
+
+  // a segment left behind by a crashed server
+  shm_unlink(name.c_str() );
+
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+  if(fd < 0) {
+    ROS_ERROR("SharedMap: can not create %s: %s", name.c_str(), strerror(errno) );
+    return false;
+  }
+
+  if(ftruncate(fd, size) != 0) {
+    ROS_ERROR("SharedMap: can not resize %s to %.1f MB: %s", name.c_str(), size / 1048576.0,
+        strerror(errno) );
+    ::close(fd);
+    shm_unlink(name.c_str() );
+    return false;
+  }
+
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if(data == MAP_FAILED) {
+    ROS_ERROR("SharedMap: can not map %s: %s", name.c_str(), strerror(errno) );
+    shm_unlink(name.c_str() );
+    return false;
+  }
+
+  // the segment is zeroed by ftruncate()
+  header  = new(data) SharedMapHeader();
+  rw_size = size;
+  ro      = (uint8_t *)data + entries_offset;
+  ro_size = 0;
+
+  strncpy(header->magic, "CPS2SHM", sizeof(header->magic) );
+  header->version        = SHARED_MAP_VERSION;
+  header->header_size    = sizeof(SharedMapHeader);
+  header->settings       = settings;
+  header->slots          = slots;
+  header->native_step    = step;
+  header->slot_size      = slot_size;
+  header->cell_size      = cell_size;
+  header->clients_offset = clients_offset;
+  header->queue_offset   = queue_offset;
+  header->entries_offset = entries_offset;
+  header->slots_offset   = slots_offset;
+  header->size           = size;
+  header->server_pid     = getpid();
+
+  for(int i = 0; i < SHARED_MAP_MAX_CLIENTS; ++i)
+    new(&clients()[i]) SharedMapClient();
+
+  // a cell may be claimed for position pos while its sequence is pos
+  for(uint32_t i = 0; i < settings.queue_length; ++i)
+    new(cell(i) ) SharedMapUpdate();
+
+  for(uint32_t i = 0; i < settings.queue_length; ++i)
+    cell(i)->sequence.store(i, std::memory_order_relaxed);
+
+  for(uint32_t i = 0; i < slots; ++i)
+    free_slots.push_back(slots - 1 - i);
+
+  header->sequence.store(0, std::memory_order_release);
+
+  ROS_INFO("SharedMap: created %s, %.1f MB for %u pieces", name.c_str(), size / 1048576.0,
+      settings.max_pieces);
+
+  return true;
+}
+
+bool SharedMap::attach(const std::string &_name, const SharedMapSettings &settings) {
+  close();
+
+  name      = _name;
+  is_server = false;
+
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+
+  if(fd < 0) {
+    ROS_ERROR("SharedMap: can not open %s: %s. Is the map server running?", name.c_str(),
+        strerror(errno) );
+    return false;
+  }
+
+  struct stat st;
+  SharedMapHeader *head = NULL;
+
+  if(fstat(fd, &st) == 0 && st.st_size >= sizeof(SharedMapHeader) ) {
+    void *data = mmap(NULL, sizeof(SharedMapHeader), PROT_READ, MAP_SHARED, fd, 0);
+
+    if(data != MAP_FAILED)
+      head = (SharedMapHeader *)data;
+  }
+
+  if(!head || strncmp(head->magic, "CPS2SHM", sizeof(head->magic) ) != 0
+      || head->version != SHARED_MAP_VERSION || head->header_size != sizeof(SharedMapHeader)
+      || head->size > st.st_size)
+  {
+    ROS_ERROR("SharedMap: %s is not a shared map of this version", name.c_str() );
+
+    if(head)
+      munmap(head, sizeof(SharedMapHeader) );
+
+    ::close(fd);
+    return false;
+  }
+
+  const SharedMapSettings &stored = head->settings;
+
+  if(stored.grid_size != settings.grid_size || stored.resize_scale != settings.resize_scale
+      || stored.kernel_size != settings.kernel_size
+      || stored.kernel_stddev != settings.kernel_stddev || stored.layout != settings.layout)
+  {
+    ROS_ERROR("SharedMap: %s is served with grid_size %.2f, downscale %d, kernel_size %d, "
+        "kernel_stddev %.2f, layout %u", name.c_str(), stored.grid_size, stored.resize_scale,
+        stored.kernel_size, stored.kernel_stddev, stored.layout);
+    munmap(head, sizeof(SharedMapHeader) );
+    ::close(fd);
+    return false;
+  }
+
+  const uint64_t entries_offset = head->entries_offset;
+  const uint64_t size           = head->size;
+
+  munmap(head, sizeof(SharedMapHeader) );
+
+  // the header, client records and queue are written by clients, the rest only by the server
+  void *rw = mmap(NULL, entries_offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  void *r  = mmap(NULL, size - entries_offset, PROT_READ, MAP_SHARED, fd, entries_offset);
+  ::close(fd);
+
+  if(rw == MAP_FAILED || r == MAP_FAILED) {
+    ROS_ERROR("SharedMap: can not map %s: %s", name.c_str(), strerror(errno) );
+
+    if(rw != MAP_FAILED)
+      munmap(rw, entries_offset);
+
+    if(r != MAP_FAILED)
+      munmap(r, size - entries_offset);
+
+    return false;
+  }
+
+  header  = (SharedMapHeader *)rw;
+  rw_size = entries_offset;
+  ro      = (uint8_t *)r;
+  ro_size = size - entries_offset;
+
+  // take a free client record
+  for(int i = 0; i < SHARED_MAP_MAX_CLIENTS && client < 0; ++i) {
+    int32_t expected = 0;
+
+    if(clients()[i].pid.compare_exchange_strong(expected, getpid() ) )
+      client = i;
+  }
+
+  if(client < 0) {
+    ROS_ERROR("SharedMap: %s already has %d clients", name.c_str(), SHARED_MAP_MAX_CLIENTS);
+    close();
+    return false;
+  }
+
+  // nothing read yet, so the server may reuse any retired slot
+  clients()[client].epoch.store(header->sequence.load(std::memory_order_acquire) / 2);
+
+  ROS_INFO("SharedMap: attached to %s as client %d", name.c_str(), client);
+
+  return true;
+}
+
+void SharedMap::close() {
+  if(header && !is_server && client >= 0)
+    clients()[client].pid.store(0);
+
+  if(header)
+    munmap(header, rw_size);
+
+  if(ro && ro_size > 0)
+    munmap(ro, ro_size);
+
+  if(header && is_server)
+    shm_unlink(name.c_str() );
+
+  header     = NULL;
+  ro         = NULL;
+  rw_size    = 0;
+  ro_size    = 0;
+  client     = -1;
+  generation = 0;
+
+  dequeue_pos = 0;
+  entry_index.clear();
+  mirrored.clear();
+  free_slots.clear();
+  retired.clear();
+}
+
+bool SharedMap::submit(const cv::Mat &image, const cv::Point3f &pos_world,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix)
+{
+  if(!header || image.type() != CV_8UC1 || image.rows != header->settings.image_rows
+      || image.cols != header->settings.image_cols)
+    return false;
+
+  // claim a cell: its sequence equals the position while it is free for that position
+  uint64_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+  SharedMapUpdate *update;
+
+  while(true) {
+    update = cell(pos);
+
+    const int64_t diff = (int64_t)update->sequence.load(std::memory_order_acquire)
+                       - (int64_t)pos;
+
+    if(diff == 0) {
+      if(header->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+        break;
+    }
+    else if(diff < 0)
+      return false; // full
+    else
+      pos = header->enqueue_pos.load(std::memory_order_relaxed);
+  }
+
+  update->x                 = pos_world.x;
+  update->y                 = pos_world.y;
+  update->z                 = pos_world.z;
+  update->rows              = image.rows;
+  update->cols              = image.cols;
+  update->cm_width          = camera_matrix.width;
+  update->cm_height         = camera_matrix.height;
+  update->cm_cx             = camera_matrix.cx;
+  update->cm_cy             = camera_matrix.cy;
+  update->cm_focal_length   = camera_matrix.fl;
+  update->cm_ceiling_height = camera_matrix.ceil_height;
+  update->cm_scale          = camera_matrix.scale;
+
+  uint8_t *pixels = (uint8_t *)(update + 1);
+
+  for(int r = 0; r < image.rows; ++r)
+    memcpy(pixels + r * image.cols, image.ptr<uchar>(r), image.cols);
+
+  // hand the cell to the server
+  update->sequence.store(pos + 1, std::memory_order_release);
+
+  return true;
+}
+
+bool SharedMap::pop(cv::Mat &image, cv::Point3f &pos_world,
+    fisheye_camera_matrix::CameraMatrix &camera_matrix)
+{
+  if(!header || !is_server)
+    return false;
+
+  SharedMapUpdate *update = cell(dequeue_pos);
+
+  if(update->sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+    return false;
+
+  pos_world     = cv::Point3f(update->x, update->y, update->z);
+  camera_matrix = fisheye_camera_matrix::CameraMatrix(update->cm_width, update->cm_height,
+      update->cm_cx, update->cm_cy, update->cm_focal_length, update->cm_ceiling_height,
+      update->cm_scale);
+  image         = cv::Mat(update->rows, update->cols, CV_8UC1, (void *)(update + 1) ).clone();
+
+  // free the cell for the round after the next
+  update->sequence.store(dequeue_pos + header->settings.queue_length,
+      std::memory_order_release);
+  ++dequeue_pos;
+
+  return true;
+}
+
+void SharedMap::reclaim() {
+  uint64_t epoch = generation;
+
+  for(int i = 0; i < SHARED_MAP_MAX_CLIENTS; ++i) {
+    SharedMapClient &c = clients()[i];
+    const int32_t pid  = c.pid.load();
+
+    if(pid == 0)
+      continue;
+
+    if(!process_alive(pid) ) {
+      ROS_WARN("SharedMap: dropping client %d, its process %d is gone", i, pid);
+      c.pid.store(0);
+      continue;
+    }
+
+    epoch = std::min(epoch, c.epoch.load() );
+  }
+
+  // a slot retired in generation g is not read by states of generation g or later
+  while(!retired.empty() && retired.front().first <= epoch) {
+    free_slots.push_back(retired.front().second);
+    retired.pop_front();
+  }
+}
+
+int SharedMap::publish(
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> > &grid)
+{
+  if(!header || !is_server)
+    return 0;
+
+  reclaim();
+
+  std::vector<std::pair<int64_t, const std::shared_ptr<const MapPiece> *> > changed;
+
+  for(std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator it =
+      grid.begin(); it != grid.end(); ++it)
+  {
+    if(!it->second || it->second->img.empty() )
+      continue;
+
+    const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> >::const_iterator m =
+        mirrored.find(it->first);
+
+    if(m == mirrored.end() || m->second != it->second)
+      changed.push_back(std::make_pair(it->first, &it->second) );
+  }
+
+  if(changed.empty() )
+    return 0;
+
+  const uint64_t next = generation + 1;
+  int written         = 0;
+
+  // readers retry while the sequence is odd or changed
+  header->sequence.store(2 * generation + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for(int i = 0; i < changed.size(); ++i) {
+    const MapPiece &piece = **changed[i].second;
+
+    if(piece.img.rows != header->settings.native_rows
+        || piece.img.cols != header->settings.native_cols || piece.img.type() != CV_8UC1)
+      continue;
+
+    const std::unordered_map<int64_t, uint32_t>::const_iterator index =
+        entry_index.find(changed[i].first);
+
+    if(free_slots.empty()
+        || (index == entry_index.end() && entry_index.size() >= header->settings.max_pieces) )
+    {
+      ROS_WARN_THROTTLE(10, "SharedMap: %s is full, increase max_pieces", name.c_str() );
+      break;
+    }
+
+    const uint32_t s = free_slots.back();
+    free_slots.pop_back();
+
+    cv::Mat img(piece.img.rows, piece.img.cols, CV_8UC1, (void *)slot(s), header->native_step);
+    piece.img.copyTo(img);
+
+    uint32_t e;
+
+    if(index == entry_index.end() ) {
+      e = entry_index.size();
+      entry_index[changed[i].first] = e;
+    }
+    else {
+      e = index->second;
+      retired.push_back(std::make_pair(next, entries()[e].slot) );
+    }
+
+    SharedMapEntry &entry        = entries()[e];
+    entry.key                    = changed[i].first;
+    entry.x                      = piece.pos_world.x;
+    entry.y                      = piece.pos_world.y;
+    entry.z                      = piece.pos_world.z;
+    entry.orientation_angle      = piece.orientation.angle;
+    entry.orientation_confidence = piece.orientation.confidence;
+    entry.slot                   = s;
+    entry.stamp                  = piece.stamp.toNSec();
+    entry.generation             = next;
+
+    mirrored[changed[i].first] = *changed[i].second;
+    ++written;
+  }
+
+  header->pieces.store(entry_index.size(), std::memory_order_relaxed);
+
+  generation = next;
+  header->sequence.store(2 * generation, std::memory_order_release);
+
+  return written;
+}
+
+bool SharedMap::sync(std::vector<std::pair<cv::Point2i, MapPiece> > &pieces) {
+  pieces.clear();
+
+  if(!header || is_server)
+    return false;
+
+  const uint64_t sequence = header->sequence.load(std::memory_order_acquire);
+
+  if(sequence % 2 != 0 || sequence / 2 == generation)
+    return false;
+
+  const uint32_t count = std::min(header->pieces.load(std::memory_order_relaxed),
+      header->settings.max_pieces);
+  std::vector<SharedMapEntry> copy(entries(), entries() + count);
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  if(header->sequence.load(std::memory_order_relaxed) != sequence)
+    return false;
+
+  for(std::vector<SharedMapEntry>::const_iterator it = copy.begin(); it != copy.end(); ++it) {
+    if(it->generation <= generation || it->slot >= header->slots)
+      continue;
+
+    MapPiece map_piece;
+
+    map_piece.is_set    = true;
+    map_piece.mapped    = true;
+    map_piece.pos_world = cv::Point3f(it->x, it->y, it->z);
+    map_piece.img       = cv::Mat(header->settings.native_rows, header->settings.native_cols,
+        CV_8UC1, (void *)slot(it->slot), header->native_step);
+    map_piece.stamp.fromNSec(it->stamp);
+    map_piece.orientation.angle      = it->orientation_angle;
+    map_piece.orientation.confidence = it->orientation_confidence;
+
+    pieces.push_back(std::make_pair(
+        cv::Point2i( (int32_t)(uint32_t)it->key, (int32_t)(it->key >> 32) ), map_piece) );
+  }
+
+  generation = sequence / 2;
+
+  return true;
+}
+
+void SharedMap::set_epoch(const uint64_t epoch) {
+  if(header && !is_server && client >= 0)
+    clients()[client].epoch.store(epoch);
+}
+
+} /* namespace cps2 */
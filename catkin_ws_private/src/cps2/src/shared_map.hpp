@@ -0,0 +1,228 @@
+#ifndef SRC_SHARED_MAP_HPP_
+#define SRC_SHARED_MAP_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <ros/time.h>
+#include "fisheye_camera_matrix/camera_matrix.hpp"
+#include "map_piece.hpp"
+
+namespace cps2 {
+
+const uint32_t SHARED_MAP_VERSION     = 1;
+const int      SHARED_MAP_MAX_CLIENTS = 16;
+
+/**
+ * Settings of a shared map. The ones a map piece depends on must match between server and
+ * clients, see MapFileHeader.
+ */
+struct SharedMapSettings {
+  float grid_size;
+  int32_t resize_scale;
+  int32_t kernel_size;
+  float kernel_stddev;
+  uint32_t layout;        //!< MAP_FILE_LAYOUT_*
+
+  // sizes, only set by the server
+  uint32_t image_rows;    //!< of the frames in the queue
+  uint32_t image_cols;
+  uint32_t native_rows;   //!< of the piece images
+  uint32_t native_cols;
+  uint32_t max_pieces;
+  uint32_t queue_length;
+};
+
+/**
+ * Header at the start of a shared map segment. All but the atomic fields are written once
+ * by the server, before any client can attach.
+ */
+struct SharedMapHeader {
+  char magic[8];          //!< "CPS2SHM"
+  uint32_t version;       //!< SHARED_MAP_VERSION
+  uint32_t header_size;   //!< sizeof(SharedMapHeader)
+  SharedMapSettings settings;
+  uint32_t slots;
+  uint32_t native_step;
+  uint64_t slot_size;
+  uint64_t cell_size;     //!< of a queue cell, including the image
+  uint64_t clients_offset;
+  uint64_t queue_offset;
+  uint64_t entries_offset; //!< page aligned, the rest is mapped read-only by the clients
+  uint64_t slots_offset;
+  uint64_t size;
+  int32_t server_pid;
+
+  std::atomic<uint64_t> sequence;    //!< 2 * generation, odd while the entries are written
+  std::atomic<uint32_t> pieces;      //!< entries in use
+  std::atomic<uint64_t> enqueue_pos; //!< next queue cell to be claimed by a client
+};
+
+/**
+ * A client attached to the segment.
+ */
+struct SharedMapClient {
+  std::atomic<int32_t> pid;    //!< 0 if unused
+  std::atomic<uint64_t> epoch; //!< oldest generation the client may still read
+};
+
+/**
+ * A queue cell, followed by the image of the frame.
+ */
+struct SharedMapUpdate {
+  std::atomic<uint64_t> sequence; //!< see SharedMap::submit()
+  float x;
+  float y;
+  float z;
+  uint32_t rows;
+  uint32_t cols;
+  int32_t cm_width;               //!< of the camera matrix
+  int32_t cm_height;
+  int32_t cm_cx;
+  int32_t cm_cy;
+  float cm_focal_length;
+  float cm_ceiling_height;
+  float cm_scale;
+};
+
+/**
+ * A map piece in the segment. Its image is in a slot.
+ */
+struct SharedMapEntry {
+  int64_t key;            //!< key in MapState::grid
+  float x;
+  float y;
+  float z;
+  float orientation_angle;
+  float orientation_confidence;
+  uint32_t slot;
+  uint64_t stamp;         //!< in ns
+  uint64_t generation;    //!< in which the entry last changed
+};
+
+/**
+ * A map in POSIX shared memory, so several localization processes on one machine can use the
+ * same map. A map server owns the map and is the only writer of the map pieces. Clients
+ * submit their frames through a bounded, lock-free queue and read the pieces without
+ * copying: their images point into a read-only mapping of the segment.
+ *
+ * Published piece images are never changed. The server writes a changed piece into a free
+ * slot and publishes the entries under a sequence lock, with a new generation. The replaced
+ * slot is only reused once every client reports an epoch at or beyond that generation, i.e.
+ * it holds no state that may still refer to it. Clients that died are dropped.
+ */
+class SharedMap {
+public:
+  SharedMap();
+  virtual ~SharedMap();
+
+  /**
+   * Create the segment, replacing a stale one of the same name. Only for the server.
+   * @param name name of the segment, see shm_open()
+   * @param settings settings and sizes
+   * @return false on errors
+   */
+  bool create(const std::string &name, const SharedMapSettings &settings);
+
+  /**
+   * Attach to the segment of a running server. Only for clients.
+   * @param name name of the segment
+   * @param settings expected settings, the sizes are ignored
+   * @return false, if there is no such segment, it has other settings, or all client
+   *         records are taken
+   */
+  bool attach(const std::string &name, const SharedMapSettings &settings);
+
+  /**
+   * Queue a frame for the server. Never blocks; the frame is dropped if the queue is full.
+   * Only for clients.
+   * @return false, if the frame was dropped
+   */
+  bool submit(const cv::Mat &image, const cv::Point3f &pos_world,
+      const fisheye_camera_matrix::CameraMatrix &camera_matrix);
+
+  /**
+   * Take the oldest queued frame. Only for the server.
+   * @return false, if the queue is empty
+   */
+  bool pop(cv::Mat &image, cv::Point3f &pos_world,
+      fisheye_camera_matrix::CameraMatrix &camera_matrix);
+
+  /**
+   * Write all pieces that changed since the last call and publish them as a new generation.
+   * Also frees the slots no client can read anymore. Only for the server.
+   * @param grid the server's current pieces, see MapState::grid
+   * @return number of pieces written. Pieces that do not fit are tried again next time.
+   */
+  int publish(const std::unordered_map<int64_t, std::shared_ptr<const MapPiece> > &grid);
+
+  /**
+   * Read the pieces that changed since the last call. Only for clients.
+   * @param pieces output list of pieces with the grid indices of their keys, see
+   *        Map::key2grid(). Their images point into the segment.
+   * @return false, if nothing changed or the server is just writing
+   */
+  bool sync(std::vector<std::pair<cv::Point2i, MapPiece> > &pieces);
+
+  /**
+   * Tell the server the oldest generation this client may still read. Only for clients.
+   */
+  void set_epoch(const uint64_t epoch);
+
+  /**
+   * @return generation of the last publish() or sync()
+   */
+  uint64_t get_generation() const {return generation;}
+
+  /**
+   * @return number of free slots, only for the server
+   */
+  size_t get_free_slots() const {return free_slots.size();}
+
+  bool is_open() const {return header != NULL;}
+
+  /**
+   * Detach, or remove the segment if this is the server.
+   */
+  void close();
+
+private:
+  SharedMapEntry *entries() const;
+  SharedMapClient *clients() const;
+  SharedMapUpdate *cell(const uint64_t pos) const;
+  const uint8_t *slot(const uint32_t index) const;
+
+  /**
+   * Free the retired slots, which no client can read anymore.
+   */
+  void reclaim();
+
+  std::string name;
+  bool is_server;
+  SharedMapHeader *header; //!< start of the read-write mapping
+  size_t rw_size;
+  uint8_t *ro;             //!< entries and slots, mapped read-only by clients
+  size_t ro_size;          //!< 0 if ro is part of the read-write mapping
+  uint64_t generation;
+
+  // server only
+  uint64_t dequeue_pos;
+  std::unordered_map<int64_t, uint32_t> entry_index;                      //!< by key
+  std::unordered_map<int64_t, std::shared_ptr<const MapPiece> > mirrored; //!< by key
+  std::vector<uint32_t> free_slots;
+  std::deque<std::pair<uint64_t, uint32_t> > retired; //!< generation and slot, oldest first
+
+  // client only
+  int client;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_SHARED_MAP_HPP_ */
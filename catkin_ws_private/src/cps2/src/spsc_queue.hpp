@@ -0,0 +1,208 @@
+#ifndef SRC_SPSC_QUEUE_HPP_
+#define SRC_SPSC_QUEUE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace cps2 {
+
+/**
+ * Bounded queue between one producer and one consumer thread, which drops the oldest item
+ * when it is full, so the producer never waits and the consumer always gets the most recent
+ * items in order.
+ *
+ * Each slot holds a pointer to a node with an item and its sequence number. push() swaps a
+ * filled node into its slot and keeps the node it replaces, which is the oldest one if the
+ * consumer fell behind by a whole lap, for the next push(). pop() swaps its slot empty,
+ * notices nodes of a later lap by their sequence number, and hands the node back to the
+ * producer through a ring of free nodes. All capacity + 2 nodes are allocated up front, so
+ * neither side allocates, and push() and pop() do not lock.
+ *
+ * wait_pop() sleeps on a condition variable. It raises a flag before it checks the queue for
+ * the last time, and push() only takes the mutex to wake it up while that flag is raised.
+ */
+template<typename T>
+class SpscQueue {
+public:
+  /**
+   * @param _capacity max number of queued items, at least 1
+   */
+  SpscQueue(const size_t _capacity) :
+    slots(_capacity > 0 ? _capacity : 1),
+    nodes(slots.size() + 2),
+    free_nodes(nodes.size() ),
+    spare(NULL),
+    tail(0),
+    head(0),
+    free_head(0),
+    free_tail(nodes.size() ),
+    dropped_items(0),
+    waiting(false),
+    closed(false)
+  {
+    for(typename std::vector<std::atomic<Node *> >::iterator it = slots.begin();
+        it != slots.end(); ++it)
+      it->store(NULL);
+
+    // at most capacity nodes are queued, one is held by pop() and one is the spare or filled
+    // by push(), so push() always finds a free one
+    for(size_t i = 0; i < nodes.size(); ++i)
+      free_nodes[i] = &nodes[i];
+  }
+
+  /**
+   * Queue an item, dropping the oldest one if the queue is full. Producer only.
+   */
+  void push(const T &item) {
+    Node *node = spare;
+
+    if(node)
+      spare = NULL;
+    else {
+      // only until the latest recycle() is visible, see the constructor
+      while(free_head == free_tail.load(std::memory_order_acquire) )
+        ;
+
+      node = free_nodes[free_head++ % free_nodes.size()];
+    }
+
+    node->item = item;
+    node->seq  = tail++;
+
+    // sequentially consistent, so either the consumer sees the node or this sees waiting
+    Node *old = slots[node->seq % slots.size()].exchange(node);
+
+    if(old) {
+      old->item = T();
+      spare     = old;
+      dropped_items.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if(waiting.load() ) {
+      std::lock_guard<std::mutex> lock(mutex);
+      cond.notify_one();
+    }
+  }
+
+  /**
+   * Take the oldest item without waiting. Consumer only.
+   * @return false if the queue is empty
+   */
+  bool pop(T &item) {
+    for(;;) {
+      std::atomic<Node *> &slot = slots[head % slots.size()];
+      Node *node                = slot.exchange(NULL, std::memory_order_acq_rel);
+
+      if(!node)
+        return false;
+
+      if(node->seq == head) {
+        item       = node->item;
+        node->item = T();
+        ++head;
+        recycle(node);
+
+        return true;
+      }
+
+      // the producer lapped the consumer, the items before node->seq - capacity + 1 are gone.
+      // Put node back for later, unless the producer already replaced it by an even newer one.
+      const uint64_t seq = node->seq;
+      Node *expected     = NULL;
+
+      if(!slot.compare_exchange_strong(expected, node, std::memory_order_acq_rel) ) {
+        node->item = T();
+        recycle(node);
+        dropped_items.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      head = seq - slots.size() + 1;
+    }
+  }
+
+  /**
+   * Take the oldest item, waiting for one if the queue is empty. Consumer only.
+   * @return false once the queue is closed and empty
+   */
+  bool wait_pop(T &item) {
+    for(;;) {
+      if(pop(item) )
+        return true;
+
+      std::unique_lock<std::mutex> lock(mutex);
+
+      // raised before checking, see push()
+      waiting.store(true);
+
+      if(slots[head % slots.size()].load() ) {
+        waiting.store(false);
+        continue;
+      }
+
+      if(closed.load() ) {
+        waiting.store(false);
+        return pop(item);
+      }
+
+      cond.wait(lock);
+      waiting.store(false);
+    }
+  }
+
+  /**
+   * Wake up the consumer for good, e.g. on shutdown.
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed.store(true);
+    }
+
+    cond.notify_one();
+  }
+
+  /**
+   * @return number of items dropped so far because the consumer fell behind
+   */
+  uint64_t dropped() const {return dropped_items.load(std::memory_order_relaxed);}
+
+  size_t capacity() const {return slots.size();}
+
+private:
+  struct Node {
+    T item;
+    uint64_t seq;
+  };
+
+  /**
+   * Hand a node, which the consumer is done with, back to the producer. Consumer only.
+   */
+  void recycle(Node *node) {
+    const uint64_t t = free_tail.load(std::memory_order_relaxed);
+
+    free_nodes[t % free_nodes.size()] = node;
+    free_tail.store(t + 1, std::memory_order_release);
+  }
+
+  std::vector<std::atomic<Node *> > slots;
+  std::vector<Node> nodes;         //!< all nodes, never resized
+  std::vector<Node *> free_nodes;  //!< ring of the nodes neither in a slot nor the spare
+  Node *spare;                     //!< node of the last dropped item, producer only
+  uint64_t tail;                   //!< sequence number of the next item, producer only
+  uint64_t head;                   //!< sequence number of the next item to take, consumer only
+  uint64_t free_head;              //!< next free node to take, producer only
+  std::atomic<uint64_t> free_tail; //!< next position to return a node to, written by consumer
+  std::atomic<uint64_t> dropped_items;
+  std::atomic<bool> waiting;       //!< the consumer is about to sleep in wait_pop()
+  std::atomic<bool> closed;
+  std::mutex mutex;
+  std::condition_variable cond;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_SPSC_QUEUE_HPP_ */
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cv_bridge/cv_bridge.h>
+#include <image_transport/image_transport.h>
+#include <nav_msgs/Odometry.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <ros/ros.h>
+#include <tf/tf.h>
+#include "../grid_map.hpp"
+#include "../particle_filter_impl.hpp"
+
+/*
+ * Run all combinations of resamplers and estimators, and the default ParticleFilter on a
+ * FieldMeasurement and on a LampMeasurement, side by side on the same recorded data
+ * (usually a rosbag, see benchmark_particle_filter.launch). All filters evaluate against one
+ * shared map, which is updated with the estimate of the default ParticleFilter. For each
+ * combination the time per frame, the number of resamplings and the mean distance to the
+ * estimate of the default ParticleFilter are printed.
+ */
+
+struct Params {
+  int particles_num;
+  float particles_keep;
+  float particle_belief_scale;
+  float particle_stddev_lin;
+  float particle_stddev_ang;
+  float bin_size;
+  float punishEdgeParticlesRate;
+  float resample_ess;
+  float heading_window;
+  float heading_prior;
+  cv::Point3f pos_start;
+};
+
+class Runner {
+public:
+  Runner(const std::string &_name) : name(_name), frames(0), resamplings(0), seconds(0),
+      sum_dist(0) {}
+  virtual ~Runner() {}
+
+  virtual void init() = 0;
+  virtual cps2::Particle step(const cv::Mat &img, const float dx, const float dth) = 0;
+
+  const std::string name;
+  int frames;
+  int resamplings;
+  double seconds;
+  double sum_dist;
+};
+
+template<class PF>
+class RunnerT : public Runner {
+public:
+  RunnerT(const std::string &_name, cps2::Map *map, cps2::ImageEvaluator *image_evaluator,
+      const Params &p) :
+    Runner(_name),
+    pf(map, image_evaluator, p.particles_num, p.particles_keep, p.particle_belief_scale,
+       p.particle_stddev_lin, p.particle_stddev_ang, false, p.bin_size,
+       p.punishEdgeParticlesRate, true, p.pos_start, 0, 0, 1, p.resample_ess,
+       p.heading_window, p.heading_prior, 0) {}
+
+  void init() {
+    pf.addNewRandomParticles();
+  }
+
+  cps2::Particle step(const cv::Mat &img, const float dx, const float dth) {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    pf.update_heading_prior(img);
+    pf.motion_update(dx, dth);
+
+    if(pf.resample_needed() ) {
+      pf.resample();
+      ++resamplings;
+    }
+
+    pf.evaluate(img);
+
+    const cps2::Particle best = pf.getBest();
+
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ++frames;
+
+    return best;
+  }
+
+private:
+  PF pf;
+};
+
+cps2::ImageEvaluator *image_evaluator;
+cps2::Map *map;
+std::vector<Runner *> runners;
+Params params;
+
+bool ready             = false;
+bool has_camera_matrix = false;
+cv::Mat image;
+cv::Point2f pos_relative_vel;
+nav_msgs::Odometry odom_last;
+fisheye_camera_matrix::CameraMatrix camera_matrix;
+ros::Time stamp_last_odom;
+ros::Time stamp_last_image;
+
+template<class R, class E>
+void add_runner(const std::string &name) {
+  runners.push_back(new RunnerT<cps2::ParticleFilterT<cps2::ImageMeasurement,
+      cps2::OdometryMotion, R, E> >(name, map, image_evaluator, params) );
+}
+
+template<class E>
+void add_resamplers(const std::string &estimator) {
+  add_runner<cps2::SystematicResampler,   E>("systematic  / " + estimator);
+  add_runner<cps2::StratifiedResampler,   E>("stratified  / " + estimator);
+  add_runner<cps2::ResidualResampler,     E>("residual    / " + estimator);
+  add_runner<cps2::MultinomialResampler,  E>("multinomial / " + estimator);
+}
+
+void print_results() {
+  printf("\n%-26s %8s %12s %12s %12s\n", "resampler / estimator", "frames", "ms/frame",
+      "resamplings", "dist [m]");
+
+  for(std::vector<Runner *>::const_iterator it = runners.begin(); it != runners.end(); ++it) {
+    const Runner *r = *it;
+
+    if(r->frames == 0)
+      continue;
+
+    printf("%-26s %8d %12.3f %12d %12.3f\n", r->name.c_str(), r->frames,
+        1000 * r->seconds / r->frames, r->resamplings, r->sum_dist / r->frames);
+  }
+}
+
+void callback_odometry(const nav_msgs::Odometry &msg) {
+  if(stamp_last_odom.isZero() ) {
+    stamp_last_odom = msg.header.stamp;
+    return;
+  }
+
+  stamp_last_odom = msg.header.stamp;
+
+  tf::Quaternion q_last;
+  tf::Quaternion q_now;
+
+  tf::quaternionMsgToTF(odom_last.pose.pose.orientation, q_last);
+  tf::quaternionMsgToTF(msg.pose.pose.orientation, q_now);
+
+  pos_relative_vel.x  = msg.twist.twist.linear.x;
+  pos_relative_vel.y -= tf::getYaw(q_now) - tf::getYaw(q_last);
+  odom_last           = msg;
+}
+
+void callback_camera_matrix(const fisheye_camera_matrix_msgs::CameraMatrix &msg) {
+  fisheye_camera_matrix::CameraMatrix cm(msg);
+  camera_matrix     = cm;
+  has_camera_matrix = true;
+}
+
+void callback_image(const sensor_msgs::ImageConstPtr &msg) {
+  cv::cvtColor(cv_bridge::toCvShare(msg, "bgr8")->image, image, CV_BGR2GRAY);
+
+  if(!ready) {
+    if(!has_camera_matrix)
+      return;
+
+    map->update(image, cps2::Particle(params.pos_start.x, params.pos_start.y,
+        params.pos_start.z), camera_matrix);
+
+    for(std::vector<Runner *>::iterator it = runners.begin(); it != runners.end(); ++it)
+      (*it)->init();
+
+    ready            = true;
+    stamp_last_image = msg->header.stamp;
+    return;
+  }
+
+  const float dt   = (msg->header.stamp - stamp_last_image).toSec();
+  stamp_last_image = msg->header.stamp;
+
+  // the first runner is the default ParticleFilter and serves as the reference
+  const cps2::Particle reference = runners.front()->step(
+      image, dt * pos_relative_vel.x, -pos_relative_vel.y);
+
+  for(std::vector<Runner *>::iterator it = runners.begin() + 1; it != runners.end(); ++it) {
+    const cps2::Particle best = (*it)->step(image, dt * pos_relative_vel.x, -pos_relative_vel.y);
+    const float dx            = best.p.x - reference.p.x;
+    const float dy            = best.p.y - reference.p.y;
+
+    (*it)->sum_dist += sqrtf(dx * dx + dy * dy);
+  }
+
+  map->update(image, reference, camera_matrix);
+
+  pos_relative_vel.y = 0;
+
+  if(runners.front()->frames % 100 == 0)
+    print_results();
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "benchmark_particle_filter");
+
+  // all settings are private parameters, see benchmark_particle_filter.launch
+  ros::NodeHandle nh_private("~");
+  float grid_size, kernel_stddev;
+  int downscale, kernel_size, errorfunction;
+
+  nh_private.param("grid_size",               grid_size,                      1.0f);
+  nh_private.param("downscale",               downscale,                      25);
+  nh_private.param("kernel_size",             kernel_size,                    5);
+  nh_private.param("kernel_stddev",           kernel_stddev,                  2.5f);
+  nh_private.param("particles_num",           params.particles_num,           50);
+  nh_private.param("particles_keep",          params.particles_keep,          1.0f);
+  nh_private.param("particle_belief_scale",   params.particle_belief_scale,   4.0f);
+  nh_private.param("particle_stddev_lin",     params.particle_stddev_lin,     0.1f);
+  nh_private.param("particle_stddev_ang",     params.particle_stddev_ang,     0.1f);
+  nh_private.param("bin_size",                params.bin_size,                0.5f);
+  nh_private.param("punishEdgeParticlesRate", params.punishEdgeParticlesRate, 0.5f);
+  nh_private.param("resample_ess",            params.resample_ess,            0.5f);
+  nh_private.param("errorfunction",           errorfunction,                  0);
+  nh_private.param("heading_window",          params.heading_window,          0.0f);
+  nh_private.param("heading_prior",           params.heading_prior,           0.0f);
+  params.pos_start                     = cv::Point3f(grid_size / 2, grid_size / 2, 0);
+
+  image_evaluator = new cps2::ImageEvaluator(errorfunction, downscale, kernel_size, kernel_stddev);
+
+  cps2::MapSettings map_settings;
+
+  map_settings.grid_size           = grid_size;
+  map_settings.update_interval_min = 2;
+  map_settings.update_interval_max = 120;
+
+  map = new cps2::GridMap(image_evaluator, map_settings);
+
+  // the default ParticleFilter goes first
+  runners.push_back(new RunnerT<cps2::ParticleFilter>(
+      "systematic  / binning (default)", map, image_evaluator, params) );
+
+  runners.push_back(new RunnerT<cps2::FieldParticleFilter>(
+      "systematic  / binning (field)", map, image_evaluator, params) );
+
+  runners.push_back(new RunnerT<cps2::LampParticleFilter>(
+      "systematic  / binning (lamps)", map, image_evaluator, params) );
+
+  add_resamplers<cps2::SingleBestEstimator>("single");
+  add_resamplers<cps2::BinningEstimator>("binning");
+  add_resamplers<cps2::ClusterEstimator>("cluster");
+
+  ros::NodeHandle nh;
+  image_transport::ImageTransport it(nh);
+
+  odom_last.pose.pose.orientation.w = 1;
+
+  ros::Subscriber sub_odo             = nh.subscribe("/odom", 1, &callback_odometry);
+  ros::Subscriber sub_camera_matrix   = nh.subscribe("/usb_cam/camera_matrix", 1, &callback_camera_matrix);
+  image_transport::Subscriber sub_img = it.subscribe("/usb_cam/image_undistorted", 1, &callback_image);
+
+  ros::spin();
+
+  print_results();
+
+  return 0;
+}
@@ -1,9 +1,83 @@
 #include <limits>
+#include <chrono>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/opencv.hpp>
 #include <ros/ros.h>
 #include <ros/package.h>
-#include "../map.hpp"
+#include "../grid_map.hpp"
+
+/* Moved from Map, the brute force reference for Map::image_distance */
+
+/**
+ * Translate and rotate an image, truncating the borders.
+ */
+cv::Mat transform(const cv::Mat &img, const int dx, const int dy, const float rotation) {
+  const int cx1   = img.cols / 2;
+  const int cy1   = img.rows / 2;
+  const int dim_x = std::min(40, img.cols - 2 * abs(dx) );
+  const int dim_y = std::min(40, img.rows - 2 * abs(dy) );
+  const int cx2   = dim_x / 2;
+  const int cy2   = dim_y / 2;
+  const float phs = sinf(rotation);
+  const float phc = cosf(rotation);
+
+  cv::Mat img_tf(dim_y, dim_x, CV_8UC1);
+
+  for(int c = 0; c < dim_x; ++c) {
+    const int sx = c - cx2;
+
+    for(int r = 0; r < dim_y; ++r) {
+      const int sy   = r - cy2;
+      const float x  = sx + dx;
+      const float y  = sy + dy;
+      const float xx = x * phc - y * phs + cx1;
+      const float yy = x * phs + y * phc + cy1;
+
+      if(xx >= 0 && yy >= 0 && xx < img.cols && yy < img.rows)
+        img_tf.at<uchar>(r, c) = img.at<uchar>( rintf(yy), rintf(xx) );
+      else
+        img_tf.at<uchar>(r, c) = 0;
+    }
+  }
+
+  return img_tf;
+}
+
+cv::Point3f image_distance_bf(cps2::ImageEvaluator &image_evaluator,
+    fisheye_camera_matrix::CameraMatrix &camera_matrix, const cv::Mat &img1,
+    const cv::Mat &img2, const cv::Point3f &pos_prev, const cv::Point3f &pos_now) {
+
+  // this is a brute force experimental approach!
+  const cv::Point2i shift = camera_matrix.relative2image(
+      cv::Point2f(pos_now.x - pos_prev.x, pos_now.y - pos_prev.y) )
+      - cv::Point2i(img1.cols / 2, img1.rows / 2);
+
+  int best_x     = shift.x;
+  int best_y     = shift.y;
+  float best_th  = pos_now.z - pos_prev.z;
+  float best_err = 1;
+
+  for(float th = pos_now.z - pos_prev.z - 0.1; th <= pos_now.z - pos_prev.z + 0.1; th += 0.02)
+    for(int dx = shift.x - 10; dx <= shift.x + 10; dx += 2)
+      for(int dy = shift.y - 20; dy <= shift.y + 20; dy += 4) {
+        const cv::Mat img1_cut = transform(img1,  dx / 2,  dy / 2, 0);
+        const cv::Mat img2_cut = transform(img2, -dx / 2, -dy / 2, -th);
+        const float err        = image_evaluator.evaluate(img1_cut, img2_cut);
+
+        if(err < best_err) {
+          best_x   = dx;
+          best_y   = dy;
+          best_th  = th;
+          best_err = err;
+        }
+      }
+
+  cv::Point2f best_rel = camera_matrix.image2relative(
+      cv::Point2i(best_x + img1.cols / 2, best_y + img1.rows / 2) )
+      + cv::Point2f(pos_prev.x, pos_prev.y);
+
+  return cv::Point3f(best_rel.x, best_rel.y, best_th + pos_prev.z);
+}
 
 int main(int argc, char* argv[]) {
   ros::init(argc, argv, "stitching");
@@ -18,7 +92,11 @@ int main(int argc, char* argv[]) {
   }
 
   cps2::ImageEvaluator image_evaluator(cps2::IE_MODE_PIXELS, 1, 1, 1);
-  cps2::Map map(&image_evaluator, false, 1.0, 1, 60);
+  cps2::MapSettings map_settings;
+
+  map_settings.keep_full_res = true;
+
+  cps2::GridMap map(&image_evaluator, map_settings);
   fisheye_camera_matrix::CameraMatrix camera_matrix(
       (ros::package::getPath("fisheye_camera_matrix")
       + std::string("/config/default.calib") ).c_str()
@@ -56,25 +134,45 @@ int main(int argc, char* argv[]) {
   printf("guessed vector image1->image2:   %.2f, %.2f, %.2f \n",
       img2_guess_pos_rel.x, img2_guess_pos_rel.y, img2_guess_pos_rel.z);
   
-  // image 2 corrected guess
+  // image 2 corrected guess, by brute force and by the registration of the map
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  cv::Point3f img2_bf_pos_rel = image_distance_bf(image_evaluator, camera_matrix, img1,
+      img2_real_img, cv::Point3f(0, 0, 0), img2_guess_pos_rel);
+
+  const double duration_bf = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+
   cv::Point3f img2_corr_pos_rel = map.image_distance(img1, img2_real_img,
       cv::Point3f(0, 0, 0), img2_guess_pos_rel);
 
+  const double duration_corr = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  printf("brute force vector image1->image2: %.2f, %.2f, %.2f (%.3f s)\n",
+      img2_bf_pos_rel.x, img2_bf_pos_rel.y, img2_bf_pos_rel.z, duration_bf);
+  printf("corrected vector image1->image2:   %.2f, %.2f, %.2f (%.3f s)\n\n",
+      img2_corr_pos_rel.x, img2_corr_pos_rel.y, img2_corr_pos_rel.z, duration_corr);
+
+  cv::Point2i img2_bf_pos_img = camera_matrix.relative2image(
+      cv::Point2f(img2_bf_pos_rel.x, img2_bf_pos_rel.y) );
   cv::Point2i img2_corr_pos_img = camera_matrix.relative2image(
       cv::Point2f(img2_corr_pos_rel.x, img2_corr_pos_rel.y) );
 
+  cv::Mat img2_bf_img = image_evaluator.transform(
+      img1, img2_bf_pos_img, 0, img2_bf_pos_rel.z);
   cv::Mat img2_corr_img = image_evaluator.transform(
       img1, img2_corr_pos_img, 0, img2_corr_pos_rel.z);
 
-  printf("corrected vector image1->image2: %.2f, %.2f, %.2f \n\n",
-      img2_corr_pos_rel.x, img2_corr_pos_rel.y, img2_corr_pos_rel.z);
-
-  cv::Mat canvas2(img1.rows, 2 * img1.cols + 20, CV_8UC1, cv::Scalar(127) );
+  cv::Mat canvas2(img1.rows, 3 * img1.cols + 40, CV_8UC1, cv::Scalar(127) );
 
   img2_real_img.copyTo(canvas2(cv::Rect2i(0, 0, img1.cols, img1.rows) ) );
-  img2_corr_img.copyTo(canvas2(cv::Rect2i(img1.cols + 20, 0, img1.cols, img1.rows) ) );
+  img2_bf_img.copyTo(canvas2(cv::Rect2i(img1.cols + 20, 0, img1.cols, img1.rows) ) );
+  img2_corr_img.copyTo(canvas2(cv::Rect2i(2 * img1.cols + 40, 0, img1.cols, img1.rows) ) );
 
-  cv::imshow("img2 (real) <-> img2 (corrected, from img1)", canvas2);
+  cv::imshow("img2 (real) <-> img2 (brute force) <-> img2 (corrected)", canvas2);
   cv::waitKey(0);
 
   return 0;
@@ -2,7 +2,7 @@
 #include <opencv2/opencv.hpp>
 #include <ros/ros.h>
 #include <ros/package.h>
-#include "../map.hpp"
+#include "../grid_map.hpp"
 
 namespace cv{
   typedef Rect_<int> Rect2i;
@@ -320,14 +320,18 @@ int main(int argc, char* argv[]) {
   ros::NodeHandle nh;
 
   cps2::ImageEvaluator image_evaluator(cps2::IE_MODE_PIXELS, 1, 1, 1);
-  cps2::Map map(&image_evaluator, false, 1.0, 1, 60);
+  cps2::MapSettings map_settings;
+
+  map_settings.keep_full_res = true;
+
+  cps2::GridMap map(&image_evaluator, map_settings);
 
   fisheye_camera_matrix::CameraMatrix camera_matrix(
       (ros::package::getPath("fisheye_camera_matrix")
       + std::string("/config/default.calib") ).c_str()
   );
 
-  printf("Bild  alt        blur+abs   blur       abs        -           moment\n");
+  printf("Bild  alt        blur+abs   blur       abs        -           moment     histogram\n");
   std::string path = ros::package::getPath("cps2") + std::string("/../../../captures/img");
 for(int i = 1; i < 21; ++i) {
   std::string path_img = path + std::to_string(i) + std::string(".png");
@@ -380,7 +384,12 @@ for(int i = 1; i < 21; ++i) {
   img1.copyTo(tile1, img2_real_img);
   img2_real_img.copyTo(tile2, img1);
 
-  printf("%f\n", orientation(img1) - orientation(img2_real_img));
+  printf("%f   ", orientation(img1) - orientation(img2_real_img));
+
+  // productized version, see orientation.hpp
+  cps2::OrientationHistogram oh1(img1);
+  cps2::OrientationHistogram oh2(img2_real_img);
+  printf("%f\n", cps2::quarter_diff(oh2.angle, oh1.angle) );
 }
 /*
   // image 2 corrected guess
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "../grid_map.hpp"
+#include "../particle_filter_impl.hpp"
+
+/*
+ * Check that Particles skipped by an eval_budget can not overtake the evaluated ones.
+ *
+ * Every pose measures the same belief, but slowly, so only the first few Particles of each
+ * frame fit into the budget. The evaluated Particles are the ones with the highest previous
+ * beliefs, so no skipped Particle may end up with a higher weight than an evaluated one.
+ */
+
+const int   PARTICLES = 20;
+const int   FRAMES    = 10;
+const float BELIEF    = 0.5;   //!< belief of every measured pose
+const float BUDGET    = 0.004; //!< in s, fits about a fifth of the Particles
+
+/**
+ * Measure BELIEF for every pose, taking 1 ms each.
+ */
+class SlowMeasurement {
+public:
+  SlowMeasurement(cps2::Map *map, cps2::ImageEvaluator *image_evaluator,
+      const float belief_scale, const float heading_window) {}
+
+  void prepare(const cv::Mat &img, const std::vector<cps2::Particle> &particles) {}
+
+  bool measure(cv::Point3f &pos_world, float &belief) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1) );
+    belief = BELIEF;
+
+    return true;
+  }
+};
+
+int main(int argc, char **argv) {
+  cps2::ImageEvaluator image_evaluator(cps2::IE_MODE_PIXELS, 25, 5, 2.5);
+  cps2::MapSettings map_settings;
+  cps2::GridMap map(&image_evaluator, map_settings);
+
+  cps2::ParticleFilterT<SlowMeasurement, cps2::OdometryMotion, cps2::SystematicResampler,
+      cps2::SingleBestEstimator> pf(&map, &image_evaluator, PARTICLES, 1.0, 4.0, 0.1, 0.1,
+      false, 0, 1.0, true, cv::Point3f(0.5, 0.5, 0), BUDGET, 0, 0.9, 0.5, 0, 0, 0);
+
+  const cv::Mat img = cv::Mat::zeros(480, 640, CV_8UC1);
+  bool passed       = true;
+
+  pf.addNewRandomParticles();
+
+  for(int frame = 0; frame < FRAMES; ++frame) {
+    pf.evaluate(img);
+
+    // measured Particles have exactly BELIEF, the decayed beliefs of skipped ones are lower
+    float min_evaluated = 1;
+    float max_skipped   = 0;
+    int evaluated       = 0;
+
+    for(std::vector<cps2::Particle>::const_iterator it = pf.particles.begin();
+        it != pf.particles.end(); ++it)
+    {
+      if(it->belief == BELIEF) {
+        min_evaluated = std::min(min_evaluated, it->weight);
+        ++evaluated;
+      }
+      else
+        max_skipped = std::max(max_skipped, it->weight);
+    }
+
+    printf("frame %d: %d of %d evaluated, min weight evaluated %g, max weight skipped %g\n",
+        frame, evaluated, PARTICLES, min_evaluated, max_skipped);
+
+    // up to rounding, Particles may have been measured in another order
+    if(evaluated == PARTICLES || max_skipped > 1.001f * min_evaluated)
+      passed = false;
+  }
+
+  printf("%s\n", passed ? "passed" : "FAILED");
+
+  return passed ? 0 : 1;
+}
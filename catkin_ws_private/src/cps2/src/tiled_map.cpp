@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <ros/ros.h>
+#include "map_file.hpp"
+#include "orientation.hpp"
+#include "tiled_map.hpp"
+
+namespace cps2 {
+
+const size_t TILED_MAP_TILE_BYTES = TILED_MAP_TILE_SIZE * TILED_MAP_TILE_SIZE;
+const size_t TILED_MAP_ALIGN      = 65536; //!< alignment of levels, a multiple of page sizes
+
+TiledMap::TiledMap() :
+    fd(-1),
+    data(NULL),
+    data_size(0),
+    resize_scale(1),
+    level(0),
+    prefetch_pending(false),
+    prefetch_stop(false)
+{
+  memset(&header, 0, sizeof(header) );
+}
+
+TiledMap::~TiledMap() {
+  close();
+}
+
+bool TiledMap::build(const std::string &path_img, const std::string &path) {
+  // the source image has to fit into RAM once, lookups later only need the tiles in use
+  std::vector<cv::Mat> pyramid(1, cv::imread(path_img) );
+
+  if(pyramid[0].empty() ) {
+    ROS_ERROR("TiledMap: can not read %s", path_img.c_str() );
+    return false;
+  }
+
+  cv::cvtColor(pyramid[0], pyramid[0], CV_BGR2GRAY);
+
+  while(pyramid.size() < TILED_MAP_MAX_LEVELS
+      && (pyramid.back().cols > TILED_MAP_TILE_SIZE || pyramid.back().rows > TILED_MAP_TILE_SIZE) )
+  {
+    cv::Mat next;
+    cv::pyrDown(pyramid.back(), next);
+    pyramid.push_back(next);
+  }
+
+  const OrientationHistogram orientation(pyramid[0]);
+  TiledMapHeader header;
+
+  memset(&header, 0, sizeof(header) );
+  strncpy(header.magic, "CPS2TILE", sizeof(header.magic) );
+  header.version                = TILED_MAP_VERSION;
+  header.header_size            = sizeof(header);
+  header.tile_size              = TILED_MAP_TILE_SIZE;
+  header.levels                 = pyramid.size();
+  header.orientation_angle      = orientation.angle;
+  header.orientation_confidence = orientation.confidence;
+
+  uint64_t offset = (sizeof(header) + TILED_MAP_ALIGN - 1) & ~(uint64_t)(TILED_MAP_ALIGN - 1);
+
+  for(int l = 0; l < pyramid.size(); ++l) {
+    TiledMapLevel &level = header.level[l];
+
+    level.width   = pyramid[l].cols;
+    level.height  = pyramid[l].rows;
+    level.tiles_x = (level.width  + TILED_MAP_TILE_SIZE - 1) / TILED_MAP_TILE_SIZE;
+    level.tiles_y = (level.height + TILED_MAP_TILE_SIZE - 1) / TILED_MAP_TILE_SIZE;
+    level.offset  = offset;
+
+    offset += (uint64_t)level.tiles_x * level.tiles_y * TILED_MAP_TILE_BYTES;
+  }
+
+  header.crc = MapFile::crc32(0, &header, offsetof(TiledMapHeader, crc) );
+
+  // write to a temporary file first, so that a crash never leaves a broken file behind
+  const std::string path_tmp = path + ".tmp";
+  FILE *file = fopen(path_tmp.c_str(), "wb");
+
+  if(file == NULL) {
+    ROS_ERROR("TiledMap: can not write %s: %s", path_tmp.c_str(), strerror(errno) );
+    return false;
+  }
+
+  std::vector<uchar> tile(TILED_MAP_TILE_BYTES);
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+      && fseek(file, header.level[0].offset, SEEK_SET) == 0;
+
+  for(int l = 0; ok && l < pyramid.size(); ++l)
+    for(int ty = 0; ok && ty < header.level[l].tiles_y; ++ty)
+      for(int tx = 0; ok && tx < header.level[l].tiles_x; ++tx) {
+        const cv::Rect roi = cv::Rect(tx * TILED_MAP_TILE_SIZE, ty * TILED_MAP_TILE_SIZE,
+            TILED_MAP_TILE_SIZE, TILED_MAP_TILE_SIZE) & cv::Rect(0, 0, pyramid[l].cols,
+            pyramid[l].rows);
+
+        std::fill(tile.begin(), tile.end(), 0);
+
+        for(int r = 0; r < roi.height; ++r)
+          memcpy(&tile[r * TILED_MAP_TILE_SIZE], pyramid[l].ptr<uchar>(roi.y + r) + roi.x,
+              roi.width);
+
+        ok = fwrite(&tile[0], TILED_MAP_TILE_BYTES, 1, file) == 1;
+      }
+
+  ok = fclose(file) == 0 && ok;
+
+  if(!ok || rename(path_tmp.c_str(), path.c_str() ) != 0) {
+    ROS_ERROR("TiledMap: can not write %s: %s", path.c_str(), strerror(errno) );
+    unlink(path_tmp.c_str() );
+    return false;
+  }
+
+  ROS_INFO("TiledMap: wrote %s, %d levels, %dx%d pixels", path.c_str(), header.levels,
+      header.level[0].width, header.level[0].height);
+
+  return true;
+}
+
+bool TiledMap::open(const std::string &path, const int _resize_scale) {
+  close();
+
+  resize_scale = _resize_scale;
+  fd           = ::open(path.c_str(), O_RDONLY);
+
+  struct stat st;
+
+  if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(header) ) {
+    ROS_ERROR("TiledMap: can not open %s", path.c_str() );
+    close();
+    return false;
+  }
+
+  memset(&header, 0, sizeof(header) );
+
+  if(pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || memcmp(header.magic, "CPS2TILE", sizeof(header.magic) ) != 0
+      || header.crc != MapFile::crc32(0, &header, offsetof(TiledMapHeader, crc) )
+      || header.version != TILED_MAP_VERSION || header.tile_size != TILED_MAP_TILE_SIZE
+      || header.levels < 1 || header.levels > TILED_MAP_MAX_LEVELS)
+  {
+    ROS_ERROR("TiledMap: %s is not a valid tiled map file (version %d)", path.c_str(),
+        TILED_MAP_VERSION);
+    close();
+    return false;
+  }
+
+  const TiledMapLevel &last = header.level[header.levels - 1];
+
+  if(st.st_size < last.offset + (uint64_t)last.tiles_x * last.tiles_y * TILED_MAP_TILE_BYTES) {
+    ROS_ERROR("TiledMap: %s is truncated", path.c_str() );
+    close();
+    return false;
+  }
+
+  data_size = st.st_size;
+  void *p   = mmap(NULL, data_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if(p == MAP_FAILED) {
+    ROS_ERROR("TiledMap: can not map %s: %s", path.c_str(), strerror(errno) );
+    close();
+    return false;
+  }
+
+  // lookups touch a few tiles only. Reading ahead would page in unrelated parts of the map,
+  // the prefetcher knows better.
+  data = (uchar *)p;
+  madvise(data, data_size, MADV_RANDOM);
+
+  // the largest level not exceeding resize_scale
+  level = 0;
+
+  while(level + 1 < header.levels && (2 << level) <= resize_scale)
+    ++level;
+
+  prefetch_pending = false;
+  prefetch_stop    = false;
+  prefetched       = cv::Rect();
+  prefetcher       = std::thread(&TiledMap::prefetch_loop, this);
+
+  return true;
+}
+
+cv::Size TiledMap::size() const {
+  return cv::Size(header.level[0].width, header.level[0].height);
+}
+
+inline uchar TiledMap::pixel(const int level, const int x, const int y) const {
+  const TiledMapLevel &l = header.level[level];
+
+  if(x < 0 || y < 0 || x >= (int)l.width || y >= (int)l.height)
+    return 0;
+
+  const size_t tile = (size_t)(y >> TILED_MAP_TILE_SHIFT) * l.tiles_x + (x >> TILED_MAP_TILE_SHIFT);
+
+  return data[l.offset + tile * TILED_MAP_TILE_BYTES
+      + ( (y & (TILED_MAP_TILE_SIZE - 1) ) << TILED_MAP_TILE_SHIFT) + (x & (TILED_MAP_TILE_SIZE - 1) )];
+}
+
+cv::Mat TiledMap::transform(const cv::Point2f &center, const float th, const int rows,
+    const int cols) const
+{
+  const int dim_x   = cols / resize_scale;
+  const int dim_y   = rows / resize_scale;
+  const int cx2     = dim_x / 2;
+  const int cy2     = dim_y / 2;
+  const float f     = 1.0f / (1 << level);
+  const float step  = resize_scale * f;
+  const float ths   = sinf(th);
+  const float thc   = cosf(th);
+  // pixel i of level l covers the pixels [i * 2^l, (i + 1) * 2^l) of level 0
+  const float cx1   = (center.x + 0.5f) * f - 0.5f;
+  const float cy1   = (center.y + 0.5f) * f - 0.5f;
+
+  cv::Mat img_tf(dim_y, dim_x, CV_8UC1);
+
+  if(data == NULL) {
+    img_tf = cv::Scalar(0);
+    return img_tf;
+  }
+
+  for(int r = 0; r < dim_y; ++r) {
+    const int sy = r - cy2;
+    uchar *row   = img_tf.ptr<uchar>(r);
+
+    for(int c = 0; c < dim_x; ++c) {
+      const int sx   = c - cx2;
+      const float xx = step * (sx * thc - sy * ths) + cx1;
+      const float yy = step * (sx * ths + sy * thc) + cy1;
+      const int x0   = (int)floorf(xx);
+      const int y0   = (int)floorf(yy);
+      const uchar p00 = pixel(level, x0,     y0);
+      const uchar p01 = pixel(level, x0 + 1, y0);
+      const uchar p10 = pixel(level, x0,     y0 + 1);
+      const uchar p11 = pixel(level, x0 + 1, y0 + 1);
+
+      row[c] = 0;
+
+      // do not blend known pixels with unknown ones
+      if(p00 == 0 || p01 == 0 || p10 == 0 || p11 == 0)
+        continue;
+
+      const float fx = xx - x0;
+      const float fy = yy - y0;
+      const float v  = (1 - fy) * ( (1 - fx) * p00 + fx * p01) + fy * ( (1 - fx) * p10 + fx * p11);
+
+      row[c] = std::max(1, (int)(v + 0.5f) );
+    }
+  }
+
+  return img_tf;
+}
+
+void TiledMap::prefetch(const cv::Rect2f &area) {
+  if(data == NULL)
+    return;
+
+  const TiledMapLevel &l = header.level[level];
+  const float f          = 1.0f / (1 << level) / TILED_MAP_TILE_SIZE;
+  const int tx0 = std::max(0, (int)floorf(area.x * f) );
+  const int ty0 = std::max(0, (int)floorf(area.y * f) );
+  const int tx1 = std::min( (int)l.tiles_x - 1, (int)floorf( (area.x + area.width)  * f) );
+  const int ty1 = std::min( (int)l.tiles_y - 1, (int)floorf( (area.y + area.height) * f) );
+
+  if(tx1 < tx0 || ty1 < ty0)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+
+    prefetch_tiles   = cv::Rect(tx0, ty0, tx1 - tx0 + 1, ty1 - ty0 + 1);
+    prefetch_pending = true;
+  }
+
+  prefetch_cond.notify_one();
+}
+
+void TiledMap::prefetch_loop() {
+  const TiledMapLevel &l = header.level[level];
+  const long page_size   = sysconf(_SC_PAGESIZE);
+
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+
+  while(true) {
+    prefetch_cond.wait(lock, [this] {return prefetch_pending || prefetch_stop;});
+
+    if(prefetch_stop)
+      return;
+
+    const cv::Rect tiles = prefetch_tiles;
+    prefetch_pending     = false;
+
+    lock.unlock();
+
+    // let the kernel read all missing tiles at once, then touch every page, so that they are
+    // resident before the lookups need them. Tiles of the last request are usually resident.
+    std::vector<const uchar *> todo;
+
+    for(int ty = tiles.y; ty < tiles.y + tiles.height; ++ty)
+      for(int tx = tiles.x; tx < tiles.x + tiles.width; ++tx)
+        if(!prefetched.contains(cv::Point(tx, ty) ) ) {
+          const uchar *tile = data + l.offset + ( (size_t)ty * l.tiles_x + tx) * TILED_MAP_TILE_BYTES;
+
+          madvise( (void *)tile, TILED_MAP_TILE_BYTES, MADV_WILLNEED);
+          todo.push_back(tile);
+        }
+
+    volatile uchar sink = 0;
+
+    for(int i = 0; i < todo.size(); ++i)
+      for(size_t j = 0; j < TILED_MAP_TILE_BYTES; j += page_size)
+        sink += todo[i][j];
+
+    prefetched = tiles;
+
+    lock.lock();
+  }
+}
+
+void TiledMap::close() {
+  if(prefetcher.joinable() ) {
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex);
+      prefetch_stop = true;
+    }
+
+    prefetch_cond.notify_one();
+    prefetcher.join();
+  }
+
+  if(data != NULL)
+    munmap(data, data_size);
+
+  if(fd >= 0)
+    ::close(fd);
+
+  data      = NULL;
+  data_size = 0;
+  fd        = -1;
+}
+
+} /* namespace cps2 */
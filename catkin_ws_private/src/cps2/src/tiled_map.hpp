@@ -0,0 +1,143 @@
+#ifndef SRC_TILED_MAP_HPP_
+#define SRC_TILED_MAP_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <opencv2/core/core.hpp>
+
+namespace cps2 {
+
+const uint32_t TILED_MAP_VERSION    = 1;
+const int      TILED_MAP_TILE_SIZE  = 256; //!< edge length of tiles in pixels, a power of 2
+const int      TILED_MAP_TILE_SHIFT = 8;   //!< log2(TILED_MAP_TILE_SIZE)
+const int      TILED_MAP_MAX_LEVELS = 8;   //!< level l is downscaled by 2^l
+
+/**
+ * Dimensions of one pyramid level in a tiled map file.
+ */
+struct TiledMapLevel {
+  uint32_t width;
+  uint32_t height;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  uint64_t offset;   //!< file offset of the first tile
+};
+
+/**
+ * Header at the start of a tiled map file. The tiles of a level are stored row by row, each
+ * tile as TILED_MAP_TILE_SIZE rows of TILED_MAP_TILE_SIZE pixels. Pixels outside the image
+ * are zero (unknown).
+ */
+struct TiledMapHeader {
+  char magic[8];        //!< "CPS2TILE"
+  uint32_t version;     //!< TILED_MAP_VERSION
+  uint32_t header_size; //!< sizeof(TiledMapHeader)
+  uint32_t tile_size;   //!< TILED_MAP_TILE_SIZE
+  uint32_t levels;
+  float orientation_angle;      //!< see OrientationHistogram of the full image
+  float orientation_confidence;
+  TiledMapLevel level[TILED_MAP_MAX_LEVELS];
+  uint32_t reserved;
+  uint32_t crc;         //!< crc32 of all fields above
+};
+
+/**
+ * Out-of-core big map: a mipmap pyramid of a ceiling image, cut into tiles and memory mapped
+ * from disk. Only the tiles of the level in use, around the particles, need to be in RAM.
+ *
+ * A background thread pages in the tiles around the area passed to prefetch(), so that
+ * lookups in transform() rarely wait for the disk.
+ */
+class TiledMap {
+public:
+  TiledMap();
+  virtual ~TiledMap();
+
+  /**
+   * Cut an image into a tiled map file. Level 0 is the image itself, every further level is
+   * blurred and downscaled by 2 (cv::pyrDown), until a level fits into a single tile.
+   * @param path_img path of the image, e.g. config/map.png
+   * @param path path of the tiled map file to write
+   * @return false, if the image can not be read or the file can not be written
+   */
+  static bool build(const std::string &path_img, const std::string &path);
+
+  /**
+   * Map a tiled map file and start the prefetcher.
+   * @param path path of the tiled map file
+   * @param resize_scale lookups will downscale by this factor, see ImageEvaluator; selects the
+   *        level to read from and to prefetch
+   * @return false, if the file can not be mapped or is not a valid tiled map file
+   */
+  bool open(const std::string &path, const int resize_scale);
+
+  bool is_open() const {return data != NULL;}
+
+  /**
+   * @return size of level 0 (the original image) in pixels
+   */
+  cv::Size size() const;
+
+  /**
+   * @return header of the file, with the orientation of the whole map
+   */
+  const TiledMapHeader &getHeader() const {return header;}
+
+  /**
+   * Compute a rotated subimage, downscaled by resize_scale, like ImageEvaluator::transform().
+   * The pixels are interpolated bilinearly from the largest level not exceeding resize_scale.
+   * @param center center of the new image in pixels of level 0
+   * @param th rotate the resulting image around this angle
+   * @param rows full resolution height of the resulting image
+   * @param cols full resolution width of the resulting image
+   * @return the transformed image
+   */
+  cv::Mat transform(const cv::Point2f &center, const float th, const int rows,
+      const int cols) const;
+
+  /**
+   * Ask the prefetcher to page in all tiles of the current level overlapping an area. Returns
+   * immediately; a pending request is replaced by a newer one.
+   * @param area area in pixels of level 0
+   */
+  void prefetch(const cv::Rect2f &area);
+
+private:
+  /**
+   * Pixel of a level, 0 outside of it.
+   */
+  inline uchar pixel(const int level, const int x, const int y) const;
+
+  /**
+   * Page in the tiles requested by prefetch(), until close() is called.
+   */
+  void prefetch_loop();
+
+  /**
+   * Stop the prefetcher, unmap and close the file.
+   */
+  void close();
+
+  TiledMapHeader header;
+  int fd;
+  uchar *data;
+  size_t data_size;
+  int resize_scale;
+  int level; //!< level used by transform() and prefetch()
+
+  std::thread prefetcher;
+  std::mutex prefetch_mutex;
+  std::condition_variable prefetch_cond;
+  cv::Rect prefetch_tiles; //!< requested tiles of level, in tile indices
+  cv::Rect prefetched;     //!< last tiles paged in
+  bool prefetch_pending;
+  bool prefetch_stop;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_TILED_MAP_HPP_ */
@@ -0,0 +1,53 @@
+#include <algorithm>
+#include "visual_odometry.hpp"
+
+namespace cps2 {
+
+VisualOdometry::VisualOdometry(float _weight, int _downscale, float _budget,
+    float _min_response)
+    : weight(std::max(0.0f, std::min(1.0f, _weight) ) ),
+      downscale(std::max(1, _downscale) ),
+      budget(_budget),
+      min_response(_min_response),
+      registration(_downscale, VO_ANGLE_STEPS * VO_ANGLE_STEP, VO_ANGLE_STEP, _budget),
+      response(0)
+{
+
+}
+
+cv::Point3f VisualOdometry::update(const cv::Mat &img,
+    const fisheye_camera_matrix::CameraMatrix &camera_matrix, const float dx, const float dth)
+{
+  const cv::Point3f odom(dx, 0, dth);
+
+  response = 0;
+
+  if(weight == 0)
+    return odom;
+
+  cv::Mat cur = registration.patch(img);
+
+  if(prev.empty() || prev.size() != cur.size() ) {
+    prev = cur;
+    return odom;
+  }
+
+  // pixels of the patch per m on the ceiling
+  const float px_per_m = camera_matrix.fl / (camera_matrix.scale * camera_matrix.ceil_height)
+      * registration.getScale(img);
+
+  // the current frame is centered at shift in the previous one
+  cv::Point3f shift;
+  response = registration.align(prev, cur, dth, shift);
+  prev     = cur;
+
+  if(response < min_response)
+    return odom;
+
+  // driving forward moves the center up in the previous image, driving left moves it right
+  const cv::Point3f best(-shift.y / px_per_m, shift.x / px_per_m, shift.z);
+
+  return (1 - weight) * odom + weight * best;
+}
+
+} /* namespace cps2 */
@@ -0,0 +1,67 @@
+#ifndef SRC_VISUAL_ODOMETRY_HPP_
+#define SRC_VISUAL_ODOMETRY_HPP_
+
+#include <opencv2/core/core.hpp>
+#include "fisheye_camera_matrix/camera_matrix.hpp"
+#include "registration.hpp"
+
+namespace cps2 {
+
+/**
+ * Angular resolution (in radians) and number of steps to each side of the odometry heading
+ * change, that are tried when registering two frames.
+ */
+const float VO_ANGLE_STEP  = 0.02;
+const int   VO_ANGLE_STEPS = 2;
+
+/**
+ * Estimate the motion of the car between consecutive ceiling images and fuse it with the wheel
+ * odometry to get a tighter motion proposal for the ParticleFilter.
+ *
+ * Consecutive frames are registered by a Registration engine, with the odometry heading change
+ * as the guess. Only the patch of the previous frame is kept.
+ */
+class VisualOdometry {
+public:
+  /**
+   * @param _weight weight of the visual estimate when fusing it with odometry, in [0, 1].
+   *        Choose 0 to disable visual odometry.
+   * @param _downscale reduce the images by this factor before registration
+   * @param _budget time budget (in s) per frame. The odometry heading is always tried, further
+   *        angles only while time is left.
+   * @param _min_response correlation peaks below this value are not trusted
+   */
+  VisualOdometry(float _weight, int _downscale, float _budget, float _min_response);
+
+  /**
+   * Register img against the previous image and fuse the result with odometry.
+   *
+   * @param img new undistorted, grayscale image
+   * @param camera_matrix current camera matrix
+   * @param dx distance (in m) traveled straight ahead since the previous image, by odometry
+   * @param dth heading change (in radians) since the previous image, by odometry
+   * @return fused motion (forward, left, heading change), in the frame of the car. Without a
+   *         previous image or a trustworthy registration, this is just the odometry.
+   */
+  cv::Point3f update(const cv::Mat &img, const fisheye_camera_matrix::CameraMatrix &camera_matrix,
+      const float dx, const float dth);
+
+  /**
+   * @return correlation peak of the last registration, 0 if there was none
+   */
+  float getResponse() const {return response;}
+
+  const float weight;
+  const int downscale;
+  const float budget;
+  const float min_response;
+
+private:
+  Registration registration;
+  float response;
+  cv::Mat prev;
+};
+
+} /* namespace cps2 */
+
+#endif /* SRC_VISUAL_ODOMETRY_HPP_ */
@@ -1,3 +1,6 @@
+#ifndef FISHEYE_CAMERA_MATRIX_CAMERA_MATRIX_HPP_
+#define FISHEYE_CAMERA_MATRIX_CAMERA_MATRIX_HPP_
+
 #include <opencv2/core/core.hpp>
 
 #include "fisheye_camera_matrix_msgs/CameraMatrix.h"
@@ -30,3 +33,5 @@ public:
   float scale;
 };
 }
+
+#endif